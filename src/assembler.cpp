@@ -4,12 +4,17 @@
 #include <fstream>
 #include <cstdarg>
 
+#include "image.h"
 #include "support/format/format.h"
 
 using namespace std;
 using namespace Assembler;
 
-J80Assembler::J80Assembler() : dataSegment(DataSegment()), codeSegment(CodeSegment()), position(0)
+constexpr u16 J80Assembler::BANK_WINDOW_BASE;
+constexpr u32 J80Assembler::BANK_WINDOW_SIZE;
+constexpr u32 J80Assembler::MAX_BANKS;
+
+J80Assembler::J80Assembler() : dataSegment(DataSegment()), codeSegment(CodeSegment()), bank(DataSegmentEntry::NO_BANK), position(0), logLevel(Log::VERBOSE_INFO)
 {
   
 }
@@ -25,6 +30,8 @@ bool J80Assembler::parse(const std::string &filename)
   position = 0;
   dataSegment = DataSegment();
   codeSegment = CodeSegment();
+  banks.clear();
+  bank = DataSegmentEntry::NO_BANK;
 
   file = filename;
   
@@ -50,6 +57,35 @@ void J80Assembler::error (const std::string& m)
   log(Log::ERROR, true, "Assembler error: {}", m);
 }
 
+/* hex and ascii dump, 8 bytes per line */
+static void printData(std::ostream& out, u16 address, const u8* data, u16 dataLen)
+{
+  for (int i = 0; i < dataLen / 8 + (dataLen % 8 != 0 ? 1 : 0); ++i)
+  {
+    out << fmt::format("{:04X}: ", address + i*8);
+    
+    for (int j = 0; j < 8; ++j)
+    {
+      if (i*8+j < dataLen)
+        out << fmt::format("{:02X}", data[i*8 + j]);
+      else
+        out << fmt::format("  ");
+    }
+    
+    out << fmt::format(" ");
+    
+    for (int j = 0; j < 8; ++j)
+    {
+      if (i*8+j < dataLen &&  data[i*8 + j] >= 0x20 && data[i*8 + j] <= 0x7E)
+        out << fmt::format("{}", (char)data[i*8 + j]);
+      else
+        out << fmt::format(" ");
+    }
+    
+    out << fmt::format("\n");
+  }
+}
+
 void J80Assembler::printProgram(std::ostream& out) const
 {
   bool keepLabels = true;
@@ -98,45 +134,47 @@ void J80Assembler::printProgram(std::ostream& out) const
     label = nullptr;
   }
   
-  u16 dataLen = dataSegment.length;
-  for (int i = 0; i < dataLen / 8 + (dataLen % 8 != 0 ? 1 : 0); ++i)
+  printData(out, address, dataSegment.data, dataSegment.length);
+  
+  for (const auto& bank : banks)
   {
-    out << fmt::format("{:04X}: ", address + i*8);
-    
-    for (int j = 0; j < 8; ++j)
-    {
-      if (i*8+j < dataLen)
-        out << fmt::format("{:02X}", dataSegment.data[i*8 + j]);
-      else
-        out << fmt::format("  ");
-    }
-    
-    out << fmt::format(" ");
-    
-    for (int j = 0; j < 8; ++j)
-    {
-      if (i*8+j < dataLen &&  dataSegment.data[i*8 + j] >= 0x20 && dataSegment.data[i*8 + j] <= 0x7E)
-        out << fmt::format("{}", (char)dataSegment.data[i*8 + j]);
-      else
-        out << fmt::format(" ");
-    }
-    
-    out << fmt::format("\n");
+    out << fmt::format("bank {}:\n", bank.first);
+    printData(out, bank.second.offset, bank.second.data, bank.second.length);
   }
 }
 
-void J80Assembler::buildDataSegment()
+Result J80Assembler::buildDataSegment()
 {
-  /* for each entry specified as data compute total size in bytes of segment */
+  /* for each entry specified as data compute total size in bytes of segment, banked
+     entries are counted in their own bank */
   u16 totalSize = 0;
+  std::map<u8, u32> bankSizes;
+  
   for (auto &entry : data)
-    totalSize += entry->second.length;
+  {
+    if (entry->second.isBanked())
+      bankSizes[entry->second.bank] += entry->second.length;
+    else
+      totalSize += entry->second.length;
+  }
   
   log(Log::INFO, true, "Building data segment, total size: {} bytes", totalSize);
   
   dataSegment.alloc(totalSize);
   
+  for (const auto& size : bankSizes)
+  {
+    if (size.second > BANK_WINDOW_SIZE)
+      return Result(fmt::format("bank {} holds {} bytes of data, more than the {} bytes of the bank window.", size.first, size.second, BANK_WINDOW_SIZE));
+    
+    log(Log::INFO, true, "Building bank {}, total size: {} bytes", size.first, size.second);
+    
+    banks[size.first].alloc(size.second);
+    banks[size.first].offset = BANK_WINDOW_BASE;
+  }
+  
   totalSize = 0;
+  bankSizes.clear();
   
   /* copy data from data entry to final data segment at correct offset and save
      the offset to solve references to it when assembling code
@@ -144,6 +182,19 @@ void J80Assembler::buildDataSegment()
   for (auto &entry : data)
   {
     const auto* data = entry->second.getData();
+    
+    if (entry->second.isBanked())
+    {
+      u32& bankSize = bankSizes[entry->second.bank];
+      std::copy(data, data + entry->second.length, &banks[entry->second.bank].data[bankSize]);
+      entry->second.offset = BANK_WINDOW_BASE + bankSize;
+      
+      log(Log::VERBOSE_INFO, true, "  > Data {} ({} bytes) in bank {} at {:4X}h", entry->first, entry->second.length, entry->second.bank, entry->second.offset);
+      
+      bankSize += entry->second.length;
+      continue;
+    }
+    
     std::copy(data, data + entry->second.length, &dataSegment.data[totalSize]);
     entry->second.offset = totalSize;
     
@@ -151,6 +202,8 @@ void J80Assembler::buildDataSegment()
     
     totalSize += entry->second.length;
   }
+  
+  return Result();
 }
 
 void J80Assembler::buildCodeSegment()
@@ -316,6 +369,31 @@ Result J80Assembler::solveJumps()
   return Result();
 }
 
+/* labels, source lines and data entries of the assembled program, with the same
+   addresses they have once loaded */
+void J80Assembler::buildSymbols()
+{
+  symbolTable.clear();
+  
+  u16 sourceFile = symbolTable.addFile(file);
+  u16 address = codeSegment.offset;
+  
+  for (const auto& i : instructions)
+  {
+    const Label* label = dynamic_cast<Label*>(i.get());
+    
+    if (label)
+      symbolTable.addLabel(label->getLabel(), address);
+    else if (i->getLength() && i->getSourceLine())
+      symbolTable.addLine(address, sourceFile, i->getSourceLine());
+    
+    address += i->getLength();
+  }
+  
+  for (const auto& entry : data)
+    symbolTable.addData(entry->first, entry->second.address(dataSegment.offset), entry->second.length);
+}
+
 Result J80Assembler::solveDataReferences()
 {  
   u16 base = computeDataSegmentOffset();
@@ -358,3 +436,29 @@ void J80Assembler::saveBinary(const std::string &filename) const
   
   fclose(bin);
 }
+
+/* the image keeps everything saveBinary drops: where the program starts, its stack,
+   its interrupts, its banks and its symbols */
+bool J80Assembler::saveImage(const std::string &filename) const
+{
+  image::ImageBuilder builder;
+  
+  builder.addRam(0, codeSegment.data, codeSegment.length);
+  builder.addRam(dataSegment.offset, dataSegment.data, dataSegment.length);
+  
+  for (const auto& bank : banks)
+    builder.addBank(bank.first, bank.second.offset - BANK_WINDOW_BASE, bank.second.data, bank.second.length);
+  
+  builder.setEntryPoint(entryPoint.isSet() ? entryPoint.get() : 0);
+  
+  if (stackBase.isSet())
+    builder.setStackBase(stackBase.get());
+  
+  u8 interrupts = 0;
+  for (int i = 0; i < maxNumberOfInterrupts(); ++i)
+    interrupts |= irqs[i] ? 1 << i : 0;
+  
+  builder.setInterrupts(interrupts);
+  builder.setSymbols(symbolTable.serialize());
+  return builder.save(filename);
+}
@@ -8,6 +8,7 @@
 #include <unordered_map>
 #include <vector>
 #include <list>
+#include <map>
 #include <iostream>
 
 #include "assembler/j80lexer.h"
@@ -18,6 +19,7 @@
 
 #include "instruction.h"
 #include "opcodes.h"
+#include "symbols.h"
 
 enum class Log
 {
@@ -76,6 +78,12 @@ namespace Assembler
   
   class J80Assembler
   {
+  public:
+    /* data placed with .bank goes in extended RAM, seen through the window of vm::BankedRam */
+    static constexpr u16 BANK_WINDOW_BASE = 0x8000;
+    static constexpr u32 BANK_WINDOW_SIZE = 0x4000;
+    static constexpr u32 MAX_BANKS = 256;
+    
   private:    
     u16 position;
     std::list<std::unique_ptr<Instruction>> instructions;
@@ -93,11 +101,25 @@ namespace Assembler
     DataSegment dataSegment;
     CodeSegment codeSegment;
     
+    /* bank receiving the data declared from now on */
+    u32 bank;
+    std::map<u8, DataSegment> banks;
+    
+    symbols::SymbolTable symbolTable;
+    
+    Log logLevel;
+    
   public:
     J80Assembler();
     
+    /* messages less important than level are discarded */
+    void setLogLevel(Log level) { logLevel = level; }
+    
     template<typename... Args> void log(Log l, bool newline, const std::string& format, Args... args) const
     {
+      if (l > logLevel)
+        return;
+      
       auto& out = l == Log::ERROR ? std::cerr : std::cout;
       
       out << fmt::format(format, args...);
@@ -121,6 +143,16 @@ namespace Assembler
     bool setStackBase(u16 address) { return stackBase.set(address); }
     bool setEntryPoint(u16 address) { return entryPoint.set(address); }
     
+    /* NO_BANK goes back to the data segment */
+    bool setBank(u32 bank)
+    {
+      if (bank != DataSegmentEntry::NO_BANK && bank >= MAX_BANKS)
+        return false;
+      
+      this->bank = bank;
+      return true;
+    }
+    
     Instruction* preamble(u32 len)
     {
       return new Instruction(len);
@@ -138,10 +170,22 @@ namespace Assembler
       position += i->getLength();
       instructions.push_back(std::unique_ptr<Instruction>(i));
     }
+    
+    /* assigns line to every instruction added since the previous call */
+    void setSourceLine(u32 line)
+    {
+      for (auto it = instructions.rbegin(); it != instructions.rend() && (*it)->getSourceLine() == 0; ++it)
+        (*it)->setSourceLine(line);
+    }
 
     void addData(const std::string& label, const DataSegmentEntry& entry)
     {
-      data.lru.push_back(data.map.insert(std::make_pair(label, entry)).first);
+      auto inserted = data.map.insert(std::make_pair(label, entry));
+      
+      if (inserted.second)
+        inserted.first->second.bank = bank;
+      
+      data.lru.push_back(inserted.first);
     }
 
     void addConstValue(const std::string& label, u16 value)
@@ -151,10 +195,11 @@ namespace Assembler
     
     void prepareSource();
     
-    void buildDataSegment();
+    Result buildDataSegment();
     void buildCodeSegment();
     Result solveDataReferences();
     Result solveJumps();
+    void buildSymbols();
     
     u16 computeDataSegmentOffset()
     {
@@ -175,7 +220,7 @@ namespace Assembler
       
       prepareSource();
       
-      buildDataSegment();
+      result = buildDataSegment();
       
       if (result)
         result = solveDataReferences();
@@ -185,11 +230,17 @@ namespace Assembler
       buildCodeSegment();
       dataSegment.offset = codeSegment.length + codeSegment.offset;
       
+      if (result)
+        buildSymbols();
+      
       return result;
     }
     
     const DataSegment& getDataSegment() { return dataSegment; }
     const CodeSegment& getCodeSegment() { return codeSegment; }
+    /* offsets of bank segments are addresses inside the bank window */
+    const std::map<u8, DataSegment>& getBanks() { return banks; }
+    const symbols::SymbolTable& getSymbols() const { return symbolTable; }
     
     std::list<std::unique_ptr<Instruction>>::const_iterator iterator() { return instructions.begin(); }
     bool hasNext(std::list<std::unique_ptr<Instruction>>::const_iterator it) { return it  != instructions.end(); }
@@ -197,6 +248,8 @@ namespace Assembler
     void printProgram(std::ostream& out) const;
     void saveForLogisim(const std::string& filename) const;
     void saveBinary(const std::string& filename) const;
+    bool saveImage(const std::string& filename) const;
+    bool saveSymbols(const std::string& filename) const { return symbolTable.save(filename); }
   };
   
 }
@@ -97,6 +97,10 @@
   EI
   DI
   SEXT
+  MUL
+  DIV
+  COPY
+  FILL
   NOP
   DATA_ASCII ".ascii"
   DATA_ASCIIZ ".asciiz"
@@ -108,6 +112,7 @@
   ENTRY ".entry"
   INTERRUPT ".interrupt"
   STACK_BASE ".stackbase"
+  BANK ".bank"
 ;
 
 %type<Value8> value8
@@ -132,7 +137,7 @@ start:
 ;
 
 instructions:
-  | instructions instruction { }
+  | instructions instruction { assembler.setSourceLine(@2.begin.line); }
   | instructions EOL { }
   /*| instructions label EOL { }*/
 ;
@@ -196,6 +201,19 @@ instruction:
   assembler.add(new InstructionSEXT($2));
 }
 
+/* MUL P, R, S - MUL P, Q, O */
+| MUL REG16 COMMA REG8 COMMA REG8 { assembler.add(new InstructionEXT($2, $4, $6, ExtOp::MUL8)); }
+| MUL REG16 COMMA REG16 COMMA REG16 { assembler.add(new InstructionEXT($2, $4, $6, ExtOp::MUL16)); }
+| MUL REG16 COMMA REG16 { assembler.add(new InstructionEXT($2, $2, $4, ExtOp::MUL16)); }
+
+/* DIV P, Q, R */
+| DIV REG16 COMMA REG16 COMMA REG8 { assembler.add(new InstructionEXT($2, $4, $6, ExtOp::DIV8)); }
+| DIV REG16 COMMA REG8 { assembler.add(new InstructionEXT($2, $2, $4, ExtOp::DIV8)); }
+
+/* COPY P, Q, O - FILL P, R, O */
+| COPY REG16 COMMA REG16 COMMA REG16 { assembler.add(new InstructionEXT($2, $4, $6, ExtOp::COPY)); }
+| FILL REG16 COMMA REG8 COMMA REG16 { assembler.add(new InstructionEXT($2, $4, $6, ExtOp::FILL)); }
+
 | JMP address { assembler.add(new InstructionJMP_NNNN($1, $2)); }
 | JMP REG16 { assembler.add(new InstructionJMP_PP($1, (Reg)$2)); }
 | CALL address { assembler.add(new InstructionCALL_NNNN($1, $2)); }
@@ -259,6 +277,14 @@ instruction:
   
 }
 
+/* data declared after .bank N goes in extended RAM bank N, a plain .bank goes back to the data segment */
+| BANK U16 {
+  if (!assembler.setBank($2)) {
+    error(@1, "bank index specified over maximum allowed index"); YYERROR;
+  }
+}
+| BANK { assembler.setBank(DataSegmentEntry::NO_BANK); }
+
 /* label */
 | STRING COLON {
   if ($1.size() >= 2 && $1[0] == '_' && $1[1] == '_')
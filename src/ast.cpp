@@ -31,6 +31,9 @@ const Type* ASTBinaryExpression::getType(const SymbolTable& table) const
   switch (op) {
     case Binary::ADDITION:
     case Binary::SUBTRACTION:
+    case Binary::MULTIPLICATION:
+    case Binary::DIVISION:
+    case Binary::MODULO:
       
     case Binary::AND:
     case Binary::XOR:
@@ -59,6 +59,8 @@
   LBRACK "["
   RBRACK "]"
   STAR "*"
+  SLASH "/"
+  PERCENT "%"
   EQUAL "="
   PLUS "+"
   MINUS "-"
@@ -174,7 +176,9 @@
 %left LAND
 %left COMP
 %left PLUS MINUS
+%left STAR SLASH PERCENT
 %right UMINUS
+%left DOT ARROW LBRACK
 
 %%
 
@@ -347,6 +351,9 @@ expression:
   | LPAREN expression RPAREN { $$ = $2; }
   | expression PLUS expression { $$ = new ASTBinaryExpression(@1, Binary::ADDITION, $1, $3); }
   | expression MINUS expression { $$ = new ASTBinaryExpression(@1, Binary::SUBTRACTION, $1, $3); }
+  | expression STAR expression { $$ = new ASTBinaryExpression(@1, Binary::MULTIPLICATION, $1, $3); }
+  | expression SLASH expression { $$ = new ASTBinaryExpression(@1, Binary::DIVISION, $1, $3); }
+  | expression PERCENT expression { $$ = new ASTBinaryExpression(@1, Binary::MODULO, $1, $3); }
   | expression AND expression { $$ = new ASTBinaryExpression(@1, Binary::AND, $1, $3); }
   | expression OR expression { $$ = new ASTBinaryExpression(@1, Binary::OR, $1, $3); }
   | expression XOR expression { $$ = new ASTBinaryExpression(@1, Binary::XOR, $1, $3); }
@@ -361,8 +368,8 @@ expression:
   | AND expression { $$ = new ASTUnaryExpression(@1, Unary::ADDRESSOF, $2); }
 
   | MINUS expression %prec UMINUS { $$ = new ASTUnaryExpression(@1, Unary::NEG, $2); }
-  | BANG expression { $$ = new ASTUnaryExpression(@1, Unary::NOT, $2); }
-  | TILDE expression { $$ = new ASTUnaryExpression(@1, Unary::FLIP, $2); }
+  | BANG expression %prec UMINUS { $$ = new ASTUnaryExpression(@1, Unary::NOT, $2); }
+  | TILDE expression %prec UMINUS { $$ = new ASTUnaryExpression(@1, Unary::FLIP, $2); }
 
 ;
 
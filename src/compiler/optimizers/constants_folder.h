@@ -35,6 +35,27 @@ namespace nanoc::optimizer
           break;
         }
 
+        /* MUL, DIV and MOD operate on unsigned 16 bit words, folding must yield the same value */
+        case Binary::MULTIPLICATION:
+        {
+          u16 product = u16(u32(u16(o1->getValue())) * u16(o2->getValue()));
+          folded = new ASTNumber(node->getLocation(), product);
+          break;
+        }
+
+        /* a division by zero is left to the hardware, which flags it at runtime */
+        case Binary::DIVISION:
+        case Binary::MODULO:
+        {
+          u16 dividend = u16(o1->getValue()), divisor = u16(o2->getValue());
+          if (divisor != 0)
+          {
+            u16 result = op == Binary::DIVISION ? dividend / divisor : dividend % divisor;
+            folded = new ASTNumber(node->getLocation(), result);
+          }
+          break;
+        }
+
         /* if two constants are equal we can fold them to the result */
         case Binary::EQ:
         {
@@ -190,6 +190,9 @@ namespace rtl
       {
         case nanoc::Binary::ADDITION: sop = "+"; break;
         case nanoc::Binary::SUBTRACTION: sop = "-"; break;
+        case nanoc::Binary::MULTIPLICATION: sop = "*"; break;
+        case nanoc::Binary::DIVISION: sop = "/"; break;
+        case nanoc::Binary::MODULO: sop = "%"; break;
 
         case nanoc::Binary::EQ: sop = "=="; break;
         case nanoc::Binary::NEQ: sop = "!="; break;
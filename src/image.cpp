@@ -0,0 +1,186 @@
+#include "image.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "vm.h"
+#include "vm/banked.h"
+
+using namespace image;
+
+static const char IMAGE_MAGIC[4] = { 'J', '8', '0', 'I' };
+static constexpr u16 IMAGE_VERSION = 1;
+
+ImageBuilder::ImageBuilder() : ram(VM::MEMORY_SIZE, 0), entryPoint(0), stackBase(0), flags(0), interrupts(0) { }
+
+void ImageBuilder::addRam(u16 address, const u8* data, size_t length)
+{
+  length = std::min<size_t>(length, VM::MEMORY_SIZE - address);
+  std::copy(data, data + length, ram.begin() + address);
+}
+
+void ImageBuilder::addBank(u8 bank, u16 offset, const u8* data, size_t length)
+{
+  banks.push_back({ bank, offset, std::vector<u8>(data, data + length) });
+}
+
+bool ImageBuilder::save(const std::string& filename) const
+{
+  /* runs of consecutive pages holding at least a non zero byte */
+  std::vector<Segment> segments;
+
+  for (u32 page = 0; page < VM::MEMORY_SIZE; page += PAGE_ALIGNMENT)
+  {
+    if (std::all_of(ram.begin() + page, ram.begin() + page + PAGE_ALIGNMENT, [] (u8 value) { return value == 0; }))
+      continue;
+
+    if (!segments.empty() && segments.back().address + segments.back().length == page)
+      segments.back().length += PAGE_ALIGNMENT;
+    else
+      segments.push_back({ 0, PAGE_ALIGNMENT, u16(page), NO_BANK });
+  }
+
+  u32 ramSegments = segments.size();
+
+  for (const Bank& bank : banks)
+    segments.push_back({ 0, u32(bank.data.size()), bank.offset, bank.bank });
+
+  auto align = [] (u32 offset, u32 alignment) { return (offset + alignment - 1) / alignment * alignment; };
+
+  u32 offset = align(sizeof(Header) + sizeof(Segment) * segments.size(), PAGE_ALIGNMENT);
+
+  for (Segment& segment : segments)
+  {
+    segment.offset = offset;
+    offset += segment.length;
+  }
+
+  Header header;
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.flags = flags;
+  header.entryPoint = entryPoint;
+  header.stackBase = stackBase;
+  header.interrupts = interrupts;
+  header.reserved = 0;
+  header.segmentCount = segments.size();
+  header.symbolsOffset = symbols.empty() ? 0 : align(offset, 8);
+  header.symbolsSize = symbols.size();
+
+  std::vector<u8> contents;
+  auto append = [&contents] (const void* data, size_t length) {
+    contents.insert(contents.end(), static_cast<const u8*>(data), static_cast<const u8*>(data) + length);
+  };
+
+  append(&header, sizeof(Header));
+  append(segments.data(), sizeof(Segment) * segments.size());
+
+  for (u32 i = 0; i < segments.size(); ++i)
+  {
+    contents.resize(segments[i].offset, 0);
+
+    if (i < ramSegments)
+      append(&ram[segments[i].address], segments[i].length);
+    else
+      append(banks[i - ramSegments].data.data(), segments[i].length);
+  }
+
+  if (!symbols.empty())
+  {
+    contents.resize(header.symbolsOffset, 0);
+    append(symbols.data(), symbols.size());
+  }
+
+  FILE* out = fopen(filename.c_str(), "wb");
+
+  if (!out)
+    return false;
+
+  fwrite(contents.data(), 1, contents.size(), out);
+  return fclose(out) == 0;
+}
+
+bool Image::open(const std::string& filename)
+{
+  close();
+
+  if (!file.openReadOnly(filename))
+    return false;
+
+  const u8* contents = file.bytes();
+  size_t size = file.length();
+  const Header* header = reinterpret_cast<const Header*>(contents);
+
+  if (size < sizeof(Header) || memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->version != IMAGE_VERSION
+    || size < sizeof(Header) + sizeof(Segment) * header->segmentCount || u64(header->symbolsOffset) + header->symbolsSize > size)
+  {
+    close();
+    return false;
+  }
+
+  const Segment* segments = reinterpret_cast<const Segment*>(contents + sizeof(Header));
+
+  for (u32 i = 0; i < header->segmentCount; ++i)
+  {
+    const Segment& segment = segments[i];
+    bool valid = u64(segment.offset) + segment.length <= size;
+
+    if (segment.bank == NO_BANK)
+      valid &= segment.address % PAGE_ALIGNMENT == 0 && segment.offset % PAGE_ALIGNMENT == 0 && segment.length % PAGE_ALIGNMENT == 0 && segment.address + segment.length <= VM::MEMORY_SIZE;
+    else
+      valid &= segment.bank < vm::BankedRam::MAX_BANKS;
+
+    if (!valid)
+    {
+      close();
+      return false;
+    }
+  }
+
+  this->header = header;
+  this->segments = segments;
+  return true;
+}
+
+void Image::close()
+{
+  file.close();
+  header = nullptr;
+  segments = nullptr;
+}
+
+bool Image::hasBanks() const
+{
+  for (u32 i = 0; i < header->segmentCount; ++i)
+  {
+    if (segments[i].bank != NO_BANK)
+      return true;
+  }
+
+  return false;
+}
+
+bool Image::openSymbols(symbols::SymbolMap& map) const
+{
+  return header->symbolsSize && header->symbolsOffset % 8 == 0 && map.open(file.bytes() + header->symbolsOffset, header->symbolsSize);
+}
+
+void Image::load(VM& vm, vm::BankedRam* banks) const
+{
+  for (u32 i = 0; i < header->segmentCount; ++i)
+  {
+    const Segment& segment = segments[i];
+
+    if (segment.bank == NO_BANK)
+      vm.mapRam(file, segment.offset, segment.address, segment.length);
+    else if (banks)
+      banks->load(segment.bank, segment.address, contents(segment), segment.length);
+  }
+
+  Regs& regs = vm.allRegs();
+  regs.PC = header->entryPoint;
+
+  if (hasStackBase())
+    regs.SP = header->stackBase;
+}
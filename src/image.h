@@ -0,0 +1,139 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include "utils.h"
+#include "symbols.h"
+#include "vm/memory.h"
+
+#include <string>
+#include <vector>
+
+class VM;
+
+namespace vm
+{
+  class BankedRam;
+}
+
+/* .img files are written by the assembler and hold everything needed to run a
+   program without the assembler, RAM is stored as whole pages of the address space
+   at page aligned offsets of the file so a loader can map them in place, pages
+   left out are zero
+
+   header: "J80I", u16 version, u16 flags, u16 entry point, u16 stack base,
+   u8 mask of the used interrupts, u8 reserved, u16 segment count, u32 offset and
+   u32 size of the symbols, then:
+
+   segments  u32 offset in the file, u32 length, u16 address, u16 bank
+             RAM segments have bank NO_BANK and cover whole pages, banked segments
+             have the offset inside their bank as address
+   contents  bytes of the segments
+   symbols   a whole .sym file (see symbols.h) 8 bytes aligned, absent if its size is 0
+
+   everything is little endian */
+namespace image
+{
+  static constexpr u32 PAGE_ALIGNMENT = 0x1000;
+  static constexpr u16 NO_BANK = 0xFFFF;
+
+  enum Flags : u16
+  {
+    HAS_STACK_BASE = 0x0001
+  };
+
+  struct Header
+  {
+    char magic[4];
+    u16 version;
+    u16 flags;
+    u16 entryPoint;
+    u16 stackBase;
+    u8 interrupts;
+    u8 reserved;
+    u16 segmentCount;
+    u32 symbolsOffset;
+    u32 symbolsSize;
+  };
+
+  struct Segment
+  {
+    u32 offset;
+    u32 length;
+    u16 address;
+    u16 bank;
+  };
+
+  static_assert(sizeof(Header) == 24 && sizeof(Segment) == 12, "image records must be packed");
+
+  /* collects the contents of an image, RAM can be added in any order and overlapping
+     writes keep the last bytes */
+  class ImageBuilder
+  {
+  private:
+    struct Bank
+    {
+      u8 bank;
+      u16 offset;
+      std::vector<u8> data;
+    };
+
+    std::vector<u8> ram;
+    std::vector<Bank> banks;
+    std::vector<u8> symbols;
+    u16 entryPoint;
+    u16 stackBase;
+    u16 flags;
+    u8 interrupts;
+
+  public:
+    ImageBuilder();
+
+    void setEntryPoint(u16 address) { entryPoint = address; }
+    void setStackBase(u16 address) { stackBase = address; flags |= HAS_STACK_BASE; }
+    void setInterrupts(u8 mask) { interrupts = mask; }
+    void setSymbols(std::vector<u8> symbols) { this->symbols = std::move(symbols); }
+
+    /* bytes past the end of the address space are dropped */
+    void addRam(u16 address, const u8* data, size_t length);
+    void addBank(u8 bank, u16 offset, const u8* data, size_t length);
+
+    bool save(const std::string& filename) const;
+  };
+
+  /* an image mapped read only, shared by every VM it is loaded in */
+  class Image
+  {
+  private:
+    vm::FileMapping file;
+    const Header* header;
+    const Segment* segments;
+
+  public:
+    Image() : header(nullptr), segments(nullptr) { }
+    ~Image() { close(); }
+
+    bool open(const std::string& filename);
+    void close();
+    bool isOpen() const { return header != nullptr; }
+
+    u16 entryPoint() const { return header->entryPoint; }
+    bool hasStackBase() const { return header->flags & HAS_STACK_BASE; }
+    u16 stackBase() const { return header->stackBase; }
+    u8 interrupts() const { return header->interrupts; }
+
+    u32 segmentCount() const { return header->segmentCount; }
+    const Segment& segment(u32 index) const { return segments[index]; }
+    const u8* contents(const Segment& segment) const { return file.bytes() + segment.offset; }
+    bool hasBanks() const;
+
+    /* the map stays valid while the image is open */
+    bool openSymbols(symbols::SymbolMap& map) const;
+
+    /* maps the RAM pages of the image over the VM memory and sets PC, and SP if the
+       image has a stack base, pages not in the image are left as they are, banked
+       segments are skipped without banks */
+    void load(VM& vm, vm::BankedRam* banks = nullptr) const;
+  };
+}
+
+#endif
@@ -224,8 +224,8 @@ Result InstructionXXX_NNNN<RegType>::solve(const Environment &env)
       
       if (it != env.data.map.end())
       {
-        env.assembler.log(Log::INFO, true, "  > Data address referenced '{}' ({:04X}{:+d}) value", value.label, it->second.offset + env.dataSegmentBase, value.offset);
-        value.value = it->second.offset + env.dataSegmentBase + value.offset;
+        env.assembler.log(Log::INFO, true, "  > Data address referenced '{}' ({:04X}{:+d}) value", value.label, it->second.address(env.dataSegmentBase), value.offset);
+        value.value = it->second.address(env.dataSegmentBase) + value.offset;
       }
       else
       {
@@ -365,6 +365,33 @@ void InstructionALU_R_NN::assemble(byte* dest) const
   dest[2] = value.value;
 }
 
+#pragma mark EXT
+/****************************
+ * MUL P, R, S
+ * MUL P, Q, O
+ * DIV P, Q, R
+ * COPY P, Q, O
+ * FILL P, R, O
+ ****************************/
+std::string InstructionEXT::mnemonic() const
+{
+  switch (op)
+  {
+    case ExtOp::MUL8: return fmt::format("{} {}, {}, {}", Opcodes::extName(op), Opcodes::reg16(dst), Opcodes::reg8(src1), Opcodes::reg8(src2));
+    case ExtOp::MUL16:
+    case ExtOp::COPY: return fmt::format("{} {}, {}, {}", Opcodes::extName(op), Opcodes::reg16(dst), Opcodes::reg16(src1), Opcodes::reg16(src2));
+    case ExtOp::FILL: return fmt::format("{} {}, {}, {}", Opcodes::extName(op), Opcodes::reg16(dst), Opcodes::reg8(src1), Opcodes::reg16(src2));
+    default: return fmt::format("{} {}, {}, {}", Opcodes::extName(op), Opcodes::reg16(dst), Opcodes::reg16(src1), Opcodes::reg8(src2));
+  }
+}
+
+void InstructionEXT::assemble(byte* dest) const
+{
+  dest[0] = (OPCODE_EXT << 3) | dst;
+  dest[1] = (src1 << 5) | static_cast<u8>(op);
+  dest[2] = (src2 << 5);
+}
+
 #pragma mark XXX R, [PP]
 void InstructionXXX_PTR_PP::assemble(u8* dest) const
 {
@@ -487,5 +514,7 @@ Instruction* Instruction::disassemble(const u8* code)
     case OPCODE_RET: return new InstructionRET(condition);
     case OPCODE_CALLC: return new InstructionCALL_NNNN(condition, uint16l);
     case OPCODE_CALL: return new InstructionCALL_NNNN(condition, uint16l);
+
+    case OPCODE_EXT: return new InstructionEXT(reg1, reg2, reg3, ExtOp(alu));
   }
 }
\ No newline at end of file
@@ -19,27 +19,33 @@ namespace Assembler
 #pragma mark Environment
   struct DataSegmentEntry
   {
+    static constexpr u32 NO_BANK = 0xFFFFFFFF;
+    
     std::unique_ptr<u8[]> data;
     u32 length;
+    /* from the data segment base, or absolute inside the bank window for banked data */
     u32 offset;
+    u32 bank;
     
-    DataSegmentEntry(DataSegmentEntry&& other) : data(std::move(other.data)), length(other.length), offset(other.offset)
+    DataSegmentEntry(DataSegmentEntry&& other) : data(std::move(other.data)), length(other.length), offset(other.offset), bank(other.bank)
     {
       
     }
     
     DataSegmentEntry(const DataSegmentEntry& other) : DataSegmentEntry(other.length, other.offset)
     {
+      bank = other.bank;
       std::copy(other.data.get(), other.data.get()+length, data.get());
     }
     
-    DataSegmentEntry() : data(nullptr), length(0), offset(0) { }
+    DataSegmentEntry() : data(nullptr), length(0), offset(0), bank(NO_BANK) { }
     
     DataSegmentEntry& operator=(const DataSegmentEntry& other)
     {
       this->data = std::unique_ptr<u8[]>(new u8[other.length]);
       this->length = other.length;
       this->offset = other.offset;
+      this->bank = other.bank;
       std::copy(other.data.get(), other.data.get()+length, data.get());
       return *this;
     }
@@ -49,6 +55,7 @@ namespace Assembler
       this->data = std::move(other.data);
       this->length = other.length;
       this->offset = other.offset;
+      this->bank = other.bank;
       return *this;
     }
     
@@ -73,9 +80,11 @@ namespace Assembler
       });
     }
     
-    DataSegmentEntry(u16 size, u16 offset = 0) : data(new u8[size]), length(size), offset(offset) { }
+    DataSegmentEntry(u16 size, u16 offset = 0) : data(new u8[size]), length(size), offset(offset), bank(NO_BANK) { }
     
     const u8* getData() const { return this->data.get(); }
+    bool isBanked() const { return bank != NO_BANK; }
+    u16 address(u16 dataSegmentBase) const { return isBanked() ? offset : dataSegmentBase + offset; }
   };
   
   struct DataReference
@@ -199,9 +208,10 @@ namespace Assembler
     u8 data[4];
     u16 addressInROM;
     u32 length;
+    u32 sourceLine;
     
   public:
-    Instruction(u32 length) : data{0}, length(length) { }
+    Instruction(u32 length) : data{0}, length(length), sourceLine(0) { }
     
     virtual const u16 getLength() const { return length; }
     
@@ -216,6 +226,10 @@ namespace Assembler
     void setAddress(u16 address) { this->addressInROM = address; }
     u16 getAddressInROM() const { return addressInROM; }
     
+    /* 0 for instructions generated by the assembler itself */
+    void setSourceLine(u32 line) { this->sourceLine = line; }
+    u32 getSourceLine() const { return sourceLine; }
+    
     virtual Result solve(const Environment& env) { return Result(); }
 
     static Instruction* disassemble(const u8* code);
@@ -533,6 +547,23 @@ namespace Assembler
     void assemble(byte* dest) const override;
   };
   
+#pragma mark MUL P, R, S - MUL P, Q, O - DIV P, Q, R - COPY P, Q, O - FILL P, R, O
+  class InstructionEXT : public Instruction
+  {
+  public:
+    const ExtOp op;
+    const Reg dst;
+    const Reg src1;
+    const Reg src2;
+    
+  public:
+    InstructionEXT(Reg dst, Reg src1, Reg src2, ExtOp op) : Instruction(3),
+    op(op), dst(dst), src1(src1), src2(src2) { }
+    
+    std::string mnemonic() const override;
+    void assemble(byte* dest) const override;
+  };
+  
 #pragma marg SEXT
   class InstructionSEXT : public InstructionSingleReg<Reg8>
   {
@@ -14,6 +14,19 @@
 #include <string>
 #include <thread>
 #include <array>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <csignal>
+#include <cctype>
+#include <limits>
+
+#if !_WIN32
+#include <dirent.h>
+#endif
 
 #include "assembler.h"
 #include "compiler.h"
@@ -22,6 +35,11 @@
 #include "compiler/rtl.h"
 
 #include "screen.h"
+#include "vm/aot.h"
+#include "vm/output.h"
+#include "vm/banked.h"
+#include "vm/farm.h"
+#include "vm/timer.h"
 
 using namespace std;
 
@@ -41,15 +59,413 @@ string trimExtension(const string& text)
     return text;
 }
 
-class PrintfStdOut : public StdOut
+/* .j80 sources are assembled, .img files are mapped (see image.h), .bin files are
+   either raw images or Logisim "v2.0 raw" dumps */
+bool loadJob(const string& path, vm::Job& job)
+{
+  job.name = path;
+  job.image.reset();
+  job.segments.clear();
+  job.banks.clear();
+  
+  if (stringEndsWith(path, ".j80"))
+  {
+    Assembler::J80Assembler assembler;
+    assembler.setLogLevel(Log::ERROR);
+    
+    if (!assembler.parse(path) || !assembler.assemble())
+      return false;
+    
+    const auto& code = assembler.getCodeSegment();
+    const auto& data = assembler.getDataSegment();
+    job.segments.push_back({ 0, vector<u8>(code.data, code.data + code.length) });
+    job.segments.push_back({ data.offset, vector<u8>(data.data, data.data + data.length) });
+    
+    for (const auto& bank : assembler.getBanks())
+      job.banks.push_back({ bank.first, u16(bank.second.offset - vm::BankedRam::WINDOW_BASE), vector<u8>(bank.second.data, bank.second.data + bank.second.length) });
+    return true;
+  }
+  else if (stringEndsWith(path, ".img"))
+  {
+    auto loaded = std::make_shared<image::Image>();
+    
+    if (!loaded->open(path))
+      return false;
+    
+    job.image = loaded;
+    return true;
+  }
+  else if (stringEndsWith(path, ".bin"))
+  {
+    ifstream file(path, ios::binary);
+    
+    if (!file)
+      return false;
+    
+    vector<u8> image((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    const string header = "v2.0 raw";
+    
+    if (image.size() >= header.size() && std::equal(header.begin(), header.end(), image.begin()))
+    {
+      istringstream text(string(image.begin() + header.size(), image.end()));
+      image.clear();
+      
+      for (unsigned value; text >> hex >> value; )
+        image.push_back(value);
+    }
+    
+    job.segments.push_back({ 0, std::move(image) });
+    return true;
+  }
+  
+  return false;
+}
+
+/* stoul which takes the whole text or throws, negative values don't wrap around and
+   a 0x prefix reads the rest as hexadecimal */
+static size_t parseCount(const string& text, size_t min, size_t max)
+{
+  const bool hex = text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X');
+  const string digits = hex ? text.substr(2) : text;
+  size_t end = 0;
+  
+  if (digits.empty() || !(hex ? isxdigit(static_cast<unsigned char>(digits[0])) : isdigit(static_cast<unsigned char>(digits[0]))))
+    throw invalid_argument(text);
+  
+  unsigned long long value = stoull(digits, &end, hex ? 16 : 10);
+  
+  if (end != digits.size() || value < min || value > max)
+    throw out_of_range(text);
+  
+  return value;
+}
+
+/* j80 farm <directory> [threads] [repeat]
+   runs every program of the directory as a job, a program saved in several formats
+   runs once from its .img, else its .bin, else its .j80 */
+int runFarm(const vector<string>& args)
+{
+  static constexpr u64 MAX_INSTRUCTIONS_PER_JOB = 1 << 26;
+  static constexpr size_t MAX_THREADS = 1024;
+  static constexpr size_t MAX_REPEAT = 1 << 20;
+  static const char* const FORMATS[] = { ".img", ".bin", ".j80" };
+  
+  size_t threads = 0, repeat = 1;
+  
+  try
+  {
+    if (args.size() > 3)
+      threads = parseCount(args[3], 0, MAX_THREADS);
+    if (args.size() > 4)
+      repeat = parseCount(args[4], 1, MAX_REPEAT);
+    if (args.size() > 5)
+      throw invalid_argument(args[5]);
+  }
+  catch (const logic_error& e)
+  {
+    cerr << "Invalid argument: " << e.what() << endl;
+    return 2;
+  }
+  
+  vector<string> files;
+  
+#if !_WIN32
+  DIR* dir = opendir(args[2].c_str());
+  
+  if (!dir)
+  {
+    cerr << "Unable to open " << args[2] << endl;
+    return 1;
+  }
+  
+  while (dirent* entry = readdir(dir))
+    files.push_back(args[2] + "/" + entry->d_name);
+  closedir(dir);
+#endif
+  
+  /* path of each program by name without extension, the first format found wins */
+  std::map<string, string> programs;
+  
+  for (const char* format : FORMATS)
+  {
+    for (const string& file : files)
+    {
+      if (stringEndsWith(file, format))
+        programs.emplace(trimExtension(file), file);
+    }
+  }
+  
+  vector<vm::Job> images;
+  
+  for (const auto& program : programs)
+  {
+    vm::Job job;
+    
+    if (loadJob(program.second, job))
+    {
+      job.limits.instructions = MAX_INSTRUCTIONS_PER_JOB;
+      images.push_back(std::move(job));
+    }
+    else
+      cerr << "Unable to load " << program.second << endl;
+  }
+  
+  vector<vm::Job> jobs;
+  for (size_t r = 0; r < repeat; ++r)
+    jobs.insert(jobs.end(), images.begin(), images.end());
+  
+  vm::VMFarm farm(threads);
+  
+  auto start = std::chrono::steady_clock::now();
+  vector<vm::JobResult> results = farm.run(jobs);
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  
+  u64 instructions = 0;
+  std::map<VM::StopReason, size_t> reasons;
+  
+  for (const auto& result : results)
+  {
+    instructions += result.instructions;
+    ++reasons[result.reason];
+  }
+  
+  cout << fmt::format("{} jobs ({} images) on {} threads in {:.3f}s: {:.1f} jobs/s, {:.2f} MIPS", jobs.size(), images.size(), farm.threadCount(), elapsed, jobs.size() / elapsed, instructions / elapsed / 1000000.0) << endl;
+  
+  for (const auto& reason : reasons)
+    cout << fmt::format("  {:<20} {}", VM::stopReasonName(reason.first), reason.second) << endl;
+  
+  return 0;
+}
+
+static VM* headlessVM = nullptr;
+
+static void stopHeadless(int)
+{
+  if (headlessVM)
+    headlessVM->requestStop();
+}
+
+/* j80 run <image> [--engine switch|threaded|jit] [--timing] [--instructions N] [--cycles N]
+                   [--no-halt] [--idle] [--banks FILE] [--aot MODULE] [--out-fd N] [--stats-fd N]
+   runs an image without any terminal until it halts, hits a limit or gets SIGINT, guest
+   output goes to out-fd (stdout by default) and a single JSON line of stats to stats-fd
+   (stderr by default), --no-halt skips halt detection so engines run at full speed, --idle
+   skips idle loops (see VM::setIdleSkipping), a vm::Timer and a vm::BankedRam are mapped at
+   their default ports, --banks keeps the extended RAM in FILE instead of anonymous memory,
+   --aot runs the blocks of a module built from the output of j80 aot natively, exits with 0
+   when the program halts or idles, 2 on an invalid argument, 3 on an instruction or cycle
+   limit, 4 on a breakpoint or watchpoint and 130 on SIGINT */
+int runHeadless(const vector<string>& args)
 {
-  void out(u8 value) override
+  vm::Job job;
+  VM::RunLimits limits;
+  VM::Engine engine = J80_THREADED_DISPATCH ? VM::Engine::THREADED : VM::Engine::SWITCH;
+  bool timed = false;
+  bool idle = false;
+  string banksPath, aotPath;
+  int outFd = 1, statsFd = 2;
+  
+  try
+  {
+    for (size_t i = 3; i < args.size(); ++i)
+    {
+      const string& arg = args[i];
+      bool hasValue = i + 1 < args.size();
+      
+      if (arg == "--engine" && hasValue)
+      {
+        const string& name = args[++i];
+        
+        if (name == "switch")
+          engine = VM::Engine::SWITCH;
+        else if (name == "threaded")
+          engine = VM::Engine::THREADED;
+        else if (name == "jit")
+          engine = VM::Engine::JIT;
+        else
+          throw invalid_argument(name);
+      }
+      else if (arg == "--timing")
+        timed = true;
+      else if (arg == "--no-halt")
+        limits.stopOnHalt = false;
+      else if (arg == "--idle")
+        idle = true;
+      else if (arg == "--banks" && hasValue)
+        banksPath = args[++i];
+      else if (arg == "--aot" && hasValue)
+      {
+        aotPath = args[++i];
+        engine = VM::Engine::AOT;
+      }
+      else if (arg == "--instructions" && hasValue)
+        limits.instructions = parseCount(args[++i], 0, numeric_limits<u64>::max());
+      else if (arg == "--cycles" && hasValue)
+        limits.cycles = parseCount(args[++i], 0, numeric_limits<u64>::max());
+      else if (arg == "--out-fd" && hasValue)
+        outFd = static_cast<int>(parseCount(args[++i], 0, numeric_limits<int>::max()));
+      else if (arg == "--stats-fd" && hasValue)
+        statsFd = static_cast<int>(parseCount(args[++i], 0, numeric_limits<int>::max()));
+      else
+        throw invalid_argument(arg);
+    }
+  }
+  catch (const logic_error& e)
+  {
+    cerr << "Invalid argument: " << e.what() << endl;
+    return 2;
+  }
+  
+  if (!loadJob(args[2], job))
+  {
+    cerr << "Unable to load " << args[2] << endl;
+    return 1;
+  }
+  
+  VM vm;
+  vm::FileStdOut sout(outFd, false);
+  vm::Timer timer(vm);
+  vm::BankedRam banked(vm);
+  
+  if (!banksPath.empty() && !banked.open(banksPath))
+  {
+    cerr << "Unable to map " << banksPath << endl;
+    return 1;
+  }
+  
+  if (job.image)
+    job.image->load(vm, &banked);
+  
+  for (const auto& segment : job.segments)
+    vm.copyToRam(segment.data.data(), std::min<size_t>(segment.data.size(), VM::MEMORY_SIZE - segment.offset), segment.offset);
+  
+  for (const auto& segment : job.banks)
+    banked.load(segment.bank, segment.offset, segment.data.data(), segment.data.size());
+  
+  vm.setStdOut(&sout);
+  vm.mapDevice(&timer, vm::Timer::PORT, vm::Timer::PORT_COUNT);
+  vm.mapDevice(&banked, vm::BankedRam::PORT, 1);
+  vm.setTiming(timed ? VM::Timing::CYCLE_ACCURATE : VM::Timing::THROUGHPUT);
+  vm.setIdleSkipping(idle);
+  
+  if (!aotPath.empty())
+  {
+    Result loaded = vm.loadNative(aotPath);
+    
+    if (!loaded)
+    {
+      cerr << "Unable to load " << aotPath << ": " << loaded.message << endl;
+      return 1;
+    }
+  }
+  
+  if (!vm.setEngine(engine))
+  {
+    cerr << "Engine not available on this platform" << endl;
+    return 1;
+  }
+  
+  headlessVM = &vm;
+  signal(SIGINT, stopHeadless);
+  
+  VM::RunResult run = vm.run(limits);
+  
+  signal(SIGINT, SIG_DFL);
+  headlessVM = nullptr;
+  sout.flush();
+  
+  static const char* engines[] = { "switch", "threaded", "jit", "aot" };
+  
+  string image;
+  for (char c : args[2])
   {
-    printf("%c", (char)value);
+    if (c == '"' || c == '\\')
+    {
+      image += '\\';
+      image += c;
+    }
+    else if (c == '\n')
+      image += "\\n";
+    else if (c == '\t')
+      image += "\\t";
+    else if (static_cast<unsigned char>(c) < 0x20)
+      image += fmt::format("\\u{:04x}", static_cast<int>(c));
+    else
+      image += c;
   }
-};
+  
+  double seconds = std::chrono::duration<double>(run.elapsed).count();
+  
+  string stats = fmt::format("{{\"image\": \"{}\", \"engine\": \"{}\", \"timing\": \"{}\", \"stop\": \"{}\", \"instructions\": {}, \"cycles\": {}, \"seconds\": {:.6f}, \"mips\": {:.3f}, \"peak_stack\": {}}}\n",
+    image, engines[static_cast<int>(engine)], timed ? "cycle accurate" : "throughput", VM::stopReasonName(run.reason),
+    run.instructions, run.cycles, seconds, seconds > 0.0 ? run.instructions / seconds / 1000000.0 : 0.0, vm.peakStackDepth());
+  
+  vm::FileStdOut out(statsFd);
+  for (char c : stats)
+    out.out(c);
+  
+  switch (run.reason)
+  {
+    case VM::StopReason::HALT:
+    case VM::StopReason::IDLE:
+      return 0;
+    case VM::StopReason::INSTRUCTION_LIMIT:
+    case VM::StopReason::CYCLE_LIMIT:
+      return 3;
+    case VM::StopReason::BREAKPOINT:
+    case VM::StopReason::WATCHPOINT:
+      return 4;
+    case VM::StopReason::STOP_REQUESTED:
+    default:
+      return 130;
+  }
+}
 
-static bool shouldStopVM = false;
+/* j80 aot <program.j80> <output.cpp>
+   writes the code of a program as C++ to be built into a module for j80 run --aot,
+   translation starts from the reset address, the entry point, the interrupt vectors
+   in use and every label so that computed jumps to them stay native */
+int runTranslator(const vector<string>& args)
+{
+  Assembler::J80Assembler assembler;
+  assembler.setLogLevel(Log::ERROR);
+  
+  if (!assembler.parse(args[2]))
+    return 1;
+  
+  Result result = assembler.assemble();
+  
+  if (!result)
+  {
+    assembler.log(Log::ERROR, true, "Error: {}", result.message);
+    return 1;
+  }
+  
+  const auto& code = assembler.getCodeSegment();
+  vm::AotTranslator translator(code.data, code.length);
+  
+  translator.addEntry(0);
+  translator.addEntry(code.offset);
+  
+  for (u8 i = 0; i < assembler.maxNumberOfInterrupts(); ++i)
+    if (!assembler.isInterruptAvailable(i))
+      translator.addEntry(VM::INTERRUPT_VECTOR_BASE + i * VM::INTERRUPT_VECTOR_SIZE);
+  
+  for (const auto& label : assembler.getSymbols().getLabels())
+    translator.addEntry(label.second);
+  
+  ofstream out(args[3], ios::binary);
+  out << translator.translate();
+  
+  if (!out)
+  {
+    cerr << "Unable to write " << args[3] << endl;
+    return 1;
+  }
+  
+  cout << fmt::format("{} blocks translated to {}", translator.blockCount(), args[3]) << endl;
+  return 0;
+}
 
 void runWithArgs(const vector<string>& args, Assembler::J80Assembler& assembler, nanoc::Compiler& compiler)
 {
@@ -71,22 +487,26 @@ void runWithArgs(const vector<string>& args, Assembler::J80Assembler& assembler,
           
           string output = trimExtension(args[1]) + ".bin";
           assembler.saveForLogisim(output);
+          assembler.saveSymbols(trimExtension(args[1]) + ".sym");
+          assembler.saveImage(trimExtension(args[1]) + ".img");
 
-          std::thread thread = std::thread([&assembler] {
-            VM vm;
-            vm.copyToRam(assembler.getCodeSegment().data, assembler.getCodeSegment().length);
-            vm.copyToRam(assembler.getDataSegment().data, assembler.getDataSegment().length, assembler.getDataSegment().offset);
-            vm.setStdOut(new PrintfStdOut());
+          VM vm;
+          vm::FileStdOut sout(fileno(stdout));
+          vm.copyToRam(assembler.getCodeSegment().data, assembler.getCodeSegment().length);
+          vm.copyToRam(assembler.getDataSegment().data, assembler.getDataSegment().length, assembler.getDataSegment().offset);
+          vm.setStdOut(&sout);
 
-            
-            while (!shouldStopVM)
-              vm.executeInstruction();
+          VM::RunResult run;
+          std::thread thread = std::thread([&vm, &run] {
+            run = vm.run(VM::RunLimits());
           });
 
-          thread.detach();
-
           getchar();
-          shouldStopVM = true;
+          vm.requestStop();
+          thread.join();
+          
+          cout << endl << "VM stopped (" << VM::stopReasonName(run.reason) << ") after " << run.instructions << " instructions in "
+               << std::chrono::duration<double>(run.elapsed).count() << "s" << endl;
         }
         else
           assembler.log(Log::ERROR, true, "Error: {}", result.message);
@@ -107,6 +527,21 @@ void runWithArgs(const vector<string>& args, Assembler::J80Assembler& assembler,
 
 int main(int argc, const char * argv[])
 {
+  if (argc > 2 && string(argv[1]) == "run")
+    return runHeadless(vector<string>(argv, argv + argc));
+  else if (argc > 3 && string(argv[1]) == "aot")
+    return runTranslator(vector<string>(argv, argv + argc));
+  else if (argc > 2 && string(argv[1]) == "farm")
+    return runFarm(vector<string>(argv, argv + argc));
+  else if (argc == 2)
+  {
+    Assembler::J80Assembler assembler;
+    nanoc::Compiler compiler;
+    
+    runWithArgs(vector<string>(argv, argv + argc), assembler, compiler);
+    return 0;
+  }
+  
   VM vm;
 
 
@@ -96,6 +96,24 @@ const char* Opcodes::aluName(Alu alu)
   }
 }
 
+const char* Opcodes::extName(ExtOp op)
+{
+  switch (op)
+  {
+    case ExtOp::MUL8:
+    case ExtOp::MUL16:
+      return "mul";
+      
+    case ExtOp::DIV8: return "div";
+    case ExtOp::COPY: return "copy";
+    case ExtOp::FILL: return "fill";
+      
+    default:
+      assert(false);
+      return nullptr;
+  }
+}
+
 const char* Opcodes::opcodeName(Opcode opcode)
 {
   switch (opcode)
@@ -120,6 +138,7 @@ const char* Opcodes::opcodeName(Opcode opcode)
     case OPCODE_ALU_NN:
     case OPCODE_ALU_REG:
     case OPCODE_ALU_NNNN:
+    case OPCODE_EXT:
       return "";
       
     case OPCODE_CMP_NN:
@@ -251,6 +270,23 @@ MnemonicInfo Opcodes::printInstruction(const u8 *data)
       }
     }
 
+    case OPCODE_EXT:
+    {
+      ExtOp op = static_cast<ExtOp>(alu);
+      
+      switch (op)
+      {
+        case ExtOp::MUL8: return { fmt::format("{} {}, {}, {}", extName(op), reg16(reg1), reg8(reg2), reg8(reg3)), 3 };
+        case ExtOp::MUL16: return { fmt::format("{} {}, {}, {}", extName(op), reg16(reg1), reg16(reg2), reg16(reg3)), 3 };
+        case ExtOp::DIV8: return { fmt::format("{} {}, {}, {}", extName(op), reg16(reg1), reg16(reg2), reg8(reg3)), 3 };
+        case ExtOp::COPY: return { fmt::format("{} {}, {}, {}", extName(op), reg16(reg1), reg16(reg2), reg16(reg3)), 3 };
+        case ExtOp::FILL: return { fmt::format("{} {}, {}, {}", extName(op), reg16(reg1), reg8(reg2), reg16(reg3)), 3 };
+        default: break;
+      }
+      
+      break;
+    }
+
     case OPCODE_CMP_NN: { return {fmt::format("{} {}, {:02X}h", opcodeName(opcode), reg8(reg1), unsigned8), 3}; break; }
     case OPCODE_CMP_NNNN: { return {fmt::format("{} {}, {:04X}h", opcodeName(opcode), reg16(reg1), short2), 4}; break; }
 
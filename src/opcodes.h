@@ -123,7 +123,37 @@ enum Opcode : u8
   OPCODE_DI = 0b00011,
   OPCODE_INT = 0b01011,
   
-  OPCODE_SEXT = 0b00001
+  OPCODE_SEXT = 0b00001,
+  
+  /* operations added after the original set, the second byte selects one of ExtOp
+     in the same bits as the ALU operation of ALU forms */
+  OPCODE_EXT = 0b00111
+};
+
+/* ALU R, S, Q layout: destination in the first byte, first source and operation in
+   the second, second source in the top bits of the third, the low bit is the width
+   like for Alu
+
+     MUL P, R, S   P = R * S, unsigned 8x8 bits product
+     MUL P, Q, O   P = Q * O, low 16 bits of the unsigned product
+     DIV P, Q, R   P = Q / R and R = Q % R, unsigned, the quotient is written first
+     COPY P, Q, O  copies O bytes from [Q] to [P] as if through a buffer
+     FILL P, R, O  stores R in the O bytes at [P]
+
+   multiplies set CARRY and OVERFLOW when the product doesn't fit the width of the
+   sources, ZERO and SIGN follow the destination, a division by zero leaves the
+   registers unchanged and only sets OVERFLOW
+
+   block operations leave the flags alone, addresses wrap around at 64K and a count
+   of 0 does nothing, once done the pointers are advanced past the block and the
+   count is 0 like after a byte loop, in the order P, Q then O when they overlap */
+enum class ExtOp : u8
+{
+  MUL8 = 0b00000,
+  MUL16 = 0b00001,
+  DIV8 = 0b00010,
+  COPY = 0b00100,
+  FILL = 0b00110
 };
 
 enum JumpCondition : u8
@@ -159,6 +189,7 @@ class Opcodes
   static const char* reg8(Reg reg);
   static const char* reg16(Reg reg);
   static const char* aluName(Alu alu);
+  static const char* extName(ExtOp op);
   static const char* condName(JumpCondition cond);
 };
 
@@ -159,6 +159,8 @@ namespace ui
       Boxes = 0xff8eff00,
     };
 
+    static constexpr u64 CONTINUE_SLICE = 1 << 18;
+
 
     
 
@@ -347,6 +349,7 @@ namespace ui
 
     std::array<Flag, 4> flags = { Flag::FLAG_CARRY, Flag::FLAG_ZERO, Flag::FLAG_SIGN, Flag::FLAG_OVERFLOW };
 
+    vm->materializeFlags();
     terminal_print(REGISTERS_BOX.x() + 1, REGISTERS_BOX.y() + 1, fmt::format("PC: {:04x}h", vm->pc()).c_str());
 
     for (s32 i = 0; i < regs.size(); ++i)
@@ -401,6 +404,26 @@ namespace ui
         vm->executeInstruction();
         refresh();
       }
+      else if (evt == TK_B)
+      {
+        if (vm->isBreakpoint(vm->pc()))
+          vm->clearBreakpoint(vm->pc());
+        else
+          vm->setBreakpoint(vm->pc());
+      }
+      else if (evt == TK_C)
+      {
+        regs = vm->allRegs();
+
+        /* run in slices and stop on any input, a slice ending on a breakpoint
+           stops there as the next slice would resume past it */
+        VM::RunLimits limits;
+        limits.instructions = CONTINUE_SLICE;
+        while (vm->run(limits).reason == VM::StopReason::INSTRUCTION_LIMIT && !vm->isBreakpoint(vm->pc()) && !terminal_has_input())
+          ;
+
+        refresh();
+      }
       else if (evt == TK_R)
       {
         regs = Regs();
@@ -0,0 +1,453 @@
+#include "assembler.h"
+#include "vm.h"
+
+#include <array>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+using bench_clock = std::chrono::steady_clock;
+
+class NullStdOut : public StdOut
+{
+  void out(u8 value) override { }
+};
+
+static constexpr u64 MAX_INSTRUCTIONS_PER_PROGRAM = 1 << 24;
+/* instructions per run of the synthetic loops, which never halt */
+static constexpr u64 SYNTHETIC_LENGTH = 1 << 16;
+
+static double minSecondsPerRun = 1.0;
+
+static bool load(const string& filename, VM& vm)
+{
+  Assembler::J80Assembler assembler;
+  assembler.setLogLevel(Log::ERROR);
+  
+  if (!assembler.parse(filename))
+    return false;
+  
+  Result result = assembler.assemble();
+  
+  if (!result)
+  {
+    assembler.log(Log::ERROR, true, "Error: {}", result.message);
+    return false;
+  }
+  
+  vm.copyToRam(assembler.getCodeSegment().data, assembler.getCodeSegment().length);
+  vm.copyToRam(assembler.getDataSegment().data, assembler.getDataSegment().length, assembler.getDataSegment().offset);
+  return true;
+}
+
+/* test programs end with a jump to itself, count instructions needed to reach it */
+static u64 instructionsUntilHalt(VM& vm)
+{
+  VM::RunLimits limits;
+  limits.instructions = MAX_INSTRUCTIONS_PER_PROGRAM;
+  
+  vm.reset();
+  return vm.run(limits).instructions;
+}
+
+static double measure(VM& vm, VM::Engine engine, u64 length)
+{
+  vm.setEngine(engine);
+  
+  u64 total = 0;
+  double elapsed = 0.0;
+  auto start = bench_clock::now();
+  
+  while (elapsed < minSecondsPerRun)
+  {
+    for (int r = 0; r < 1000; ++r)
+    {
+      vm.reset();
+      total += vm.run(length);
+    }
+    
+    elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+  }
+  
+  return total / elapsed / 1000000.0;
+}
+
+/* machine code of a synthetic benchmark laid out from address 0, jumps use the
+   addresses returned by here() */
+class Code
+{
+public:
+  vector<u8> bytes;
+  
+  u16 here() const { return bytes.size(); }
+  
+  void add(const Assembler::Instruction& instruction)
+  {
+    u8 data[4];
+    instruction.assemble(data);
+    bytes.insert(bytes.end(), data, data + instruction.getLength());
+  }
+  
+  void jump(JumpCondition condition, u16 address) { add(Assembler::InstructionJMP_NNNN(condition, Assembler::Address(address))); }
+};
+
+/* every ALU_REG form of one width with operands cycling through all the registers */
+static Code aluRegLoop(bool extended)
+{
+  static const Alu ops[] = {
+    Alu::ADD8, Alu::ADC8, Alu::SUB8, Alu::SBC8, Alu::AND8, Alu::OR8, Alu::XOR8, Alu::NOT8,
+    Alu::TRANSFER_A8, Alu::TRANSFER_B8, Alu::LSH8, Alu::RSH8
+  };
+  
+  Code code;
+  
+  for (Alu alu : ops)
+    for (u8 r = 0; r < 8; ++r)
+      code.add(Assembler::InstructionALU_R(static_cast<Reg>(r), static_cast<Reg>((r + 1) & 0b111), static_cast<Reg>((r + 3) & 0b111), alu, extended));
+  
+  code.jump(COND_UNCOND, 0);
+  return code;
+}
+
+static Code aluImmediateLoop()
+{
+  static const Alu ops[] = { Alu::ADD8, Alu::ADC8, Alu::SUB8, Alu::SBC8, Alu::AND8, Alu::OR8, Alu::XOR8 };
+  
+  Code code;
+  
+  for (Alu alu : ops)
+    for (u8 r = 0; r < 8; ++r)
+      code.add(Assembler::InstructionALU_R_NN(static_cast<Reg>(r), static_cast<Reg>((r + 1) & 0b111), alu, Assembler::Value8(r * 17 + 1)));
+  
+  code.jump(COND_UNCOND, 0);
+  return code;
+}
+
+/* loads and stores through XY, the data registers don't alias it */
+static Code pointerLoop()
+{
+  static const Reg data[] = { Reg::A, Reg::D, Reg::F, Reg::B, Reg::C, Reg::E };
+  
+  Code code;
+  code.add(Assembler::InstructionLD_NNNN(Reg::XY, Assembler::Value16(0x4000)));
+  u16 loop = code.here();
+  
+  for (u8 k = 0; k < 24; ++k)
+  {
+    Reg reg = data[k % 6];
+    code.add(Assembler::InstructionLD_PTR_PP(reg, Reg::XY, Assembler::Value8(k)));
+    code.add(Assembler::InstructionST_PTR_PP(reg, Reg::XY, Assembler::Value8(k + 32)));
+  }
+  
+  code.jump(COND_UNCOND, loop);
+  return code;
+}
+
+static Code stackLoop()
+{
+  Code code;
+  code.add(Assembler::InstructionLD_NNNN(Reg::SP, Assembler::Value16(0x8000)));
+  u16 loop = code.here();
+  
+  for (int k = 0; k < 12; ++k)
+  {
+    code.add(Assembler::InstructionPUSH16(Reg::BA));
+    code.add(Assembler::InstructionPUSH16(Reg::CD));
+    code.add(Assembler::InstructionPOP16(Reg::EF));
+    code.add(Assembler::InstructionPOP16(Reg::XY));
+  }
+  
+  code.jump(COND_UNCOND, loop);
+  return code;
+}
+
+/* CALLs to a subroutine made of a single RET */
+static Code callLoop()
+{
+  static constexpr int CALLS = 16;
+  
+  Code code;
+  code.add(Assembler::InstructionLD_NNNN(Reg::SP, Assembler::Value16(0x8000)));
+  u16 loop = code.here();
+  u16 subroutine = loop + CALLS * 3 + 3;
+  
+  for (int k = 0; k < CALLS; ++k)
+    code.add(Assembler::InstructionCALL_NNNN(COND_UNCOND, Assembler::Address(subroutine)));
+  
+  code.jump(COND_UNCOND, loop);
+  code.add(Assembler::InstructionRET(COND_UNCOND));
+  return code;
+}
+
+/* conditional jumps on a zero flag set once, taken ones go to the next instruction */
+static Code conditionalLoop(bool taken)
+{
+  Code code;
+  code.add(Assembler::InstructionLD_NN(Reg::A, Assembler::Value8(0)));
+  code.add(Assembler::InstructionCMP_NN(Reg::A, Assembler::Value8(0)));
+  u16 loop = code.here();
+  
+  for (int k = 0; k < 32; ++k)
+  {
+    if (taken)
+      code.jump(COND_ZERO, code.here() + 3);
+    else
+      code.jump(COND_NZERO, loop);
+  }
+  
+  code.jump(COND_UNCOND, loop);
+  return code;
+}
+
+/* strlen over a 255 characters string at 4000h, restarted once it reaches the end */
+static Code stringLoop(VM& vm)
+{
+  vector<u8> text(256);
+  for (size_t i = 0; i < text.size() - 1; ++i)
+    text[i] = 'a' + i % 26;
+  text.back() = 0;
+  vm.copyToRam(text.data(), text.size(), 0x4000);
+  
+  Code code;
+  u16 start = code.here();
+  code.add(Assembler::InstructionLD_NNNN(Reg::XY, Assembler::Value16(0x4000)));
+  u16 loop = code.here();
+  code.add(Assembler::InstructionLD_PTR_PP(Reg::C, Reg::XY, Assembler::Value8(0)));
+  code.add(Assembler::InstructionCMP_NN(Reg::C, Assembler::Value8(0)));
+  code.jump(COND_ZERO, start);
+  code.add(Assembler::InstructionALU_NNNN(Reg::XY, Reg::XY, Alu::ADD16, Assembler::Value16(1)));
+  code.jump(COND_UNCOND, loop);
+  return code;
+}
+
+/* register lookup as it was done before the register file became an array, kept
+   to compare against Regs::reg8 and Regs::reg16 */
+static u8& switchReg8(Regs& regs, Reg r)
+{
+  switch (r) {
+    case Reg::A: return regs.A;
+    case Reg::B: return regs.B;
+    case Reg::C: return regs.C;
+    case Reg::D: return regs.D;
+    case Reg::E: return regs.E;
+    case Reg::F: return regs.F;
+    case Reg::X: return regs.X;
+    case Reg::Y: return regs.Y;
+  }
+  return regs.A;
+}
+
+static u16& switchReg16(Regs& regs, Reg r)
+{
+  switch (r) {
+    case Reg::BA: return regs.BA;
+    case Reg::CD: return regs.CD;
+    case Reg::EF: return regs.EF;
+    case Reg::XY: return regs.XY;
+    case Reg::SP: return regs.SP;
+    case Reg::FP: return regs.FP;
+    case Reg::IX: return regs.IX;
+    case Reg::IY: return regs.IY;
+  }
+  return regs.BA;
+}
+
+/* millions of three operand register lookups (dst = src1 + src2) per second over
+   random operands, with the switch based lookup and with the register file */
+template<bool SWITCH> static double measureRegisterLookup(const vector<array<Reg, 3>>& operands)
+{
+  Regs regs;
+  memset(&regs, 0, sizeof(Regs));
+  
+  u64 total = 0;
+  double elapsed = 0.0;
+  auto start = bench_clock::now();
+  
+  while (elapsed < minSecondsPerRun)
+  {
+    for (int r = 0; r < 100; ++r)
+    {
+      for (size_t k = 0; k < operands.size(); ++k)
+      {
+        const auto& o = operands[k];
+        
+        if (k & 1)
+        {
+          if (SWITCH)
+            switchReg16(regs, o[0]) = switchReg16(regs, o[1]) + switchReg16(regs, o[2]) + 1;
+          else
+            regs.reg16(o[0]) = regs.reg16(o[1]) + regs.reg16(o[2]) + 1;
+        }
+        else
+        {
+          if (SWITCH)
+            switchReg8(regs, o[0]) = switchReg8(regs, o[1]) + switchReg8(regs, o[2]) + 1;
+          else
+            regs.reg8(o[0]) = regs.reg8(o[1]) + regs.reg8(o[2]) + 1;
+        }
+      }
+      
+      total += operands.size();
+    }
+    
+    elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+  }
+  
+  /* keeps the register writes alive */
+  volatile u16 sink = regs.BA ^ regs.CD ^ regs.EF ^ regs.XY ^ regs.SP ^ regs.FP ^ regs.IX ^ regs.IY;
+  (void)sink;
+  
+  return total / elapsed / 1000000.0;
+}
+
+struct Benchmark
+{
+  string name;
+  const char* kind;
+  u64 length;
+  /* MIPS per engine, 0 when the engine isn't available */
+  array<double, 3> mips;
+};
+
+static const VM::Engine ENGINES[] = { VM::Engine::SWITCH, VM::Engine::THREADED, VM::Engine::JIT };
+static const char* ENGINE_NAMES[] = { "switch", "threaded", "jit" };
+
+static Benchmark run(VM& vm, const string& name, const char* kind, u64 length)
+{
+  Benchmark benchmark = { name, kind, length, {} };
+  
+  for (size_t e = 0; e < 3; ++e)
+    benchmark.mips[e] = VM::isEngineAvailable(ENGINES[e]) ? measure(vm, ENGINES[e], length) : 0.0;
+  
+  return benchmark;
+}
+
+static Benchmark runSynthetic(const string& name, Code (*build)(VM&))
+{
+  VM vm;
+  Code code = build(vm);
+  vm.copyToRam(code.bytes.data(), code.bytes.size());
+  return run(vm, name, "micro", SYNTHETIC_LENGTH);
+}
+
+/* j80-bench [--json] [--seconds S] [programs...]
+   micro benchmarks exercise one opcode family each, macro benchmarks are whole
+   programs (tests/fact.j80 and tests/mult.j80 unless programs are given) and a
+   string walk, --json prints a single object meant to be diffed across commits */
+int main(int argc, const char* argv[])
+{
+  vector<string> programs;
+  bool json = false;
+  
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    
+    if (arg == "--json")
+      json = true;
+    else if (arg == "--seconds" && i + 1 < argc)
+      minSecondsPerRun = atof(argv[++i]);
+    else
+      programs.push_back(arg);
+  }
+  
+  if (programs.empty())
+    programs = { "tests/fact.j80", "tests/mult.j80" };
+  
+  vector<Benchmark> benchmarks;
+  
+  benchmarks.push_back(runSynthetic("alu_reg8", [] (VM&) { return aluRegLoop(false); }));
+  benchmarks.push_back(runSynthetic("alu_reg16", [] (VM&) { return aluRegLoop(true); }));
+  benchmarks.push_back(runSynthetic("alu_nn", [] (VM&) { return aluImmediateLoop(); }));
+  benchmarks.push_back(runSynthetic("ld_st_ptr_pp", [] (VM&) { return pointerLoop(); }));
+  benchmarks.push_back(runSynthetic("push_pop16", [] (VM&) { return stackLoop(); }));
+  benchmarks.push_back(runSynthetic("call_ret", [] (VM&) { return callLoop(); }));
+  benchmarks.push_back(runSynthetic("jmpc_taken", [] (VM&) { return conditionalLoop(true); }));
+  benchmarks.push_back(runSynthetic("jmpc_not_taken", [] (VM&) { return conditionalLoop(false); }));
+  
+  NullStdOut sout;
+  vector<string> failures;
+  
+  for (const auto& program : programs)
+  {
+    VM vm;
+    vm.setStdOut(&sout);
+    
+    if (!load(program, vm))
+      failures.push_back(program);
+    else
+      benchmarks.push_back(run(vm, program, "macro", instructionsUntilHalt(vm)));
+  }
+  
+  {
+    Benchmark benchmark = runSynthetic("strlen", stringLoop);
+    benchmark.kind = "macro";
+    benchmarks.push_back(benchmark);
+  }
+  
+  std::mt19937 random(80);
+  vector<array<Reg, 3>> operands(4096);
+  for (auto& o : operands)
+    o = { static_cast<Reg>(random() & 0b111), static_cast<Reg>(random() & 0b111), static_cast<Reg>(random() & 0b111) };
+  
+  double switchLookup = measureRegisterLookup<true>(operands), arrayLookup = measureRegisterLookup<false>(operands);
+  
+  if (json)
+  {
+    string out = "{\"benchmarks\": [";
+    
+    for (size_t b = 0; b < benchmarks.size(); ++b)
+    {
+      const Benchmark& benchmark = benchmarks[b];
+      out += fmt::format("{}{{\"name\": \"{}\", \"kind\": \"{}\", \"length\": {}", b ? ", " : "", benchmark.name, benchmark.kind, benchmark.length);
+      
+      for (size_t e = 0; e < 3; ++e)
+      {
+        if (benchmark.mips[e] > 0.0)
+          out += fmt::format(", \"{}\": {{\"mips\": {:.3f}, \"ns_per_instruction\": {:.4f}}}", ENGINE_NAMES[e], benchmark.mips[e], 1000.0 / benchmark.mips[e]);
+        else
+          out += fmt::format(", \"{}\": null", ENGINE_NAMES[e]);
+      }
+      
+      out += "}";
+    }
+    
+    out += "], \"failed\": [";
+    for (size_t f = 0; f < failures.size(); ++f)
+      out += fmt::format("{}\"{}\"", f ? ", " : "", failures[f]);
+    
+    out += fmt::format("], \"register_lookup\": {{\"switch\": {:.3f}, \"array\": {:.3f}}}}}", switchLookup, arrayLookup);
+    cout << out << endl;
+    return failures.empty() ? 0 : 1;
+  }
+  
+  string header = fmt::format("{:<24} {:<5} {:>8}", "benchmark", "kind", "length");
+  for (const char* name : { "switch", "thread", "jit" })
+    header += fmt::format(" {:>12} {:>7}", fmt::format("{} MIPS", name), "ns/i");
+  cout << header << endl;
+  
+  for (const Benchmark& benchmark : benchmarks)
+  {
+    string line = fmt::format("{:<24} {:<5} {:>8}", benchmark.name, benchmark.kind, benchmark.length);
+    
+    for (double mips : benchmark.mips)
+    {
+      if (mips > 0.0)
+        line += fmt::format(" {:>12.2f} {:>7.3f}", mips, 1000.0 / mips);
+      else
+        line += fmt::format(" {:>12} {:>7}", "n/a", "");
+    }
+    
+    cout << line << endl;
+  }
+  
+  for (const auto& program : failures)
+    cout << fmt::format("{:<24} failed to assemble", program) << endl;
+  
+  cout << endl << fmt::format("{:<24} {:>12} {:>12}", "register lookup", "switch M/s", "array M/s") << endl;
+  cout << fmt::format("{:<24} {:>12.2f} {:>12.2f}", "dst = src1 + src2", switchLookup, arrayLookup) << endl;
+  
+  return failures.empty() ? 0 : 1;
+}
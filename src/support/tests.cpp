@@ -1,9 +1,21 @@
 #define CATCH_CONFIG_MAIN
 #include "support/catch.hpp"
 
+#include "image.h"
 #include "instruction.h"
+#include "symbols.h"
+#include "vm.h"
+#include "vm/aot.h"
+#include "vm/condition.h"
+#include "vm/timer.h"
+#include "vm/trace.h"
 
 #include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <vector>
 
 constexpr int OP_SHIFT = 3;
 constexpr int REG2_SHIFT = 5;
@@ -173,6 +185,86 @@ TEST_CASE("instructions are correctly generated", "[instruction gen]")
     }
   }
   
+  SECTION("MUL P, R, S")
+  {
+    for (const auto p : regs16)
+    {
+      for (const auto r : regs8)
+      {
+        for (const auto s : regs8)
+        {
+          assembled_instruction ai(OPCODE_EXT, p, (r << REG2_SHIFT) | static_cast<u8>(ExtOp::MUL8), s << REG2_SHIFT);
+          instruction_ptr i(new InstructionEXT(p, r, s, ExtOp::MUL8));
+          REQUIRE(ai == i);
+        }
+      }
+    }
+  }
+  
+  SECTION("MUL P, Q, O")
+  {
+    for (const auto p : regs16)
+    {
+      for (const auto q : regs16)
+      {
+        for (const auto o : regs16)
+        {
+          assembled_instruction ai(OPCODE_EXT, p, (q << REG2_SHIFT) | static_cast<u8>(ExtOp::MUL16), o << REG2_SHIFT);
+          instruction_ptr i(new InstructionEXT(p, q, o, ExtOp::MUL16));
+          REQUIRE(ai == i);
+        }
+      }
+    }
+  }
+  
+  SECTION("DIV P, Q, R")
+  {
+    for (const auto p : regs16)
+    {
+      for (const auto q : regs16)
+      {
+        for (const auto r : regs8)
+        {
+          assembled_instruction ai(OPCODE_EXT, p, (q << REG2_SHIFT) | static_cast<u8>(ExtOp::DIV8), r << REG2_SHIFT);
+          instruction_ptr i(new InstructionEXT(p, q, r, ExtOp::DIV8));
+          REQUIRE(ai == i);
+        }
+      }
+    }
+  }
+  
+  SECTION("COPY P, Q, O")
+  {
+    for (const auto p : regs16)
+    {
+      for (const auto q : regs16)
+      {
+        for (const auto o : regs16)
+        {
+          assembled_instruction ai(OPCODE_EXT, p, (q << REG2_SHIFT) | static_cast<u8>(ExtOp::COPY), o << REG2_SHIFT);
+          instruction_ptr i(new InstructionEXT(p, q, o, ExtOp::COPY));
+          REQUIRE(ai == i);
+        }
+      }
+    }
+  }
+  
+  SECTION("FILL P, R, O")
+  {
+    for (const auto p : regs16)
+    {
+      for (const auto r : regs8)
+      {
+        for (const auto o : regs16)
+        {
+          assembled_instruction ai(OPCODE_EXT, p, (r << REG2_SHIFT) | static_cast<u8>(ExtOp::FILL), o << REG2_SHIFT);
+          instruction_ptr i(new InstructionEXT(p, r, o, ExtOp::FILL));
+          REQUIRE(ai == i);
+        }
+      }
+    }
+  }
+  
   /*SECTION("LD R, [NNNN]")
   {
     for (const auto r : regs8)
@@ -186,3 +278,892 @@ TEST_CASE("instructions are correctly generated", "[instruction gen]")
     }
   }*/
 }
+
+/* guest code assembled back to back from address 0, gaps are NOPs */
+struct program
+{
+  std::vector<u8> code;
+
+  u16 here() const { return code.size(); }
+
+  program& operator<<(const Instruction& i)
+  {
+    place(here(), i);
+    return *this;
+  }
+
+  /* for jumps to code which follows them */
+  void place(u16 address, const Instruction& i)
+  {
+    if (code.size() < address + i.getLength())
+      code.resize(address + i.getLength());
+
+    i.assemble(&code[address]);
+  }
+
+  void org(u16 address) { code.resize(address); }
+  void halt() { *this << InstructionJMP_NNNN(COND_UNCOND, here()); }
+};
+
+static std::vector<VM::Engine> engines()
+{
+  std::vector<VM::Engine> available;
+
+  for (VM::Engine engine : { VM::Engine::SWITCH, VM::Engine::THREADED, VM::Engine::JIT, VM::Engine::AOT })
+    if (VM::isEngineAvailable(engine))
+      available.push_back(engine);
+
+  return available;
+}
+
+static const char* engineName(VM::Engine engine)
+{
+  switch (engine)
+  {
+    case VM::Engine::SWITCH: return "switch";
+    case VM::Engine::THREADED: return "threaded";
+    case VM::Engine::JIT: return "jit";
+    case VM::Engine::AOT: return "aot";
+  }
+
+  return "";
+}
+
+static void boot(VM& vm, const program& p, VM::Engine engine)
+{
+  vm.reset();
+  vm.clearRam();
+  vm.setEngine(engine);
+  vm.copyToRam(p.code.data(), p.code.size());
+}
+
+static VM::RunResult runToHalt(VM& vm)
+{
+  VM::RunLimits limits;
+  limits.instructions = 1 << 20;
+  return vm.run(limits);
+}
+
+/* accumulates the immediate of the LD at 9 into D three times and patches it from 1
+   to 2 after the first pass, D ends up 5 when the store is seen and 3 otherwise */
+static const u16 PATCHED_IMMEDIATE = 0x0B;
+
+static program selfModifying()
+{
+  program p;
+  p << InstructionLD_NN(Reg::D, 0);
+  p << InstructionLD_NN(Reg::B, 0);
+  p << InstructionLD_NN(Reg::C, 2);
+  u16 target = p.here();
+  p << InstructionLD_NN(Reg::A, 1);
+  p << InstructionALU_R(Reg::D, Reg::D, Reg::A, Alu::ADD8);
+  p << InstructionST_PTR_NNNN(Reg::C, PATCHED_IMMEDIATE);
+  p << InstructionALU_R_NN(Reg::B, Reg::B, Alu::ADD8, 1);
+  p << InstructionCMP_NN(Reg::B, 3);
+  p << InstructionJMP_NNNN(COND_NZERO, target);
+  p.halt();
+  return p;
+}
+
+/* the translation of a program as a shared object built with the host compiler,
+   false when no compiler can be run */
+static bool buildNative(const program& p, const std::string& path)
+{
+  vm::AotTranslator translator(p.code.data(), p.code.size());
+  translator.addEntry(0);
+
+  std::string source = path + ".cpp";
+  FILE* out = fopen(source.c_str(), "w");
+
+  if (!out)
+    return false;
+
+  fputs(translator.translate().c_str(), out);
+  fclose(out);
+
+  std::string command = "c++ -O1 -shared -fPIC " + source + " -o " + path + " 2>/dev/null";
+  bool built = std::system(command.c_str()) == 0;
+  std::remove(source.c_str());
+  return built;
+}
+
+TEST_CASE("stores to code are seen by every engine", "[vm]")
+{
+  program p = selfModifying();
+  VM vm;
+
+  SECTION("engines")
+  {
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+
+      REQUIRE(runToHalt(vm).reason == VM::StopReason::HALT);
+      REQUIRE(vm.reg8(Reg::D) == 5);
+      REQUIRE(vm.ramRead(PATCHED_IMMEDIATE) == 2);
+
+      /* warm caches must also drop code written by the host */
+      vm.ramWrite(PATCHED_IMMEDIATE, 7);
+      vm.allRegs().PC = 0;
+
+      REQUIRE(runToHalt(vm).reason == VM::StopReason::HALT);
+      REQUIRE(vm.reg8(Reg::D) == 7 + 2 + 2);
+    }
+  }
+
+  SECTION("translated modules")
+  {
+    const std::string module = "./j80-test-aot.so";
+
+    if (!buildNative(p, module))
+      WARN("no host compiler, translated modules are not tested");
+    else
+    {
+      boot(vm, p, VM::Engine::AOT);
+      Result loaded = vm.loadNative(module);
+      std::remove(module.c_str());
+      REQUIRE(loaded);
+
+      REQUIRE(runToHalt(vm).reason == VM::StopReason::HALT);
+      REQUIRE(vm.reg8(Reg::D) == 5);
+
+      vm.ramWrite(PATCHED_IMMEDIATE, 7);
+      vm.allRegs().PC = 0;
+
+      REQUIRE(runToHalt(vm).reason == VM::StopReason::HALT);
+      REQUIRE(vm.reg8(Reg::D) == 7 + 2 + 2);
+      vm.unloadNative();
+    }
+  }
+}
+
+/* flags as computed right away by the original ALU */
+template <typename W> static u8 eagerFlags(Alu alu, W op1, W op2, bool carryIn)
+{
+  constexpr s32 sign = 1 << (sizeof(W)*8 - 1);
+  bool subtract = alu == Alu::SUB8 || alu == Alu::SBC8;
+  bool withCarry = alu == Alu::ADC8 || alu == Alu::SBC8;
+
+  s32 result = subtract ? s32(op1) - op2 : s32(op1) + op2;
+
+  if (withCarry && carryIn)
+    result += subtract ? -1 : 1;
+
+  bool carry = subtract ? result < 0 : result > std::numeric_limits<W>::max();
+
+  return (carry ? FLAG_CARRY : 0)
+    | (W(result) == 0 ? FLAG_ZERO : 0)
+    | (result & sign ? FLAG_SIGN : 0)
+    | ((op1 & sign) != (result & sign) ? FLAG_OVERFLOW : 0);
+}
+
+TEST_CASE("lazy arithmetic flags match the eager ones", "[vm]")
+{
+  const Alu alus[] = { Alu::ADD8, Alu::ADC8, Alu::SUB8, Alu::SBC8 };
+  const u8 bytes[] = { 0x00, 0x01, 0x55, 0x7F, 0x80, 0xFF };
+  const u16 words[] = { 0x0000, 0x0001, 0x1234, 0x7FFF, 0x8000, 0xFFFF };
+
+  VM vm;
+
+  for (VM::Engine engine : engines())
+  {
+    INFO(engineName(engine));
+
+    for (Alu alu : alus)
+    {
+      for (bool carryIn : { false, true })
+      {
+        for (u8 op1 : bytes)
+        {
+          for (u8 op2 : bytes)
+          {
+            program p;
+            p << InstructionLD_NN(Reg::A, carryIn ? FLAG_CARRY : 0) << InstructionLF(Reg::A);
+            p << InstructionLD_NN(Reg::B, op1) << InstructionLD_NN(Reg::C, op2);
+            p << InstructionALU_R(Reg::E, Reg::B, Reg::C, alu, false) << InstructionSF(Reg::Y);
+            p.halt();
+
+            boot(vm, p, engine);
+            runToHalt(vm);
+
+            u8 expected = eagerFlags<u8>(alu, op1, op2, carryIn);
+            INFO(Opcodes::aluName(alu) << " " << int(op1) << ", " << int(op2) << " carry " << carryIn);
+            REQUIRE((vm.flags() & 0x0F) == expected);
+            REQUIRE(vm.reg8(Reg::Y) == expected);
+            REQUIRE((vm.allRegs().FLAGS & 0x0F) == expected);
+          }
+        }
+
+        /* SBC16 has no encoding of its own (see Alu), an extended SBC isn't an operation */
+        if (alu == Alu::SBC8)
+          continue;
+
+        for (u16 op1 : words)
+        {
+          for (u16 op2 : words)
+          {
+            program p;
+            p << InstructionLD_NN(Reg::A, carryIn ? FLAG_CARRY : 0) << InstructionLF(Reg::A);
+            p << InstructionLD_NNNN(Reg::IX, op1) << InstructionLD_NNNN(Reg::IY, op2);
+            p << InstructionALU_R(Reg::FP, Reg::IX, Reg::IY, alu, true) << InstructionSF(Reg::Y);
+            p.halt();
+
+            boot(vm, p, engine);
+            runToHalt(vm);
+
+            u8 expected = eagerFlags<u16>(alu, op1, op2, carryIn);
+            INFO(Opcodes::aluName(alu | Alu::EXTENDED_BIT) << " " << op1 << ", " << op2 << " carry " << carryIn);
+            REQUIRE((vm.flags() & 0x0F) == expected);
+            REQUIRE(vm.reg8(Reg::Y) == expected);
+            REQUIRE((vm.allRegs().FLAGS & 0x0F) == expected);
+          }
+        }
+      }
+    }
+  }
+}
+
+/* counts A from 1 to 10, storing each value to WATCHED */
+static const u16 WATCHED = 0x0100;
+static const u16 COUNT_LOOP = 0x03;
+static const u16 COUNT_STORE = 0x06;
+
+static program counter(u16& end)
+{
+  program p;
+  p << InstructionLD_NN(Reg::A, 0);
+  u16 loop = p.here();
+  p << InstructionALU_R_NN(Reg::A, Reg::A, Alu::ADD8, 1);
+  p << InstructionST_PTR_NNNN(Reg::A, WATCHED);
+  p << InstructionCMP_NN(Reg::A, 10);
+  p << InstructionJMP_NNNN(COND_NZERO, loop);
+  end = p.here();
+  p.halt();
+  return p;
+}
+
+TEST_CASE("runs stop on the first limit they hit", "[vm]")
+{
+  u16 end;
+  program p = counter(end);
+  VM vm;
+
+  SECTION("instructions")
+  {
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+      VM::RunLimits limits;
+
+      limits.instructions = 5;
+      VM::RunResult result = vm.run(limits);
+
+      REQUIRE(result.reason == VM::StopReason::INSTRUCTION_LIMIT);
+      REQUIRE(result.instructions == 5);
+      REQUIRE(vm.reg8(Reg::A) == 1);
+      REQUIRE(vm.pc() == COUNT_LOOP);
+    }
+  }
+
+  SECTION("halt")
+  {
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+      VM::RunLimits limits;
+
+      VM::RunResult result = vm.run(limits);
+
+      REQUIRE(result.reason == VM::StopReason::HALT);
+      REQUIRE(vm.pc() == end);
+      REQUIRE(vm.reg8(Reg::A) == 10);
+
+      limits.stopOnHalt = false;
+      limits.instructions = 100;
+      result = vm.run(limits);
+
+      REQUIRE(result.reason == VM::StopReason::INSTRUCTION_LIMIT);
+      REQUIRE(result.instructions == 100);
+    }
+  }
+
+  SECTION("cycles")
+  {
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+      VM::RunLimits limits;
+
+      vm.setTiming(VM::Timing::CYCLE_ACCURATE);
+      limits.cycles = 20;
+      VM::RunResult result = vm.run(limits);
+
+      REQUIRE(result.reason == VM::StopReason::CYCLE_LIMIT);
+      REQUIRE(result.cycles >= 20);
+      REQUIRE(result.cycles < 30);
+      REQUIRE(vm.cycles() == result.cycles);
+      vm.setTiming(VM::Timing::THROUGHPUT);
+    }
+  }
+
+  SECTION("breakpoints resume by executing the instruction they stopped before")
+  {
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+      VM::RunLimits limits;
+
+      vm.setBreakpoint(COUNT_STORE);
+
+      for (u8 value = 1; value <= 3; ++value)
+      {
+        VM::RunResult result = vm.run(limits);
+
+        REQUIRE(result.reason == VM::StopReason::BREAKPOINT);
+        REQUIRE(vm.pc() == COUNT_STORE);
+        REQUIRE(vm.reg8(Reg::A) == value);
+        REQUIRE(vm.ramRead(WATCHED) == value - 1);
+      }
+
+      vm.clearBreakpoint(COUNT_STORE);
+      REQUIRE(vm.run(limits).reason == VM::StopReason::HALT);
+    }
+  }
+
+  SECTION("breakpoints of the limits only last for the run")
+  {
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+      VM::RunLimits limits;
+
+      limits.breakpoints = { COUNT_STORE };
+
+      REQUIRE(vm.run(limits).reason == VM::StopReason::BREAKPOINT);
+      REQUIRE(vm.pc() == COUNT_STORE);
+      REQUIRE_FALSE(vm.isBreakpoint(COUNT_STORE));
+    }
+  }
+
+  SECTION("conditional breakpoints")
+  {
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+      VM::RunLimits limits;
+
+      REQUIRE(vm.setBreakpoint(COUNT_STORE, "A == 4"));
+      REQUIRE_FALSE(vm.setBreakpoint(COUNT_STORE, "A =="));
+
+      REQUIRE(vm.run(limits).reason == VM::StopReason::BREAKPOINT);
+      REQUIRE(vm.reg8(Reg::A) == 4);
+      vm.clearBreakpoints();
+    }
+  }
+
+  SECTION("watchpoints stop after the access")
+  {
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+      VM::RunLimits limits;
+
+      vm.setWatchpoint(WATCHED, 1);
+      VM::RunResult result = vm.run(limits);
+
+      REQUIRE(result.reason == VM::StopReason::WATCHPOINT);
+      REQUIRE(vm.pc() == COUNT_STORE + 3);
+      REQUIRE(vm.lastWatchHit().pc == COUNT_STORE);
+      REQUIRE(vm.lastWatchHit().address == WATCHED);
+      REQUIRE(vm.lastWatchHit().value == 1);
+      REQUIRE(vm.lastWatchHit().write);
+      vm.clearWatchpoints();
+    }
+  }
+
+  SECTION("idle")
+  {
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+      VM::RunLimits limits;
+
+      vm.setIdleSkipping(true);
+      limits.stopOnHalt = false;
+      VM::RunResult result = vm.run(limits);
+
+      REQUIRE(result.reason == VM::StopReason::IDLE);
+      REQUIRE(vm.pc() == end);
+      vm.setIdleSkipping(false);
+    }
+  }
+}
+
+TEST_CASE("snapshots restore registers, memory and code", "[vm]")
+{
+  program p = selfModifying();
+  VM vm;
+
+  for (VM::Engine engine : engines())
+  {
+    INFO(engineName(engine));
+    boot(vm, p, engine);
+
+    /* before the first store to the code */
+    VM::RunLimits limits;
+    limits.instructions = 4;
+    vm.run(limits);
+
+    Snapshot snapshot = vm.snapshot();
+    Regs regs = vm.allRegs();
+    std::vector<u8> memory(vm.ram(), vm.ram() + VM::MEMORY_SIZE);
+
+    runToHalt(vm);
+    REQUIRE(vm.reg8(Reg::D) == 5);
+    u64 cycles = vm.cycles(), retired = vm.retiredInstructions();
+
+    vm.restore(snapshot);
+    REQUIRE(memcmp(&vm.allRegs(), &regs, sizeof(Regs)) == 0);
+    REQUIRE(memcmp(vm.ram(), memory.data(), VM::MEMORY_SIZE) == 0);
+    REQUIRE(vm.cycles() == cycles);
+    REQUIRE(vm.retiredInstructions() == retired);
+
+    runToHalt(vm);
+    REQUIRE(vm.reg8(Reg::D) == 5);
+  }
+}
+
+/* counts the expirations of a periodic timer on interrupt 1 in X while spinning */
+static const u16 TIMER_PERIOD = 100;
+
+static program timerCounter()
+{
+  program p;
+  p.org(VM::INTERRUPT_VECTOR_BASE + VM::INTERRUPT_COUNT * VM::INTERRUPT_VECTOR_SIZE);
+
+  u16 start = p.here();
+  p.place(0, InstructionJMP_NNNN(COND_UNCOND, start));
+
+  p << InstructionLD_NNNN(Reg::SP, 0x8000);
+  p << InstructionLD_NN(Reg::A, TIMER_PERIOD & 0xFF) << InstructionST_PTR_NNNN(Reg::A, vm::Timer::PORT);
+  p << InstructionLD_NN(Reg::A, TIMER_PERIOD >> 8) << InstructionST_PTR_NNNN(Reg::A, vm::Timer::PORT + 1);
+  p << InstructionLD_NN(Reg::A, vm::Timer::ENABLE | vm::Timer::PERIODIC | (1 << vm::Timer::INTERRUPT_SHIFT));
+  p << InstructionST_PTR_NNNN(Reg::A, vm::Timer::PORT + 2);
+  p << InstructionLD_NN(Reg::X, 0) << InstructionEI();
+
+  u16 loop = p.here();
+  p << InstructionALU_R_NN(Reg::Y, Reg::Y, Alu::ADD8, 1) << InstructionJMP_NNNN(COND_UNCOND, loop);
+
+  u16 handler = p.here();
+  p << InstructionLD_PTR_NNNN(Reg::A, vm::Timer::PORT + 3);
+  p << InstructionALU_R(Reg::X, Reg::X, Reg::A, Alu::ADD8) << InstructionEI() << InstructionRET(COND_UNCOND);
+
+  p.place(VM::INTERRUPT_VECTOR_BASE + VM::INTERRUPT_VECTOR_SIZE, InstructionJMP_NNNN(COND_UNCOND, handler));
+  return p;
+}
+
+TEST_CASE("traces replay interrupts and device reads on every engine", "[vm]")
+{
+  const std::string path = "j80-test.j80t";
+  program p = timerCounter();
+
+  for (VM::Engine recorded : engines())
+  {
+    Regs last;
+    u64 instructions;
+
+    {
+      VM vm;
+      boot(vm, p, recorded);
+
+      vm::Timer timer(vm);
+      vm.mapDevice(&timer, vm::Timer::PORT, vm::Timer::PORT_COUNT);
+
+      vm::TraceRecorder recorder(vm, 64);
+      REQUIRE(recorder.open(path));
+      instructions = recorder.run(3000);
+      instructions += recorder.run(1234);
+      recorder.close();
+
+      last = vm.allRegs();
+      REQUIRE(vm.reg8(Reg::X) > 0);
+    }
+
+    for (VM::Engine replayed : engines())
+    {
+      INFO(engineName(recorded) << " replayed on " << engineName(replayed));
+
+      VM vm;
+      vm.setEngine(replayed);
+
+      /* reads of the ports are answered from the trace, interrupts are raised by the
+         replay so the timer itself must not run again */
+      vm::Device ports;
+      vm.mapDevice(&ports, vm::Timer::PORT, vm::Timer::PORT_COUNT);
+
+      vm::TraceReader reader;
+      REQUIRE(reader.open(path));
+
+      vm::TraceReplayer replayer(vm);
+      vm::TraceReplayer::Result result = replayer.replay(reader);
+
+      REQUIRE(result.error == "");
+      REQUIRE(result.success);
+      REQUIRE(result.instructions == instructions);
+      REQUIRE(memcmp(vm.allRegs().file16, last.file16, sizeof(last.file16)) == 0);
+      REQUIRE(vm.pc() == last.PC);
+      REQUIRE(vm.allRegs().FLAGS == last.FLAGS);
+    }
+  }
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("conditions compile and evaluate like C", "[vm]")
+{
+  vm::Condition condition;
+  Regs regs;
+  memset(&regs, 0, sizeof(Regs));
+  std::vector<u8> memory(VM::MEMORY_SIZE, 0);
+
+  REQUIRE(condition.compile(""));
+  REQUIRE(condition.isAlways());
+
+  REQUIRE(condition.compile("A == 10 && [IX + 2] != 0FFh || (FLAGS & 2)"));
+  REQUIRE_FALSE(condition.isAlways());
+
+  regs.A = 10;
+  regs.IX = 0x100;
+  REQUIRE(condition.evaluate(regs, memory.data()));
+
+  memory[0x102] = 0xFF;
+  REQUIRE_FALSE(condition.evaluate(regs, memory.data()));
+
+  regs.FLAGS = FLAG_ZERO;
+  REQUIRE(condition.evaluate(regs, memory.data()));
+
+  REQUIRE(condition.compile("1 + 2 << 1 == 6 && 0x10 == 10h && ~0 != 0 && !B && -1 < 0 == 0"));
+  REQUIRE(condition.evaluate(regs, memory.data()));
+
+  REQUIRE(condition.compile("PC == 1234h && CD == 0102h && C == 1"));
+  regs.PC = 0x1234;
+  regs.CD = 0x0102;
+  REQUIRE(condition.evaluate(regs, memory.data()));
+
+  for (const char* invalid : { "A ==", "(A", "[IX", "Q == 1", "A B", "1 +* 2" })
+  {
+    INFO(invalid);
+    REQUIRE_FALSE(condition.compile(invalid));
+  }
+}
+
+struct logged_event : public vm::EventHandler
+{
+  VM& vm;
+  char name;
+  std::string& log;
+  u64 delay;
+
+  logged_event(VM& vm, char name, std::string& log, u64 delay = 0) : vm(vm), name(name), log(log), delay(delay) { }
+
+  void fire(u64 deadline) override
+  {
+    REQUIRE(vm.clock() >= deadline);
+    log += name;
+
+    if (delay)
+    {
+      vm.scheduleIn(delay, this);
+      delay = 0;
+    }
+  }
+};
+
+TEST_CASE("events fire in deadline order and timers interrupt", "[vm]")
+{
+  VM vm;
+
+  SECTION("event order")
+  {
+    program p;
+    p << InstructionNOP() << InstructionJMP_NNNN(COND_UNCOND, u16(0));
+
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+
+      std::string log;
+      logged_event a(vm, 'a', log), b(vm, 'b', log), c(vm, 'c', log, 150), d(vm, 'd', log);
+
+      /* equal deadlines keep their scheduling order, c comes back after d */
+      vm.schedule(300, &d);
+      vm.schedule(100, &a);
+      vm.schedule(200, &c);
+      vm.schedule(100, &b);
+
+      VM::RunLimits limits;
+      limits.instructions = 1000;
+      vm.run(limits);
+
+      REQUIRE(log == "abcdc");
+      REQUIRE(vm.nextEventDeadline() == vm::EventQueue::NEVER);
+    }
+  }
+
+  SECTION("timer interrupts")
+  {
+    program p = timerCounter();
+    u16 expirations = 0;
+
+    for (VM::Engine engine : engines())
+    {
+      INFO(engineName(engine));
+      boot(vm, p, engine);
+
+      vm::Timer timer(vm);
+      vm.mapDevice(&timer, vm::Timer::PORT, vm::Timer::PORT_COUNT);
+
+      VM::RunLimits limits;
+      limits.instructions = 10000;
+      REQUIRE(vm.run(limits).reason == VM::StopReason::INSTRUCTION_LIMIT);
+
+      /* every engine takes them after the same instructions */
+      if (!expirations)
+        expirations = vm.reg8(Reg::X);
+
+      REQUIRE(vm.reg8(Reg::X) == expirations);
+      REQUIRE(expirations > 10000 / TIMER_PERIOD - 5);
+      REQUIRE(expirations <= 10000 / TIMER_PERIOD);
+
+      vm.unmapDevice(&timer);
+    }
+  }
+}
+
+TEST_CASE("images keep code, entry point, stack and symbols", "[image]")
+{
+  const std::string path = "j80-test.img";
+  const u16 origin = 0x1000;
+
+  /* the entry point jumps to the program at 0, which patches its own code */
+  std::vector<u8> bytes = selfModifying().code;
+  program p;
+  p << InstructionJMP_NNNN(COND_UNCOND, u16(0));
+
+  symbols::SymbolTable table;
+  table.addLabel("start", 0);
+  table.addLabel("main", origin);
+
+  image::ImageBuilder builder;
+  builder.setEntryPoint(origin);
+  builder.setStackBase(0xF000);
+  builder.setInterrupts(0b0010);
+  builder.addRam(0, bytes.data(), bytes.size());
+  builder.addRam(origin, p.code.data(), p.code.size());
+  builder.setSymbols(table.serialize());
+  REQUIRE(builder.save(path));
+
+  image::Image image;
+  REQUIRE(image.open(path));
+  REQUIRE(image.entryPoint() == origin);
+  REQUIRE(image.hasStackBase());
+  REQUIRE(image.stackBase() == 0xF000);
+  REQUIRE(image.interrupts() == 0b0010);
+  REQUIRE_FALSE(image.hasBanks());
+
+  symbols::SymbolMap map;
+  REQUIRE(image.openSymbols(map));
+  u16 address;
+  REQUIRE(map.addressOf("main", address));
+  REQUIRE(address == origin);
+  REQUIRE(map.describe(origin + 3) == "main+3");
+
+  VM vm;
+
+  for (VM::Engine engine : engines())
+  {
+    INFO(engineName(engine));
+    vm.reset();
+    vm.clearRam();
+    vm.setEngine(engine);
+    image.load(vm);
+
+    REQUIRE(vm.pc() == origin);
+    REQUIRE(vm.reg16(Reg::SP) == 0xF000);
+    REQUIRE(memcmp(vm.ram(), bytes.data(), bytes.size()) == 0);
+    REQUIRE(memcmp(vm.ram() + origin, p.code.data(), p.code.size()) == 0);
+
+    /* mapped pages are private, the program patches itself without touching the file */
+    REQUIRE(runToHalt(vm).reason == VM::StopReason::HALT);
+    REQUIRE(vm.reg8(Reg::D) == 5);
+    REQUIRE(image.segment(0).address == 0);
+    REQUIRE(image.contents(image.segment(0))[PATCHED_IMMEDIATE] == 1);
+  }
+
+  map.close();
+  image.close();
+  std::remove(path.c_str());
+}
+
+TEST_CASE("multiplications and divisions set flags and survive a zero divisor", "[vm]")
+{
+  struct operation
+  {
+    ExtOp op;
+    u16 op1, op2;
+    u16 result, remainder;
+    u8 flags;
+  };
+
+  const operation operations[] = {
+    { ExtOp::MUL8, 0x0C, 0x0B, 0x0084, 0, 0 },
+    { ExtOp::MUL8, 0x10, 0x10, 0x0100, 0, FLAG_CARRY | FLAG_OVERFLOW },
+    { ExtOp::MUL8, 0xFF, 0xFF, 0xFE01, 0, FLAG_CARRY | FLAG_OVERFLOW | FLAG_SIGN },
+    { ExtOp::MUL8, 0x00, 0x7F, 0x0000, 0, FLAG_ZERO },
+    { ExtOp::MUL16, 0x0100, 0x007F, 0x7F00, 0, 0 },
+    { ExtOp::MUL16, 0x4000, 0x0002, 0x8000, 0, FLAG_SIGN },
+    { ExtOp::MUL16, 0x0100, 0x0100, 0x0000, 0, FLAG_CARRY | FLAG_OVERFLOW | FLAG_ZERO },
+    { ExtOp::DIV8, 0x1234, 0x10, 0x0123, 0x04, 0 },
+    { ExtOp::DIV8, 0xFFF9, 0x02, 0x7FFC, 0x01, 0 },
+    { ExtOp::DIV8, 0x0005, 0x07, 0x0000, 0x05, FLAG_ZERO },
+    { ExtOp::DIV8, 0xFFFF, 0x01, 0xFFFF, 0x00, FLAG_SIGN }
+  };
+
+  VM vm;
+
+  for (VM::Engine engine : engines())
+  {
+    INFO(engineName(engine));
+
+    for (const operation& o : operations)
+    {
+      INFO(Opcodes::extName(o.op) << " " << o.op1 << ", " << o.op2);
+
+      program p;
+      /* every flag set beforehand so that clearing them is seen too */
+      p << InstructionLD_NN(Reg::A, 0x0F) << InstructionLF(Reg::A);
+
+      if (o.op == ExtOp::MUL8)
+        p << InstructionLD_NN(Reg::B, o.op1) << InstructionLD_NN(Reg::C, o.op2) << InstructionEXT(Reg::IX, Reg::B, Reg::C, o.op);
+      else if (o.op == ExtOp::MUL16)
+        p << InstructionLD_NNNN(Reg::CD, o.op1) << InstructionLD_NNNN(Reg::EF, o.op2) << InstructionEXT(Reg::IX, Reg::CD, Reg::EF, o.op);
+      else
+        p << InstructionLD_NNNN(Reg::CD, o.op1) << InstructionLD_NN(Reg::X, o.op2) << InstructionEXT(Reg::IX, Reg::CD, Reg::X, o.op);
+
+      p.halt();
+      boot(vm, p, engine);
+      runToHalt(vm);
+
+      REQUIRE(vm.reg16(Reg::IX) == o.result);
+      if (o.op == ExtOp::DIV8)
+        REQUIRE(vm.reg8(Reg::X) == o.remainder);
+      REQUIRE((vm.flags() & 0x0F) == o.flags);
+    }
+
+    program p;
+    p << InstructionLD_NN(Reg::A, 0x0F) << InstructionLF(Reg::A);
+    p << InstructionLD_NNNN(Reg::IX, 0xBEEF) << InstructionLD_NNNN(Reg::CD, 0x1234) << InstructionLD_NN(Reg::X, 0);
+    p << InstructionEXT(Reg::IX, Reg::CD, Reg::X, ExtOp::DIV8);
+    p.halt();
+
+    boot(vm, p, engine);
+    REQUIRE(runToHalt(vm).reason == VM::StopReason::HALT);
+    REQUIRE(vm.reg16(Reg::IX) == 0xBEEF);
+    REQUIRE(vm.reg16(Reg::CD) == 0x1234);
+    REQUIRE(vm.reg8(Reg::X) == 0);
+    REQUIRE((vm.flags() & 0x0F) == FLAG_OVERFLOW);
+  }
+}
+
+/* a single block operation at 4000h run by the engine from the given registers, the
+   code is written into the initial memory */
+static const u16 BLOCK_ORIGIN = 0x4000;
+
+static void runBlock(VM& vm, VM::Engine engine, std::vector<u8>& memory, ExtOp op, u16 p, u16 q, u16 o)
+{
+  program code;
+  code.org(BLOCK_ORIGIN);
+  code << InstructionEXT(Reg::BA, op == ExtOp::FILL ? Reg::C : Reg::EF, Reg::IX, op);
+  code.halt();
+  std::copy(code.code.begin() + BLOCK_ORIGIN, code.code.end(), memory.begin() + BLOCK_ORIGIN);
+
+  vm.reset();
+  vm.setEngine(engine);
+  vm.copyToRam(memory.data(), memory.size());
+
+  Regs& regs = vm.allRegs();
+  regs.PC = BLOCK_ORIGIN;
+  regs.BA = p;
+  regs.IX = o;
+
+  if (op == ExtOp::FILL)
+    regs.C = q;
+  else
+    regs.EF = q;
+
+  VM::RunLimits limits;
+  limits.instructions = 1;
+  REQUIRE(vm.run(limits).instructions == 1);
+}
+
+TEST_CASE("block operations copy through a buffer and wrap at 64K", "[vm]")
+{
+  std::vector<u8> memory(VM::MEMORY_SIZE);
+
+  for (u32 k = 0; k < VM::MEMORY_SIZE; ++k)
+    memory[k] = u8(k * 7 + (k >> 8));
+
+  /* destination, source and count, the code at BLOCK_ORIGIN is never overwritten */
+  const u16 copies[][3] = {
+    { 0x1000, 0x2000, 0x0100 },
+    { 0x1010, 0x1000, 0x0100 },
+    { 0x1000, 0x1010, 0x0100 },
+    { 0x0100, 0xFFF0, 0x0020 },
+    { 0xFFF0, 0x0100, 0x0020 },
+    { 0xFF80, 0xFFC0, 0x0080 },
+    { 0x8000, 0x0000, 0x9000 },
+    { 0x5000, 0x5000, 0x0100 },
+    { 0x1000, 0x2000, 0x0000 }
+  };
+
+  VM vm;
+
+  for (VM::Engine engine : engines())
+  {
+    INFO(engineName(engine));
+
+    for (const auto& copy : copies)
+    {
+      INFO("COPY " << copy[0] << ", " << copy[1] << ", " << copy[2]);
+      runBlock(vm, engine, memory, ExtOp::COPY, copy[0], copy[1], copy[2]);
+
+      std::vector<u8> expected = memory;
+      for (u32 k = 0; k < copy[2]; ++k)
+        expected[u16(copy[0] + k)] = memory[u16(copy[1] + k)];
+
+      REQUIRE(memcmp(vm.ram(), expected.data(), VM::MEMORY_SIZE) == 0);
+      REQUIRE(vm.reg16(Reg::BA) == u16(copy[0] + copy[2]));
+      REQUIRE(vm.reg16(Reg::EF) == u16(copy[1] + copy[2]));
+      REQUIRE(vm.reg16(Reg::IX) == 0);
+    }
+
+    runBlock(vm, engine, memory, ExtOp::FILL, 0xFFF8, 0xA5, 0x10);
+
+    for (u32 k = 0xFFF8; k < 0x10008; ++k)
+      REQUIRE(vm.ramRead(u16(k)) == 0xA5);
+    REQUIRE(vm.ramRead(0xFFF7) == memory[0xFFF7]);
+    REQUIRE(vm.ramRead(0x0008) == memory[0x0008]);
+    REQUIRE(vm.reg16(Reg::BA) == 0x0008);
+    REQUIRE(vm.reg16(Reg::IX) == 0);
+  }
+}
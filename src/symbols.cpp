@@ -0,0 +1,299 @@
+#include "symbols.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "support/format/format.h"
+
+#if !_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace symbols;
+
+static const char SYMBOLS_MAGIC[4] = { 'J', '8', '0', 'S' };
+static constexpr u16 SYMBOLS_VERSION = 1;
+
+std::vector<u8> SymbolTable::serialize() const
+{
+  std::string strings;
+  auto intern = [&strings] (const std::string& value) {
+    u32 offset = strings.size();
+    strings.append(value.c_str(), value.size() + 1);
+    return offset;
+  };
+
+  std::vector<Label> sortedLabels;
+  for (const auto& label : labels)
+    sortedLabels.push_back({ label.second, 0, intern(label.first) });
+
+  std::stable_sort(sortedLabels.begin(), sortedLabels.end(), [] (const Label& a, const Label& b) { return a.address < b.address; });
+
+  std::vector<u32> names(sortedLabels.size());
+  for (u32 i = 0; i < names.size(); ++i)
+    names[i] = i;
+
+  std::sort(names.begin(), names.end(), [&] (u32 a, u32 b) {
+    return strcmp(&strings[sortedLabels[a].name], &strings[sortedLabels[b].name]) < 0;
+  });
+
+  std::vector<Line> sortedLines = lines;
+  std::stable_sort(sortedLines.begin(), sortedLines.end(), [] (const Line& a, const Line& b) { return a.address < b.address; });
+
+  std::vector<Data> sortedData;
+  for (const auto& entry : data)
+    sortedData.push_back({ entry.second.first, entry.second.second, intern(entry.first) });
+
+  std::stable_sort(sortedData.begin(), sortedData.end(), [] (const Data& a, const Data& b) { return a.address < b.address; });
+
+  std::vector<u32> fileNames;
+  for (const auto& file : files)
+    fileNames.push_back(intern(file));
+
+  Header header;
+  memcpy(header.magic, SYMBOLS_MAGIC, sizeof(header.magic));
+  header.version = SYMBOLS_VERSION;
+  header.reserved = 0;
+  header.labelCount = sortedLabels.size();
+  header.lineCount = sortedLines.size();
+  header.dataCount = sortedData.size();
+  header.fileCount = fileNames.size();
+  header.stringsSize = strings.size();
+
+  std::vector<u8> contents;
+  auto append = [&contents] (const void* data, size_t length) {
+    contents.insert(contents.end(), static_cast<const u8*>(data), static_cast<const u8*>(data) + length);
+  };
+
+  append(&header, sizeof(Header));
+  append(sortedLabels.data(), sizeof(Label) * sortedLabels.size());
+  append(names.data(), sizeof(u32) * names.size());
+  append(sortedLines.data(), sizeof(Line) * sortedLines.size());
+  append(sortedData.data(), sizeof(Data) * sortedData.size());
+  append(fileNames.data(), sizeof(u32) * fileNames.size());
+  append(strings.data(), strings.size());
+
+  return contents;
+}
+
+bool SymbolTable::save(const std::string& filename) const
+{
+  std::vector<u8> contents = serialize();
+  FILE* out = fopen(filename.c_str(), "wb");
+
+  if (!out)
+    return false;
+
+  fwrite(contents.data(), 1, contents.size(), out);
+  return fclose(out) == 0;
+}
+
+bool SymbolMap::open(const std::string& filename)
+{
+  close();
+
+#if !_WIN32
+  int fd = ::open(filename.c_str(), O_RDONLY);
+
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+
+  if (fstat(fd, &info) == 0 && info.st_size > 0)
+  {
+    void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (address != MAP_FAILED)
+    {
+      mapping = address;
+      contents = static_cast<const u8*>(address);
+      size = info.st_size;
+    }
+  }
+
+  ::close(fd);
+#else
+  FILE* in = fopen(filename.c_str(), "rb");
+
+  if (!in)
+    return false;
+
+  u8 chunk[4096];
+  for (size_t read; (read = fread(chunk, 1, sizeof(chunk), in)) > 0; )
+    buffer.insert(buffer.end(), chunk, chunk + read);
+
+  fclose(in);
+  contents = buffer.data();
+  size = buffer.size();
+#endif
+
+  if (!parse())
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+bool SymbolMap::open(const u8* contents, size_t size)
+{
+  close();
+
+  this->contents = contents;
+  this->size = size;
+
+  if (!parse())
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+bool SymbolMap::parse()
+{
+  const Header* header = reinterpret_cast<const Header*>(contents);
+
+  if (size < sizeof(Header) || memcmp(header->magic, SYMBOLS_MAGIC, sizeof(header->magic)) != 0 || header->version != SYMBOLS_VERSION)
+    return false;
+
+  size_t expected = sizeof(Header) + header->labelCount * (sizeof(Label) + sizeof(u32)) + header->lineCount * sizeof(Line)
+    + header->dataCount * sizeof(Data) + header->fileCount * sizeof(u32) + header->stringsSize;
+
+  if (size != expected || (header->stringsSize && contents[size - 1] != '\0'))
+    return false;
+
+  const u8* position = contents + sizeof(Header);
+  labels = reinterpret_cast<const Label*>(position);
+  position += header->labelCount * sizeof(Label);
+  names = reinterpret_cast<const u32*>(position);
+  position += header->labelCount * sizeof(u32);
+  lines = reinterpret_cast<const Line*>(position);
+  position += header->lineCount * sizeof(Line);
+  data = reinterpret_cast<const Data*>(position);
+  position += header->dataCount * sizeof(Data);
+  files = reinterpret_cast<const u32*>(position);
+  position += header->fileCount * sizeof(u32);
+  strings = reinterpret_cast<const char*>(position);
+
+  /* lookups index straight into the tables, so every reference is checked once here,
+     the string table ends with a NUL so any offset inside it is a terminated name */
+  for (u32 i = 0; i < header->labelCount; ++i)
+    if (labels[i].name >= header->stringsSize || names[i] >= header->labelCount)
+      return false;
+
+  for (u32 i = 0; i < header->lineCount; ++i)
+    if (lines[i].file >= header->fileCount)
+      return false;
+
+  for (u32 i = 0; i < header->dataCount; ++i)
+    if (data[i].name >= header->stringsSize)
+      return false;
+
+  for (u32 i = 0; i < header->fileCount; ++i)
+    if (files[i] >= header->stringsSize)
+      return false;
+
+  this->header = header;
+  return true;
+}
+
+void SymbolMap::close()
+{
+#if !_WIN32
+  if (mapping)
+    munmap(mapping, size);
+#endif
+
+  mapping = nullptr;
+  buffer.clear();
+  contents = nullptr;
+  size = 0;
+  header = nullptr;
+}
+
+const char* SymbolMap::labelAt(u16 address, u16& offset) const
+{
+  if (!header)
+    return nullptr;
+
+  const Label* end = labels + header->labelCount;
+  const Label* it = std::upper_bound(labels, end, address, [] (u16 address, const Label& label) { return address < label.address; });
+
+  if (it == labels)
+    return nullptr;
+
+  --it;
+  offset = address - it->address;
+  return strings + it->name;
+}
+
+bool SymbolMap::addressOf(const std::string& label, u16& address) const
+{
+  if (!header)
+    return false;
+
+  const u32* end = names + header->labelCount;
+  const u32* it = std::lower_bound(names, end, label, [this] (u32 index, const std::string& label) {
+    return strcmp(strings + labels[index].name, label.c_str()) < 0;
+  });
+
+  if (it == end || label != strings + labels[*it].name)
+    return false;
+
+  address = labels[*it].address;
+  return true;
+}
+
+bool SymbolMap::lineAt(u16 address, const char*& file, u32& line) const
+{
+  if (!header)
+    return false;
+
+  const Line* end = lines + header->lineCount;
+  const Line* it = std::upper_bound(lines, end, address, [] (u16 address, const Line& line) { return address < line.address; });
+
+  if (it == lines)
+    return false;
+
+  --it;
+  file = strings + files[it->file];
+  line = it->line;
+  return true;
+}
+
+const char* SymbolMap::dataAt(u16 address, u16& offset) const
+{
+  if (!header)
+    return nullptr;
+
+  const Data* end = data + header->dataCount;
+  const Data* it = std::upper_bound(data, end, address, [] (u16 address, const Data& data) { return address < data.address; });
+
+  if (it == data || address - (it - 1)->address >= (it - 1)->length)
+    return nullptr;
+
+  --it;
+  offset = address - it->address;
+  return strings + it->name;
+}
+
+std::string SymbolMap::describe(u16 address) const
+{
+  u16 offset;
+  const char* label = labelAt(address, offset);
+
+  if (!label)
+    return fmt::format("{:04X}h", address);
+  else if (offset)
+    return fmt::format("{}+{}", label, offset);
+  else
+    return label;
+}
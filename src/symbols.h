@@ -0,0 +1,126 @@
+#ifndef _SYMBOLS_H_
+#define _SYMBOLS_H_
+
+#include "utils.h"
+
+#include <string>
+#include <vector>
+
+/* .sym files are written by the assembler next to the binary so that tools can
+   name addresses without parsing the source again, every array is sorted so that
+   lookups are binary searches straight on the mapped file
+
+   header: "J80S", u16 version, u16 reserved, u32 count of labels, lines, data
+   entries and files, u32 size of the string table, then in this order:
+
+   labels    u16 address, u16 reserved, u32 name      sorted by address
+   names     u32 index into labels                    sorted by label name
+   lines     u16 address, u16 file, u32 line          sorted by address
+   data      u16 address, u16 length, u32 name        sorted by address
+   files     u32 name
+   strings   NUL terminated, names are offsets into this table
+
+   everything is little endian */
+namespace symbols
+{
+  struct Header
+  {
+    char magic[4];
+    u16 version;
+    u16 reserved;
+    u32 labelCount;
+    u32 lineCount;
+    u32 dataCount;
+    u32 fileCount;
+    u32 stringsSize;
+  };
+
+  struct Label
+  {
+    u16 address;
+    u16 reserved;
+    u32 name;
+  };
+
+  struct Line
+  {
+    u16 address;
+    u16 file;
+    u32 line;
+  };
+
+  struct Data
+  {
+    u16 address;
+    u16 length;
+    u32 name;
+  };
+
+  static_assert(sizeof(Header) == 28 && sizeof(Label) == 8 && sizeof(Line) == 8 && sizeof(Data) == 8, "symbol file records must be packed");
+
+  /* collects symbols while assembling, entries can be added in any order */
+  class SymbolTable
+  {
+  private:
+    std::vector<std::pair<std::string, u16>> labels;
+    std::vector<Line> lines;
+    std::vector<std::pair<std::string, std::pair<u16, u16>>> data;
+    std::vector<std::string> files;
+
+  public:
+    void clear() { labels.clear(); lines.clear(); data.clear(); files.clear(); }
+
+    u16 addFile(const std::string& name) { files.push_back(name); return files.size() - 1; }
+    void addLabel(const std::string& name, u16 address) { labels.push_back(std::make_pair(name, address)); }
+    void addLine(u16 address, u16 file, u32 line) { lines.push_back({ address, file, line }); }
+    void addData(const std::string& name, u16 address, u16 length) { data.push_back(std::make_pair(name, std::make_pair(address, length))); }
+
+    const std::vector<std::pair<std::string, u16>>& getLabels() const { return labels; }
+
+    /* contents of a .sym file, also embedded as is in program images */
+    std::vector<u8> serialize() const;
+    bool save(const std::string& filename) const;
+  };
+
+  class SymbolMap
+  {
+  private:
+    const u8* contents;
+    size_t size;
+    void* mapping;
+    std::vector<u8> buffer;
+
+    const Header* header;
+    const Label* labels;
+    const u32* names;
+    const Line* lines;
+    const Data* data;
+    const u32* files;
+    const char* strings;
+
+    bool parse();
+
+  public:
+    SymbolMap() : contents(nullptr), size(0), mapping(nullptr), header(nullptr) { }
+    ~SymbolMap() { close(); }
+
+    bool open(const std::string& filename);
+    /* symbols already in memory, which must outlive the map and be 4 bytes aligned */
+    bool open(const u8* contents, size_t size);
+    void close();
+    bool isOpen() const { return header != nullptr; }
+
+    /* closest label at or before address, offset is the distance from it */
+    const char* labelAt(u16 address, u16& offset) const;
+    bool addressOf(const std::string& label, u16& address) const;
+    /* source line of the instruction starting at or before address */
+    bool lineAt(u16 address, const char*& file, u32& line) const;
+    /* data entry containing address */
+    const char* dataAt(u16 address, u16& offset) const;
+
+    /* label+offset when a label precedes address, plain hex address otherwise */
+    std::string describe(u16 address) const;
+  };
+}
+
+#endif
@@ -30,6 +30,9 @@ std::string nanoc::Mnemonics::mnemonicForBinary(Binary op)
   switch (op) {
     case Binary::ADDITION: return "+";
     case Binary::SUBTRACTION: return "-";
+    case Binary::MULTIPLICATION: return "*";
+    case Binary::DIVISION: return "/";
+    case Binary::MODULO: return "%";
     case Binary::AND: return "&";
     case Binary::OR: return "|";
     case Binary::XOR: return "^";
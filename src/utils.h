@@ -49,6 +49,9 @@ namespace nanoc {
   {
     ADDITION,
     SUBTRACTION,
+    MULTIPLICATION,
+    DIVISION,
+    MODULO,
     AND,
     OR,
     XOR,
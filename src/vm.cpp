@@ -1,10 +1,150 @@
 #include "vm.h"
 
 #include "opcodes.h"
+#include "vm/aot.h"
+#include "vm/jit.h"
+#include "vm/memory.h"
+#include "vm/profiler.h"
+#include "vm/trace.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <new>
+
+VM::VM() : sout(nullptr), fusions(ALL_FUSIONS), engine(J80_THREADED_DISPATCH ? Engine::THREADED : Engine::SWITCH), stopRequested(false), profiler(nullptr), recorder(nullptr), timing(Timing::THROUGHPUT),
+  resumeAddress(NO_RESUME), breakHit(false), haltEnabled(false), haltHit(false), watchHit(false), idleSkipping(false), idleHit(false)
+{
+  reset();
+  memory = vm::allocatePages(MEMORY_SIZE);
+  
+  if (!memory)
+    throw std::bad_alloc();
+  
+  bus.setRam(memory);
+  bus.setWatcher(this);
+  breakpoints.fill(0);
+  dirtyPages.fill(~u64(0));
+  dataSegmentStart = 0xFFFFFFFF;
+}
+
+VM::~VM()
+{
+  vm::releasePages(memory, MEMORY_SIZE);
+}
+
+/* only the pages written lose their code, devices such as vm::BankedRam copy into RAM
+   while a program runs */
+void VM::ramReplaced(u32 start, size_t length)
+{
+  if (length == 0)
+    return;
+  
+  markDirty(start, length);
+  
+  for (u32 page = start / DecodeCache::PAGE_SIZE; page <= (start + length - 1) / DecodeCache::PAGE_SIZE; ++page)
+    invalidateCode(page);
+}
+
+void VM::copyToRam(const u8* data, size_t length, u16 offset)
+{
+  memcpy(&memory[offset], data, length);
+  ramReplaced(offset, length);
+}
+
+void VM::mapRam(const vm::FileMapping& file, size_t offset, u16 address, u32 length)
+{
+  file.mapInto(&memory[address], offset, length);
+  ramReplaced(address, length);
+}
+
+void VM::clearRam()
+{
+  memset(memory, 0, MEMORY_SIZE);
+  markDirty(0, MEMORY_SIZE);
+  decodeCache.clear();
+  
+#if J80_JIT
+  if (jit)
+    jit->flush();
+#endif
+  
+  if (aot)
+    aot->invalidateAll();
+}
+
+constexpr u8 Regs::REG8_OFFSETS[8];
+static_assert(offsetof(Regs, XY) == 6 && offsetof(Regs, X) == 7 && offsetof(Regs, IY) == 14, "register file must follow the encoding order");
+
+constexpr u32 Snapshot::PAGE_SIZE;
+constexpr u32 Snapshot::PAGE_COUNT;
+
+void VM::markDirty(u32 start, size_t length)
+{
+  if (length == 0)
+    return;
+  
+  for (u32 page = start / Snapshot::PAGE_SIZE; page <= (start + length - 1) / Snapshot::PAGE_SIZE; ++page)
+    dirtyPages[page / 64] |= u64(1) << (page % 64);
+}
+
+void VM::invalidateCode(u32 page)
+{
+  decodeCache.invalidatePage(page);
+  
+#if J80_JIT
+  if (jit)
+    jit->invalidatePage(page);
+#endif
+  
+  if (aot)
+    aot->invalidatePage(page);
+}
+
+Snapshot VM::snapshot()
+{
+  Snapshot snapshot;
+  snapshot.regs = regs;
+  snapshot.lazyFlags = lazyFlags;
+  snapshot.interruptEnabled = interruptEnabled;
+  
+  for (u32 page = 0; page < Snapshot::PAGE_COUNT; ++page)
+  {
+    if (isDirty(page) || !cleanPages[page])
+    {
+      auto copy = std::make_shared<Snapshot::Page>();
+      memcpy(copy->data(), &memory[page * Snapshot::PAGE_SIZE], Snapshot::PAGE_SIZE);
+      cleanPages[page] = std::move(copy);
+    }
+  }
+  
+  dirtyPages.fill(0);
+  snapshot.pages = cleanPages;
+  return snapshot;
+}
+
+void VM::restore(const Snapshot& snapshot)
+{
+  for (u32 page = 0; page < Snapshot::PAGE_COUNT; ++page)
+  {
+    if (isDirty(page) || cleanPages[page] != snapshot.pages[page])
+    {
+      memcpy(&memory[page * Snapshot::PAGE_SIZE], snapshot.pages[page]->data(), Snapshot::PAGE_SIZE);
+      invalidateCode(page);
+    }
+  }
+  
+  dirtyPages.fill(0);
+  cleanPages = snapshot.pages;
+  
+  regs = snapshot.regs;
+  lazyFlags = snapshot.lazyFlags;
+  interruptEnabled = snapshot.interruptEnabled;
+}
 
 bool VM::isConditionTrue(JumpCondition condition) const
 {
-  u8 flags = regs.FLAGS;
+  u8 flags = this->flags();
   
   switch (condition) {
     case COND_CARRY: return flags & FLAG_CARRY;
@@ -16,15 +156,92 @@ bool VM::isConditionTrue(JumpCondition condition) const
     case COND_SIGN: return flags & FLAG_SIGN;
     case COND_NSIGN: return !(flags & FLAG_SIGN);
     case COND_UNCOND: return true;
+    
+    /* the unconditional bit wins over whatever is in the condition field */
+    default: return true;
   }
 }
 
+void VM::setStdOut(StdOut* out)
+{
+  if (sout)
+    unmapDevice(sout);
+  
+  sout = out;
+  
+  if (sout)
+    mapDevice(sout, StdOut::PORT, 1, vm::MemoryBus::WRITE);
+}
+
+void VM::mapDevice(vm::Device* device, u16 start, u32 length, vm::MemoryBus::Access access)
+{
+  bus.map(device, start, length, access);
+  
+  /* translated loads read RAM directly where nothing is mapped */
+#if J80_JIT
+  if (jit)
+    jit->flush();
+#endif
+}
+
+void VM::unmapDevice(vm::Device* device)
+{
+  bus.unmap(device);
+  
+#if J80_JIT
+  if (jit)
+    jit->flush();
+#endif
+}
+
 void VM::ramWrite(u16 address, u8 value)
 {
-  if (address == 0xFFFF && sout)
-    sout->out(value);
-  else
-    memory[address] = value;
+  if (bus.write(address, value))
+  {
+    markDirty(address);
+    codeWritten(address);
+  }
+}
+
+/* self modifying code: drop every decoded instruction overlapping the address */
+void VM::codeWritten(u16 address)
+{
+  if (decodeCache.mayContain(address))
+    decodeCache.invalidate(address);
+  
+#if J80_JIT
+  if (jit && jit->covers(address))
+    jit->invalidate(address);
+#endif
+  
+  if (aot && aot->covers(address))
+    aot->invalidate(address);
+}
+
+/* same as a ramWrite for each byte, pages which never held code are skipped whole */
+void VM::blockWritten(u16 start, u32 length)
+{
+  markDirty(start, length);
+  
+  const u32 end = start + length;
+  
+  for (u32 address = start; address < end; )
+  {
+    u32 pageEnd = std::min(end, (address / DecodeCache::PAGE_SIZE + 1) * DecodeCache::PAGE_SIZE);
+    bool code = decodeCache.mayContain(address) || (aot && aot->isLoaded());
+    
+#if J80_JIT
+    code = code || (jit && jit->covers(address));
+#endif
+    
+    if (code)
+    {
+      for (; address < pageEnd; ++address)
+        codeWritten(address);
+    }
+    
+    address = pageEnd;
+  }
 }
 
 template <typename W> void aluFlagsArithmetic(const W& op1, const W& op2, const W& dest)
@@ -60,15 +277,13 @@ template <typename W> void VM::alu(Alu op, const W &op1, const W &op2, W &dest,
     {
       result = op1 + op2;
       setArithmeticFlags = true;
-      setFlag(FLAG_CARRY, result > std::numeric_limits<W>::max());
       break;
     }
     case Alu::ADC8:
     case Alu::ADC16:
     {
-      result = op1 + op2 + (isFlagSet(FLAG_CARRY) ? 1 : 0);
+      result = op1 + op2 + (carry() ? 1 : 0);
       dest = result;
-      setFlag(FLAG_CARRY, result > std::numeric_limits<W>::max());
       setArithmeticFlags = true;
       break;
     }
@@ -76,15 +291,13 @@ template <typename W> void VM::alu(Alu op, const W &op1, const W &op2, W &dest,
     case Alu::SUB16:
     {
       result = op1 - op2;
-      setFlag(FLAG_CARRY, result < 0);
       setArithmeticFlags = true;
       break;
     }
     case Alu::SBC8:
     case Alu::SBC16:
     {
-      result = op1 - op2 - (isFlagSet(FLAG_CARRY) ? 1 : 0);
-      setFlag(FLAG_CARRY, result < 0);
+      result = op1 - op2 - (carry() ? 1 : 0);
       setArithmeticFlags = true;
       break;
     }
@@ -108,6 +321,7 @@ template <typename W> void VM::alu(Alu op, const W &op1, const W &op2, W &dest,
     case Alu::LSH16:
     case Alu::LSH8:
     {
+      materializeFlags();
       setFlag(FLAG_CARRY, isNegative<W>(op1));
       dest = op1 << 1;
       break;
@@ -116,342 +330,1555 @@ template <typename W> void VM::alu(Alu op, const W &op1, const W &op2, W &dest,
     case Alu::RSH16:
     case Alu::RSH8:
     {
+      materializeFlags();
       setFlag(FLAG_CARRY, op1 & 0x01);
       dest = op1 >> 1;
       break;
     }
   }
-    
+  
+  /* all four flags of arithmetic operations are recorded and computed on demand */
   if (setArithmeticFlags)
   {
-    setFlag(FLAG_SIGN, isNegative<W>(result));
-    setFlag(FLAG_OVERFLOW, (isNegative<W>(op1) ^ isNegative<W>(result)) != 0);
+    if (saveFlags)
+      recordFlags<W>(isNegative<W>(op1), result);
+    else
+    {
+      materializeFlags();
+      bool zero = isFlagSet(FLAG_ZERO);
+      recordFlags<W>(isNegative<W>(op1), result);
+      materializeFlags();
+      setFlag(FLAG_ZERO, zero);
+    }
   }
 
   if (saveResult)
     dest = result;
 
-  if (saveFlags)
+  if (saveFlags && !setArithmeticFlags)
+  {
+    materializeFlags();
     setFlag(FLAG_ZERO, (saveResult ? dest : W(result)) == 0);
+  }
 }
 
-void VM::executeInstruction()
-{
-  u8 *d = &memory[regs.PC];
+const VM::InstructionHandler VM::handlers[] = {
+  nullptr,
   
-  u8 length = 0;
+  &VM::opLD_RSH_LSH8,
+  &VM::opLD_RSH_LSH16,
+  &VM::opLD_NN,
+  &VM::opLD_NNNN,
+  &VM::opLD_PTR_NNNN,
+  &VM::opLD_PTR_PP,
+  &VM::opSD_PTR_NNNN,
+  &VM::opSD_PTR_PP,
   
-  Opcode opcode = static_cast<Opcode>(d[0]>>3);
-  Reg reg1 = static_cast<Reg>(d[0] & 0b111);
-  Reg reg2 = static_cast<Reg>(d[1] >> 5);
-  Reg reg3 = static_cast<Reg>(d[2] >> 5);
-  u8 unsigned8 = (u8)d[2];
-  s8 signed8 = (s8)d[2];
-  u16 short1 = d[2] | (d[1]<<8);
-  u16 short2 = d[2] | (d[3]<<8);
-  Alu aluop = static_cast<Alu>(d[1] & 0b11111);
-  JumpCondition cond = static_cast<JumpCondition>(d[0] & 0b1111);
+  &VM::opALU_REG8,
+  &VM::opALU_REG16,
+  &VM::opALU_NN,
+  &VM::opALU_NNNN,
   
-  bool saveFlags = true;
-
-  switch (opcode)
-  {
-    // R8 <- R8, R16 <- R16, RSH/LSH R8, RSH/LSH R16
-    case OPCODE_LD_RSH_LSH:
-    {
-      if ((aluop & 0x1) == Alu::EXTENDED_BIT)
-        alu<u16>(aluop, reg16(reg1), reg16(reg2), reg16(reg1), true, saveFlags);
-      else
-        alu<u8>(aluop, reg8(reg1), reg8(reg2), reg8(reg1), true, saveFlags);
-      
-      length = 2;
-      break;
-    }
-      
-    case OPCODE_CMP_NN:
-    {
-      alu<u8>(aluop, reg8(reg1), unsigned8, reg8(reg1), false, saveFlags);
-
-      length = 3;
-      break;
-    }
-
-    case OPCODE_ALU_NN:
-    {
-      alu<u8>(aluop, reg8(reg2), unsigned8, reg8(reg1), true, saveFlags);
-      
-      length = 3;
-      break;
-    }
-      
-    case OPCODE_CMP_NNNN:
-    {
-      alu<u16>(aluop, reg16(reg1), short2, reg16(reg1), false, saveFlags);
-      length = 4;
-      break;
-    }
+  &VM::opCMP_REG8,
+  &VM::opCMP_REG16,
+  &VM::opCMP_NN,
+  &VM::opCMP_NNNN,
+  
+  &VM::opMUL8,
+  &VM::opMUL16,
+  &VM::opDIV8,
+  
+  &VM::opCOPY,
+  &VM::opFILL,
+  
+  &VM::opJMP_NNNN,
+  &VM::opJMP_PP,
+  &VM::opCALL,
+  &VM::opRET,
+  
+  &VM::opPUSH,
+  &VM::opPUSH16,
+  &VM::opPOP,
+  &VM::opPOP16,
+  
+  &VM::opLF,
+  &VM::opSF,
+  &VM::opEI,
+  &VM::opDI,
+  &VM::opSEXT,
+  &VM::opNOP,
+  
+  &VM::opBREAK,
+  
+  &VM::opUNKNOWN
+};
 
-    case OPCODE_ALU_NNNN:
-    {
-      alu<u16>(aluop, reg16(reg2), short2, reg16(reg1), true, saveFlags);
-      
-      length = 4;
-      break;
-    }
+/* clock cycles spent by the hardware state machine after the bytes of an instruction
+   have been fetched (one cycle each), the second column is used when the instruction
+   branches, a branch to the following instruction is counted as not taken
 
-    case OPCODE_ALU_REG:
-    {
-      if ((aluop & 0x1) == Alu::EXTENDED_BIT)
-        alu<u16>(aluop, reg16(reg2), reg16(reg3), reg16(reg1), true, saveFlags);
-      else
-        alu<u8>(aluop, reg8(reg2), reg8(reg3), reg8(reg1), true, saveFlags);
+   registers and immediates are moved in a single cycle, memory accesses need one
+   cycle on the bus plus one to compute the address when it is relative to a register,
+   stack operations also spend a cycle for each SP update, the multiplier handles
+   8 bits per cycle and the divider produces two quotient bits per cycle, block
+   operations load their three registers and then pay for each byte on their own */
+static const struct { u8 cycles; u8 takenCycles; } executeCycles[] = {
+  { 1, 1 }, // INVALID
+  
+  { 1, 1 }, // LD_RSH_LSH8
+  { 1, 1 }, // LD_RSH_LSH16
+  { 1, 1 }, // LD_NN
+  { 1, 1 }, // LD_NNNN
+  { 1, 1 }, // LD_PTR_NNNN
+  { 2, 2 }, // LD_PTR_PP
+  { 1, 1 }, // SD_PTR_NNNN
+  { 2, 2 }, // SD_PTR_PP
+  
+  { 1, 1 }, // ALU_REG8
+  { 1, 1 }, // ALU_REG16
+  { 1, 1 }, // ALU_NN
+  { 1, 1 }, // ALU_NNNN
+  
+  { 1, 1 }, // CMP_REG8
+  { 1, 1 }, // CMP_REG16
+  { 1, 1 }, // CMP_NN
+  { 1, 1 }, // CMP_NNNN
+  
+  { 2, 2 }, // MUL8
+  { 4, 4 }, // MUL16
+  { 8, 8 }, // DIV8
+  
+  { 2, 2 }, // COPY
+  { 2, 2 }, // FILL
+  
+  { 0, 1 }, // JMP_NNNN
+  { 0, 1 }, // JMP_PP
+  { 0, 5 }, // CALL
+  { 0, 5 }, // RET
+  
+  { 2, 2 }, // PUSH
+  { 4, 4 }, // PUSH16
+  { 2, 2 }, // POP
+  { 4, 4 }, // POP16
+  
+  { 1, 1 }, // LF
+  { 1, 1 }, // SF
+  { 1, 1 }, // EI
+  { 1, 1 }, // DI
+  { 1, 1 }, // SEXT
+  { 0, 0 }, // NOP
+  
+  { 0, 0 }, // BREAK, never used since cycles come from the trapped instruction
+  
+  { 1, 1 }, // UNKNOWN
+};
 
-      length = 3;
-      break;
-    }
-      
-    case OPCODE_CMP_REG:
-    {
-      if ((aluop & 0x1) == Alu::EXTENDED_BIT)
-        alu<u16>(aluop, reg16(reg1), reg16(reg2), reg16(reg1), false, saveFlags);
-      else
-        alu<u8>(aluop, reg8(reg1), reg8(reg2), reg8(reg1), false, saveFlags);
-      
-      length = 2;
-      break;
-    }
-      
-    // R <- NN
-    case OPCODE_LD_NN:
-    {
-      u8& r = reg8(reg1);
-      r = unsigned8;
-      
-      length = 3;
-      break;
-    }
-     
-    // R <- NNNN
-    case OPCODE_LD_NNNN:
-    {
-      u16& r = reg16(reg1);
-      r = short1;
-      
-      length = 3;
-      break;
-    }
-      
-    // R <- [NNNN]
-    case OPCODE_LD_PTR_NNNN:
-    {
-      u8& r = reg8(reg1);
-      u16 address = short1;
-      
-      r = ramRead(address);
-      
-      length = 3;
-      break;
-    }
-      
-    // R <- [PP + SS]
-    case OPCODE_LD_PTR_PP:
-    {
-      u8& r = reg8(reg1);
-      u16 baseAddress = reg16(reg2);
-      s8 offset = signed8;
-      
-      r = ramRead(baseAddress+offset);
-      
-      length = 3;
-      break;
-    }
-      
-    // [NNNN] <- R
-    case OPCODE_SD_PTR_NNNN:
-    {
-      u8& r = reg8(reg1);
-      u16 address = short1;
+const DecodedInstruction& VM::decode(u16 address)
+{
+  static_assert(sizeof(handlers) / sizeof(handlers[0]) == static_cast<size_t>(Handler::COUNT), "handler table must match Handler enum");
+  static_assert(sizeof(executeCycles) / sizeof(executeCycles[0]) == static_cast<size_t>(Handler::COUNT), "cycle table must match Handler enum");
+  
+  /* instructions at the end of memory wrap around like PC does */
+  u8 d[DecodeCache::MAX_INSTRUCTION_LENGTH];
+  for (u32 k = 0; k < DecodeCache::MAX_INSTRUCTION_LENGTH; ++k)
+    d[k] = memory[u16(address + k)];
+  
+  DecodedInstruction& i = decodeCache.slot(address);
+  
+  i.opcode = static_cast<Opcode>(d[0]>>3);
+  i.reg1 = static_cast<Reg>(d[0] & 0b111);
+  i.reg2 = static_cast<Reg>(d[1] >> 5);
+  i.reg3 = static_cast<Reg>(d[2] >> 5);
+  i.unsigned8 = (u8)d[2];
+  i.short1 = d[2] | (d[1]<<8);
+  i.short2 = d[2] | (d[3]<<8);
+  i.aluop = static_cast<Alu>(d[1] & 0b11111);
+  i.cond = static_cast<JumpCondition>(d[0] & 0b1111);
+  
+  bool extended = (i.aluop & 0x1) == Alu::EXTENDED_BIT;
+  
+  switch (i.opcode)
+  {
+    case OPCODE_LD_RSH_LSH: i.handler = extended ? Handler::LD_RSH_LSH16 : Handler::LD_RSH_LSH8; i.length = 2; break;
+    case OPCODE_LD_NN: i.handler = Handler::LD_NN; i.length = 3; break;
+    case OPCODE_LD_NNNN: i.handler = Handler::LD_NNNN; i.length = 3; break;
+    case OPCODE_LD_PTR_NNNN: i.handler = Handler::LD_PTR_NNNN; i.length = 3; break;
+    case OPCODE_LD_PTR_PP: i.handler = Handler::LD_PTR_PP; i.length = 3; break;
+    case OPCODE_SD_PTR_NNNN: i.handler = Handler::SD_PTR_NNNN; i.length = 3; break;
+    case OPCODE_SD_PTR_PP: i.handler = Handler::SD_PTR_PP; i.length = 3; break;
       
-      ramWrite(address, r);
+    case OPCODE_ALU_REG: i.handler = extended ? Handler::ALU_REG16 : Handler::ALU_REG8; i.length = 3; break;
+    case OPCODE_ALU_NN: i.handler = Handler::ALU_NN; i.length = 3; break;
+    case OPCODE_ALU_NNNN: i.handler = Handler::ALU_NNNN; i.length = 4; break;
       
-      length = 3;
-      break;
-    }
+    case OPCODE_CMP_REG: i.handler = extended ? Handler::CMP_REG16 : Handler::CMP_REG8; i.length = 2; break;
+    case OPCODE_CMP_NN: i.handler = Handler::CMP_NN; i.length = 3; break;
+    case OPCODE_CMP_NNNN: i.handler = Handler::CMP_NNNN; i.length = 4; break;
       
-    // [PP + SS] <- R
-    case OPCODE_SD_PTR_PP:
+    case OPCODE_EXT:
     {
-      u8& r = reg8(reg1);
-      u16 baseAddress = reg16(reg2);
-      s8 offset = signed8;
-      
-      ramWrite(baseAddress+offset, r);
-      
-      length = 3;
-      break;
-    }
+      i.length = 3;
       
-    case OPCODE_JMPC_NNNN:
-    case OPCODE_JMP_NNNN:
-    {
-      if (isConditionTrue(cond))
+      switch (static_cast<ExtOp>(i.aluop))
       {
-        u16 address = short1;
-        regs.PC = address;
+        case ExtOp::MUL8: i.handler = Handler::MUL8; break;
+        case ExtOp::MUL16: i.handler = Handler::MUL16; break;
+        case ExtOp::DIV8: i.handler = Handler::DIV8; break;
+        case ExtOp::COPY: i.handler = Handler::COPY; break;
+        case ExtOp::FILL: i.handler = Handler::FILL; break;
+        default: i.handler = Handler::UNKNOWN; i.length = 0; break;
       }
-      else
-        length = 3;
       break;
     }
       
-    case OPCODE_JMPC_PP:
+    case OPCODE_JMP_NNNN:
+    case OPCODE_JMPC_NNNN: i.handler = Handler::JMP_NNNN; i.length = 3; break;
     case OPCODE_JMP_PP:
-    {
-      if (isConditionTrue(cond))
-      {
-        u16 address = reg16(reg2);
-        regs.PC = address;
-      }
-      else
-        length = 2;
-
-      break;
-    }
-      
-    case OPCODE_NOP:
-    {
-      length = 1;
-      break;
-    }
-      
-    case OPCODE_PUSH:
-    {
-      u8& r = reg8(reg1);
-      u16& sp = reg16(Reg::SP);
-      --sp;
-      ramWrite(sp, r);
-      
-      length = 1;
-      break;
-    }
-      
-    case OPCODE_PUSH16:
-    {
-      u16& r = reg16(reg1);
-      u16& sp = reg16(Reg::SP);
-      --sp;
-      ramWrite(sp, r & 0xFF);
-      --sp;
-      ramWrite(sp, (r >> 8) & 0xFF);
-      
-      length = 1;
-      break;
-    }
-      
-    case OPCODE_POP:
-    {
-      u8& r = reg8(reg1);
-      u16& sp = reg16(Reg::SP);
-      r = ramRead(sp);
-      ++sp;
-      
-      length = 1;
-      break;
-    }
-      
-    case OPCODE_POP16:
-    {
-      u16& r = reg16(reg1);
-      u16& sp = reg16(Reg::SP);
-      u8 high = ramRead(sp);
-      ++sp;
-      u8 low = ramRead(sp);
-      ++sp;
-      r = (high << 8)| low;
-      
-      length = 1;
-      break;
-    }
-      
-    case OPCODE_RET:
-    case OPCODE_RETC:
-    {
-      if (isConditionTrue(cond))
-      {
-        u16& sp = reg16(Reg::SP);
-        u8 high = ramRead(sp);
-        ++sp;
-        u8 low = ramRead(sp);
-        ++sp;
-        regs.PC = (high << 8) | low;
-      }
-      else
-        length = 1;
-      
-      break;
-    }
-      
+    case OPCODE_JMPC_PP: i.handler = Handler::JMP_PP; i.length = 2; break;
     case OPCODE_CALL:
-    case OPCODE_CALLC:
-    {
-      if (isConditionTrue(cond))
-      {
-        u16 address = regs.PC+3;
-        u16& sp = reg16(Reg::SP);
-        --sp;
-        ramWrite(sp, address & 0xFF);
-        --sp;
-        ramWrite(sp, (address >> 8) & 0xFF);
-        regs.PC = short1;
-      }
-      else length = 3;
-      break;
-    }
-      
-    case OPCODE_LF:
-    {
-      u8& r = reg8(reg1);
-      regs.FLAGS = 0x0F & r;
-      
-      length = 1;
-      break;
-    }
-      
-    case OPCODE_SF:
-    {
-      u8& r = reg8(reg1);
-      r = 0x0F & regs.FLAGS;
-      
-      length = 1;
-      break;
-    }
-      
-    case OPCODE_EI:
-    {
-      interruptEnabled = true;
-      
-      length = 1;
-      break;
-    }
-      
-    case OPCODE_DI:
-    {
-      interruptEnabled = false;
+    case OPCODE_CALLC: i.handler = Handler::CALL; i.length = 3; break;
+    case OPCODE_RET:
+    case OPCODE_RETC: i.handler = Handler::RET; i.length = 1; break;
       
-      length = 1;
-      break;
-    }
+    case OPCODE_PUSH: i.handler = Handler::PUSH; i.length = 1; break;
+    case OPCODE_PUSH16: i.handler = Handler::PUSH16; i.length = 1; break;
+    case OPCODE_POP: i.handler = Handler::POP; i.length = 1; break;
+    case OPCODE_POP16: i.handler = Handler::POP16; i.length = 1; break;
       
-    case OPCODE_SEXT:
-    {
-      u8& r = reg8(reg1);
-      u8& h = reg8(static_cast<Reg>(reg1 | 0b100));
-      h = r & 0x80 ? 0xFF : 0x00;
+    case OPCODE_LF: i.handler = Handler::LF; i.length = 1; break;
+    case OPCODE_SF: i.handler = Handler::SF; i.length = 1; break;
+    case OPCODE_EI: i.handler = Handler::EI; i.length = 1; break;
+    case OPCODE_DI: i.handler = Handler::DI; i.length = 1; break;
+    case OPCODE_SEXT: i.handler = Handler::SEXT; i.length = 1; break;
+    case OPCODE_NOP: i.handler = Handler::NOP; i.length = 1; break;
       
-      length = 1;
-      break;
-    }
+    /* unknown opcodes don't advance PC */
+    default: i.handler = Handler::UNKNOWN; i.length = 0; break;
+  }
+  
+  /* an unknown opcode still costs the fetch of its first byte */
+  u8 fetched = std::max<u8>(i.length, 1);
+  i.cycles = fetched + executeCycles[static_cast<size_t>(i.handler)].cycles;
+  i.takenCycles = fetched + executeCycles[static_cast<size_t>(i.handler)].takenCycles;
+  
+  /* halts are trapped too so that every engine can stop on them */
+  if (isBreakpoint(address) || haltsAt(i, address))
+  {
+    i.trapped = i.handler;
+    i.handler = Handler::BREAK;
+  }
+  
+  i.fusion = Fusion::NONE;
+  if (fusions)
+    fuse(i, address);
+  
+  return i;
+}
+
+/* the following instruction is read straight from memory instead of being decoded
+   so that a run of fusable instructions doesn't decode recursively, a later write
+   to it invalidates the pair since the cache drops every entry spanning the address */
+void VM::fuse(DecodedInstruction& i, u16 address)
+{
+  u16 next = address + i.length;
+  Opcode opcode = static_cast<Opcode>(memory[next] >> 3);
+  
+  /* the second half would run without stopping at its breakpoint */
+  if (isBreakpoint(next))
+    return;
+  
+  bool jump = opcode == OPCODE_JMP_NNNN || opcode == OPCODE_JMPC_NNNN;
+  bool ret = opcode == OPCODE_RET || opcode == OPCODE_RETC;
+  Fusion fusion = Fusion::NONE;
+  
+  switch (i.handler)
+  {
+    case Handler::CMP_NN: if (jump) fusion = Fusion::CMP_NN_JMP; break;
+    case Handler::CMP_REG8:
+    case Handler::CMP_REG16: if (ret) fusion = Fusion::CMP_REG_RET; break;
+    case Handler::ALU_NNNN: if (jump) fusion = Fusion::ALU_NNNN_JMP; break;
+    default: break;
+  }
+  
+  if (!(fusions & fusionBit(fusion)))
+    return;
+  
+  u16 target = memory[u16(next + 2)] | (memory[u16(next + 1)] << 8);
+  
+  /* a jump to itself is trapped as a halt */
+  if (jump && target == next)
+    return;
+  
+  i.fusion = fusion;
+  i.cond2 = static_cast<JumpCondition>(memory[next] & 0b1111);
+  i.length2 = jump ? 3 : 1;
+  i.target2 = target;
+}
+
+void VM::executeInstruction()
+{
+  const DecodedInstruction& i = decoded(regs.PC);
+  (this->*handlers[static_cast<size_t>(i.handler)])(i);
+}
+
+// R8 <- R8, R16 <- R16, RSH/LSH R8, RSH/LSH R16
+void VM::opLD_RSH_LSH8(const DecodedInstruction& i)
+{
+  alu<u8>(i.aluop, reg8(i.reg1), reg8(i.reg2), reg8(i.reg1), true, true);
+  regs.PC += i.length;
+}
+
+void VM::opLD_RSH_LSH16(const DecodedInstruction& i)
+{
+  alu<u16>(i.aluop, reg16(i.reg1), reg16(i.reg2), reg16(i.reg1), true, true);
+  regs.PC += i.length;
+}
+
+// R <- NN
+void VM::opLD_NN(const DecodedInstruction& i)
+{
+  reg8(i.reg1) = i.unsigned8;
+  regs.PC += i.length;
+}
+
+// R <- NNNN
+void VM::opLD_NNNN(const DecodedInstruction& i)
+{
+  reg16(i.reg1) = i.short1;
+  regs.PC += i.length;
+}
+
+// R <- [NNNN]
+void VM::opLD_PTR_NNNN(const DecodedInstruction& i)
+{
+  reg8(i.reg1) = ramRead(i.short1);
+  regs.PC += i.length;
+}
+
+// R <- [PP + SS]
+void VM::opLD_PTR_PP(const DecodedInstruction& i)
+{
+  u16 baseAddress = reg16(i.reg2);
+  reg8(i.reg1) = ramRead(baseAddress + i.signed8());
+  regs.PC += i.length;
+}
+
+// [NNNN] <- R
+void VM::opSD_PTR_NNNN(const DecodedInstruction& i)
+{
+  ramWrite(i.short1, reg8(i.reg1));
+  regs.PC += i.length;
+}
+
+// [PP + SS] <- R
+void VM::opSD_PTR_PP(const DecodedInstruction& i)
+{
+  u16 baseAddress = reg16(i.reg2);
+  ramWrite(baseAddress + i.signed8(), reg8(i.reg1));
+  regs.PC += i.length;
+}
+
+void VM::opALU_REG8(const DecodedInstruction& i)
+{
+  alu<u8>(i.aluop, reg8(i.reg2), reg8(i.reg3), reg8(i.reg1), true, true);
+  regs.PC += i.length;
+}
+
+void VM::opALU_REG16(const DecodedInstruction& i)
+{
+  alu<u16>(i.aluop, reg16(i.reg2), reg16(i.reg3), reg16(i.reg1), true, true);
+  regs.PC += i.length;
+}
+
+void VM::opALU_NN(const DecodedInstruction& i)
+{
+  alu<u8>(i.aluop, reg8(i.reg2), i.unsigned8, reg8(i.reg1), true, true);
+  regs.PC += i.length;
+}
+
+void VM::opALU_NNNN(const DecodedInstruction& i)
+{
+  alu<u16>(i.aluop, reg16(i.reg2), i.short2, reg16(i.reg1), true, true);
+  regs.PC += i.length;
+}
+
+void VM::opCMP_REG8(const DecodedInstruction& i)
+{
+  alu<u8>(i.aluop, reg8(i.reg1), reg8(i.reg2), reg8(i.reg1), false, true);
+  regs.PC += i.length;
+}
+
+void VM::opCMP_REG16(const DecodedInstruction& i)
+{
+  alu<u16>(i.aluop, reg16(i.reg1), reg16(i.reg2), reg16(i.reg1), false, true);
+  regs.PC += i.length;
+}
+
+void VM::opCMP_NN(const DecodedInstruction& i)
+{
+  alu<u8>(i.aluop, reg8(i.reg1), i.unsigned8, reg8(i.reg1), false, true);
+  regs.PC += i.length;
+}
+
+void VM::opCMP_NNNN(const DecodedInstruction& i)
+{
+  alu<u16>(i.aluop, reg16(i.reg1), i.short2, reg16(i.reg1), false, true);
+  regs.PC += i.length;
+}
+
+/* flags of MUL and DIV are computed eagerly, carry and overflow report a product
+   that doesn't fit the width of its sources */
+void VM::setMulDivFlags(u16 value, bool overflow)
+{
+  lazyFlags.clear();
+  regs.FLAGS = (regs.FLAGS & ~0x0F)
+    | (overflow ? FLAG_CARRY | FLAG_OVERFLOW : 0)
+    | (value == 0 ? FLAG_ZERO : 0)
+    | (value & 0x8000 ? FLAG_SIGN : 0);
+}
+
+void VM::opMUL8(const DecodedInstruction& i)
+{
+  u16 product = reg8(i.reg2) * reg8(i.reg3);
+  reg16(i.reg1) = product;
+  setMulDivFlags(product, product > 0xFF);
+  regs.PC += i.length;
+}
+
+void VM::opMUL16(const DecodedInstruction& i)
+{
+  u32 product = u32(reg16(i.reg2)) * reg16(i.reg3);
+  reg16(i.reg1) = product;
+  setMulDivFlags(product, product > 0xFFFF);
+  regs.PC += i.length;
+}
+
+void VM::opDIV8(const DecodedInstruction& i)
+{
+  u16 dividend = reg16(i.reg2);
+  u8 divisor = reg8(i.reg3);
+  
+  if (divisor == 0)
+  {
+    lazyFlags.clear();
+    regs.FLAGS = (regs.FLAGS & ~0x0F) | FLAG_OVERFLOW;
+  }
+  else
+  {
+    u16 quotient = dividend / divisor;
+    reg16(i.reg1) = quotient;
+    reg8(i.reg3) = dividend % divisor;
+    setMulDivFlags(quotient, false);
+  }
+  
+  regs.PC += i.length;
+}
+
+/* a single memmove when both ranges are plain RAM, byte by byte through the bus
+   otherwise, back to front when the destination starts inside the source and
+   through a copy of the source when wrapping at 64K makes the ranges overlap at
+   both ends */
+void VM::opCOPY(const DecodedInstruction& i)
+{
+  u16 destination = reg16(i.reg1);
+  u16 source = reg16(i.reg2);
+  u16 count = reg16(i.reg3);
+  
+  if (bus.isRam(source, count, vm::MemoryBus::READ) && bus.isRam(destination, count, vm::MemoryBus::WRITE))
+  {
+    memmove(&memory[destination], &memory[source], count);
+    blockWritten(destination, count);
+  }
+  else if (destination != source && u16(destination - source) < count && u16(source - destination) < count)
+  {
+    std::vector<u8> bytes(count);
+    
+    for (u32 k = 0; k < count; ++k)
+      bytes[k] = ramRead(source + k);
+    for (u32 k = 0; k < count; ++k)
+      ramWrite(destination + k, bytes[k]);
+  }
+  else if (u16(destination - source) < count)
+  {
+    for (u32 k = count; k > 0; --k)
+      ramWrite(destination + k - 1, ramRead(source + k - 1));
+  }
+  else
+  {
+    for (u32 k = 0; k < count; ++k)
+      ramWrite(destination + k, ramRead(source + k));
+  }
+  
+  reg16(i.reg1) = destination + count;
+  reg16(i.reg2) = source + count;
+  reg16(i.reg3) = 0;
+  
+  if (timing == Timing::CYCLE_ACCURATE)
+    cycleCount += u64(count) * COPY_BYTE_CYCLES;
+  
+  regs.PC += i.length;
+}
+
+void VM::opFILL(const DecodedInstruction& i)
+{
+  u16 destination = reg16(i.reg1);
+  u8 value = reg8(i.reg2);
+  u16 count = reg16(i.reg3);
+  
+  if (bus.isRam(destination, count, vm::MemoryBus::WRITE))
+  {
+    memset(&memory[destination], value, count);
+    blockWritten(destination, count);
+  }
+  else
+  {
+    for (u32 k = 0; k < count; ++k)
+      ramWrite(destination + k, value);
+  }
+  
+  reg16(i.reg1) = destination + count;
+  reg16(i.reg3) = 0;
+  
+  if (timing == Timing::CYCLE_ACCURATE)
+    cycleCount += u64(count) * FILL_BYTE_CYCLES;
+  
+  regs.PC += i.length;
+}
+
+void VM::opJMP_NNNN(const DecodedInstruction& i)
+{
+  if (isConditionTrue(i.cond))
+    regs.PC = i.short1;
+  else
+    regs.PC += i.length;
+}
+
+void VM::opJMP_PP(const DecodedInstruction& i)
+{
+  if (isConditionTrue(i.cond))
+    regs.PC = reg16(i.reg2);
+  else
+    regs.PC += i.length;
+}
+
+void VM::opCALL(const DecodedInstruction& i)
+{
+  if (isConditionTrue(i.cond))
+  {
+    u16 address = regs.PC + i.length;
+    u16& sp = reg16(Reg::SP);
+    pushed(sp, sp - 2);
+    --sp;
+    ramWrite(sp, address & 0xFF);
+    --sp;
+    ramWrite(sp, (address >> 8) & 0xFF);
+    regs.PC = i.short1;
+  }
+  else
+    regs.PC += i.length;
+}
+
+void VM::opRET(const DecodedInstruction& i)
+{
+  if (isConditionTrue(i.cond))
+  {
+    u16& sp = reg16(Reg::SP);
+    u8 high = ramRead(sp);
+    ++sp;
+    u8 low = ramRead(sp);
+    ++sp;
+    regs.PC = (high << 8) | low;
+  }
+  else
+    regs.PC += i.length;
+}
+
+void VM::opPUSH(const DecodedInstruction& i)
+{
+  u8& r = reg8(i.reg1);
+  u16& sp = reg16(Reg::SP);
+  pushed(sp, sp - 1);
+  --sp;
+  ramWrite(sp, r);
+  regs.PC += i.length;
+}
+
+void VM::opPUSH16(const DecodedInstruction& i)
+{
+  u16& r = reg16(i.reg1);
+  u16& sp = reg16(Reg::SP);
+  pushed(sp, sp - 2);
+  --sp;
+  ramWrite(sp, r & 0xFF);
+  --sp;
+  ramWrite(sp, (r >> 8) & 0xFF);
+  regs.PC += i.length;
+}
+
+void VM::opPOP(const DecodedInstruction& i)
+{
+  u8& r = reg8(i.reg1);
+  u16& sp = reg16(Reg::SP);
+  r = ramRead(sp);
+  ++sp;
+  regs.PC += i.length;
+}
+
+void VM::opPOP16(const DecodedInstruction& i)
+{
+  u16& r = reg16(i.reg1);
+  u16& sp = reg16(Reg::SP);
+  u8 high = ramRead(sp);
+  ++sp;
+  u8 low = ramRead(sp);
+  ++sp;
+  r = (high << 8)| low;
+  regs.PC += i.length;
+}
+
+void VM::opLF(const DecodedInstruction& i)
+{
+  lazyFlags.clear();
+  regs.FLAGS = 0x0F & reg8(i.reg1);
+  regs.PC += i.length;
+}
+
+void VM::opSF(const DecodedInstruction& i)
+{
+  reg8(i.reg1) = 0x0F & flags();
+  regs.PC += i.length;
+}
+
+void VM::opEI(const DecodedInstruction& i)
+{
+  interruptEnabled = true;
+  regs.PC += i.length;
+  
+  if (pendingInterrupts)
+    requestEventCheck();
+}
+
+void VM::opDI(const DecodedInstruction& i)
+{
+  interruptEnabled = false;
+  regs.PC += i.length;
+}
+
+void VM::opSEXT(const DecodedInstruction& i)
+{
+  u8& r = reg8(i.reg1);
+  u8& h = reg8(static_cast<Reg>(i.reg1 | 0b100));
+  h = r & 0x80 ? 0xFF : 0x00;
+  regs.PC += i.length;
+}
+
+void VM::opNOP(const DecodedInstruction& i)
+{
+  regs.PC += i.length;
+}
+
+void VM::opUNKNOWN(const DecodedInstruction&)
+{
+  
+}
+
+void VM::opBREAK(const DecodedInstruction& i)
+{
+  (this->*handlers[static_cast<size_t>(i.trapped)])(i);
+}
+
+void VM::jumpFused(const DecodedInstruction& i)
+{
+  if (isConditionTrue(i.cond2))
+    regs.PC = i.target2;
+  else
+    regs.PC += i.length2;
+}
+
+void VM::retFused(const DecodedInstruction& i)
+{
+  if (isConditionTrue(i.cond2))
+  {
+    u16& sp = reg16(Reg::SP);
+    u8 high = ramRead(sp);
+    ++sp;
+    u8 low = ramRead(sp);
+    ++sp;
+    regs.PC = (high << 8) | low;
+  }
+  else
+    regs.PC += i.length2;
+}
+
+constexpr u64 VM::STOP_CHECK_INTERVAL;
+constexpr u32 VM::NO_RESUME;
+constexpr u16 VM::INTERRUPT_VECTOR_BASE;
+constexpr u16 VM::INTERRUPT_VECTOR_SIZE;
+constexpr u32 VM::INTERRUPT_COUNT;
+constexpr u8 VM::INTERRUPT_CYCLES;
+constexpr u8 VM::COPY_BYTE_CYCLES;
+constexpr u8 VM::FILL_BYTE_CYCLES;
+constexpr u64 VM::IDLE_CHECK_INTERVAL;
+constexpr u64 VM::IDLE_PROBE_LENGTH;
+
+Result VM::setBreakpoint(u16 address, const std::string& condition)
+{
+  vm::Condition compiled;
+  Result result = compiled.compile(condition);
+  
+  if (!result)
+    return result;
+  
+  if (compiled.isAlways())
+    breakConditions.erase(address);
+  else
+    breakConditions[address] = std::move(compiled);
+  
+  breakpoints[address / 64] |= u64(1) << (address % 64);
+  invalidateBreakpoint(address);
+  return Result();
+}
+
+void VM::clearBreakpoint(u16 address)
+{
+  breakpoints[address / 64] &= ~(u64(1) << (address % 64));
+  breakConditions.erase(address);
+  invalidateBreakpoint(address);
+}
+
+void VM::clearBreakpoints()
+{
+  breakpoints.fill(0);
+  breakConditions.clear();
+  decodeCache.clear();
+  
+#if J80_JIT
+  if (jit)
+    jit->flush();
+#endif
+  
+  if (aot)
+    aot->breakpointsCleared();
+}
+
+/* the entry at the address is patched to (or back from) BREAK and the entries before
+   it are dropped too since one of them could be fused with it, translated blocks
+   could span the address so they are all thrown away, native blocks containing it
+   are closed or opened again */
+void VM::invalidateBreakpoint(u16 address)
+{
+  if (decodeCache.mayContain(address))
+    decodeCache.invalidate(address);
+  
+#if J80_JIT
+  if (jit)
+    jit->flush();
+#endif
+  
+  if (aot)
+    aot->breakpointChanged(address);
+}
+
+bool VM::shouldBreak(const DecodedInstruction& i)
+{
+  if (regs.PC == resumeAddress)
+  {
+    resumeAddress = NO_RESUME;
+    return false;
+  }
+  
+  if (isBreakpoint(regs.PC))
+  {
+    auto it = breakConditions.find(regs.PC);
+    
+    if (it == breakConditions.end() || it->second.evaluate(allRegs(), memory))
+    {
+      breakHit = true;
+      return true;
+    }
+  }
+  
+  /* a jump to itself only halts while it is taken and no interrupt can leave it */
+  if (haltEnabled && (i.trapped == Handler::UNKNOWN || (i.trapped == Handler::JMP_NNNN && i.short1 == regs.PC && isConditionTrue(i.cond) && !mayBeInterrupted())))
+  {
+    haltHit = true;
+    return true;
+  }
+  
+  return false;
+}
+
+void VM::watched(u16 address, u8 value, bool write)
+{
+  watchHit = true;
+  lastWatch = { regs.PC, address, value, write };
+}
+
+void VM::requestEventCheck()
+{
+  eventCheck = true;
+  
+#if J80_JIT
+  /* translated blocks test the invalidation flag after each store and EI */
+  if (jit)
+    jit->requestExit();
+#endif
+  
+  if (aot)
+    aot->requestExit();
+}
+
+void VM::cancelEvents(vm::EventHandler* handler)
+{
+  events.cancel(handler);
+  deferredEvents.erase(std::remove_if(deferredEvents.begin(), deferredEvents.end(), [handler](const DeferredEvent& event) { return event.handler == handler; }), deferredEvents.end());
+}
+
+void VM::raiseInterrupt(u8 index)
+{
+  pendingInterrupts |= 1 << (index % INTERRUPT_COUNT);
+  
+  if (interruptEnabled)
+    requestEventCheck();
+}
+
+/* fires whatever is due, handlers can schedule more events (deferred ones start
+   from the current clock) and raise interrupts, one of which is then taken */
+void VM::processEvents()
+{
+  u64 now = clock();
+  
+  do
+  {
+    for (const DeferredEvent& event : deferredEvents)
+      events.schedule(now + event.delay, event.handler);
+    
+    deferredEvents.clear();
+    events.runDue(now);
+  } while (!deferredEvents.empty());
+  
+  if (interruptEnabled && pendingInterrupts)
+    deliverInterrupt();
+  
+  eventCheck = false;
+}
+
+void VM::deliverInterrupt()
+{
+  u8 index = 0;
+  while (!(pendingInterrupts & (1 << index)))
+    ++index;
+  
+  pendingInterrupts &= ~(1 << index);
+  interruptEnabled = false;
+  
+  u16& sp = reg16(Reg::SP);
+  pushed(sp, sp - 2);
+  --sp;
+  ramWrite(sp, regs.PC & 0xFF);
+  --sp;
+  ramWrite(sp, (regs.PC >> 8) & 0xFF);
+  regs.PC = INTERRUPT_VECTOR_BASE + index * INTERRUPT_VECTOR_SIZE;
+  
+  if (timing == Timing::CYCLE_ACCURATE)
+    cycleCount += INTERRUPT_CYCLES;
+  
+  if (profiler)
+    profiler->interrupted(regs.PC);
+  
+  if (recorder)
+    recorder->interrupted(index);
+}
+
+/* steps like the interpreter until PC comes back to where it started, the loop is
+   idle if registers and flags are the same since it ran nothing which could have an
+   effect outside of them, returns the executed instructions plus the skipped ones */
+u64 VM::probeIdle(u64 limit)
+{
+  materializeFlags();
+  
+  Regs start = regs;
+  u64 startCycles = cycleCount;
+  u64 executed = 0;
+  
+  /* stepping stops at the deadline so that the event still fires on time */
+  while (executed < std::min(limit, IDLE_PROBE_LENGTH) && clock() < events.nextDeadline())
+  {
+    const DecodedInstruction& i = decoded(regs.PC);
+    u16 pc = regs.PC;
+    
+    switch (i.handler)
+    {
+      case Handler::LD_PTR_NNNN:
+        if (bus.isReadMapped(i.short1))
+          return executed;
+        break;
+      case Handler::LD_PTR_PP:
+        if (bus.isReadMapped(reg16(i.reg2) + i.signed8()))
+          return executed;
+        break;
+        
+      case Handler::LD_RSH_LSH8:
+      case Handler::LD_RSH_LSH16:
+      case Handler::LD_NN:
+      case Handler::LD_NNNN:
+      case Handler::ALU_REG8:
+      case Handler::ALU_REG16:
+      case Handler::ALU_NN:
+      case Handler::ALU_NNNN:
+      case Handler::CMP_REG8:
+      case Handler::CMP_REG16:
+      case Handler::CMP_NN:
+      case Handler::CMP_NNNN:
+      case Handler::MUL8:
+      case Handler::MUL16:
+      case Handler::DIV8:
+      case Handler::JMP_NNNN:
+      case Handler::JMP_PP:
+      case Handler::LF:
+      case Handler::SF:
+      case Handler::SEXT:
+      case Handler::NOP:
+      case Handler::UNKNOWN:
+        break;
+        
+      /* a trapped halt runs as the jump it replaces unless it stops the run */
+      case Handler::BREAK:
+        if (isBreakpoint(regs.PC) || shouldBreak(i))
+          return executed;
+        break;
+        
+      /* stores, the stack, interrupt state and breakpoints */
+      default:
+        return executed;
+    }
+    
+    (this->*handlers[static_cast<size_t>(i.handler)])(i);
+    ++executed;
+    ++retiredCount;
+    
+    if (timing == Timing::CYCLE_ACCURATE)
+      account(i, pc);
+    
+    if (regs.PC == start.PC)
+    {
+      materializeFlags();
+      
+      if (memcmp(regs.file16, start.file16, sizeof(regs.file16)) != 0 || regs.FLAGS != start.FLAGS)
+        return executed;
+      
+      return executed + skipIdle(executed, cycleCount - startCycles, limit - executed);
+    }
+  }
+  
+  return executed;
+}
+
+/* skips whole iterations of an idle loop up to the next deadline, the iteration
+   which reaches it is left to run for real so the event fires on the right
+   instruction, with no interrupt to wait for the run stops instead */
+u64 VM::skipIdle(u64 instructions, u64 cycles, u64 limit)
+{
+  if (!mayBeInterrupted())
+  {
+    idleHit = true;
+    return 0;
+  }
+  
+  u64 step = timing == Timing::CYCLE_ACCURATE ? cycles : instructions;
+  u64 deadline = events.nextDeadline();
+  u64 iterations = limit / instructions;
+  
+  if (deadline != vm::EventQueue::NEVER)
+    iterations = std::min(iterations, (deadline - clock()) / step);
+  
+  retiredCount += iterations * instructions;
+  
+  if (timing == Timing::CYCLE_ACCURATE)
+    cycleCount += iterations * cycles;
+  
+  return iterations * instructions;
+}
+
+/* both engines run in slices of at most STOP_CHECK_INTERVAL instructions so that
+   the stop flag is checked only between slices, a pending stop request is consumed
+   when the engine returns */
+u64 VM::runSwitch(u64 budget)
+{
+  return interpret<false, false, false>(budget);
+}
+
+/* profiling hooks, cycle accounting and watchpoint checks are compiled only in the
+   instantiations which need them so that they don't cost anything to the plain one */
+u64 VM::interpret(u64 budget)
+{
+  bool timed = timing == Timing::CYCLE_ACCURATE;
+  bool watched = bus.hasWatches();
+  
+  switch ((profiler ? 4 : 0) | (timed ? 2 : 0) | (watched ? 1 : 0))
+  {
+    case 0: return interpret<false, false, false>(budget);
+    case 1: return interpret<false, false, true>(budget);
+    case 2: return interpret<false, true, false>(budget);
+    case 3: return interpret<false, true, true>(budget);
+    case 4: return interpret<true, false, false>(budget);
+    case 5: return interpret<true, false, true>(budget);
+    case 6: return interpret<true, true, false>(budget);
+    default: return interpret<true, true, true>(budget);
+  }
+}
+
+/* an instruction at a breakpoint is only a different handler, so runs without
+   breakpoints don't check anything */
+template <bool PROFILE, bool TIMED, bool WATCH> u64 VM::interpret(u64 budget)
+{
+  /* hooks need to see each instruction of a pair on its own */
+  constexpr bool FUSE = !PROFILE && !TIMED;
+  u64 executed = 0;
+  
+  while (executed < budget && !stopRequested.load(std::memory_order_relaxed))
+  {
+    u64 slice = std::min(budget - executed, STOP_CHECK_INTERVAL);
+    /* ends the run right after the current instruction, hooks included, so that
+       VM::run can look at the event queue */
+    auto leave = [&](u64 n) { slice = n + 1; budget = executed + slice; };
+    
+    for (u64 n = 0; n < slice; ++n)
+    {
+      const DecodedInstruction& i = decoded(regs.PC);
+      u16 pc = regs.PC;
+      
+      /* the profiler must not count an instruction which doesn't run */
+      if (PROFILE && i.handler == Handler::BREAK && shouldBreak(i))
+      {
+        executed += n;
+        goto stopped;
+      }
+      
+      if (PROFILE)
+        profiler->instruction(*this, i);
+      
+      switch (i.handler)
+      {
+        case Handler::LD_RSH_LSH8: opLD_RSH_LSH8(i); break;
+        case Handler::LD_RSH_LSH16: opLD_RSH_LSH16(i); break;
+        case Handler::LD_NN: opLD_NN(i); break;
+        case Handler::LD_NNNN: opLD_NNNN(i); break;
+        case Handler::LD_PTR_NNNN: opLD_PTR_NNNN(i); break;
+        case Handler::LD_PTR_PP: opLD_PTR_PP(i); break;
+        case Handler::SD_PTR_NNNN: opSD_PTR_NNNN(i); if (eventCheck) leave(n); break;
+        case Handler::SD_PTR_PP: opSD_PTR_PP(i); if (eventCheck) leave(n); break;
+          
+        case Handler::ALU_REG8: opALU_REG8(i); break;
+        case Handler::ALU_REG16: opALU_REG16(i); break;
+        case Handler::ALU_NN: opALU_NN(i); break;
+        case Handler::ALU_NNNN:
+          opALU_NNNN(i);
+          if (FUSE && i.fusion != Fusion::NONE && n + 1 < slice) { jumpFused(i); ++n; }
+          break;
+          
+        case Handler::CMP_REG8:
+          opCMP_REG8(i);
+          if (FUSE && i.fusion != Fusion::NONE && n + 1 < slice) { retFused(i); ++n; }
+          break;
+        case Handler::CMP_REG16:
+          opCMP_REG16(i);
+          if (FUSE && i.fusion != Fusion::NONE && n + 1 < slice) { retFused(i); ++n; }
+          break;
+        case Handler::CMP_NN:
+          opCMP_NN(i);
+          if (FUSE && i.fusion != Fusion::NONE && n + 1 < slice) { jumpFused(i); ++n; }
+          break;
+        case Handler::CMP_NNNN: opCMP_NNNN(i); break;
+          
+        case Handler::MUL8: opMUL8(i); break;
+        case Handler::MUL16: opMUL16(i); break;
+        case Handler::DIV8: opDIV8(i); break;
+        case Handler::COPY: opCOPY(i); if (eventCheck) leave(n); break;
+        case Handler::FILL: opFILL(i); if (eventCheck) leave(n); break;
+          
+        case Handler::JMP_NNNN: opJMP_NNNN(i); break;
+        case Handler::JMP_PP: opJMP_PP(i); break;
+        case Handler::CALL: opCALL(i); break;
+        case Handler::RET: opRET(i); break;
+          
+        case Handler::PUSH: opPUSH(i); break;
+        case Handler::PUSH16: opPUSH16(i); break;
+        case Handler::POP: opPOP(i); break;
+        case Handler::POP16: opPOP16(i); break;
+          
+        case Handler::LF: opLF(i); break;
+        case Handler::SF: opSF(i); break;
+        case Handler::EI: opEI(i); if (eventCheck) leave(n); break;
+        case Handler::DI: opDI(i); break;
+        case Handler::SEXT: opSEXT(i); break;
+        case Handler::NOP: opNOP(i); break;
+          
+        case Handler::BREAK:
+          if (!PROFILE && shouldBreak(i))
+          {
+            executed += n;
+            goto stopped;
+          }
+          opBREAK(i);
+          if (eventCheck) leave(n);
+          break;
+          
+        case Handler::INVALID:
+        case Handler::UNKNOWN:
+        case Handler::COUNT:
+          opUNKNOWN(i); break;
+      }
+      
+      if (TIMED)
+        account(i, pc);
+      
+      if (PROFILE)
+        profiler->retired(*this);
+      
+      if (WATCH && watchHit)
+      {
+        executed += n + 1;
+        goto stopped;
+      }
+    }
+    
+    executed += slice;
+  }
+  
+stopped:
+  stopRequested.store(false, std::memory_order_relaxed);
+  return executed;
+}
+
+u64 VM::runThreaded(u64 budget)
+{
+#if J80_THREADED_DISPATCH
+  /* must follow the order of Handler */
+  static const void* const labels[] = {
+    &&op_UNKNOWN,
+    
+    &&op_LD_RSH_LSH8,
+    &&op_LD_RSH_LSH16,
+    &&op_LD_NN,
+    &&op_LD_NNNN,
+    &&op_LD_PTR_NNNN,
+    &&op_LD_PTR_PP,
+    &&op_SD_PTR_NNNN,
+    &&op_SD_PTR_PP,
+    
+    &&op_ALU_REG8,
+    &&op_ALU_REG16,
+    &&op_ALU_NN,
+    &&op_ALU_NNNN,
+    
+    &&op_CMP_REG8,
+    &&op_CMP_REG16,
+    &&op_CMP_NN,
+    &&op_CMP_NNNN,
+    
+    &&op_MUL8,
+    &&op_MUL16,
+    &&op_DIV8,
+    
+    &&op_COPY,
+    &&op_FILL,
+    
+    &&op_JMP_NNNN,
+    &&op_JMP_PP,
+    &&op_CALL,
+    &&op_RET,
+    
+    &&op_PUSH,
+    &&op_PUSH16,
+    &&op_POP,
+    &&op_POP16,
+    
+    &&op_LF,
+    &&op_SF,
+    &&op_EI,
+    &&op_DI,
+    &&op_SEXT,
+    &&op_NOP,
+    
+    &&op_BREAK,
+    
+    &&op_UNKNOWN
+  };
+  
+  static_assert(sizeof(labels) / sizeof(labels[0]) == static_cast<size_t>(Handler::COUNT), "label table must match Handler enum");
+  
+  u64 executed = 0;
+  
+  while (executed < budget && !stopRequested.load(std::memory_order_relaxed))
+  {
+    u64 slice = std::min(budget - executed, STOP_CHECK_INTERVAL);
+    u64 remaining = slice;
+    const DecodedInstruction* i;
+
+/* every handler ends with its own indirect jump to the next one */
+#define DISPATCH() do { \
+  if (--remaining == 0) goto sliceDone; \
+  i = &decoded(regs.PC); \
+  goto *labels[static_cast<size_t>(i->handler)]; \
+} while (false)
+#define HANDLER(name) op_ ## name: op ## name(*i); DISPATCH();
+/* stores can reach a device scheduling an event and EI can let a pending interrupt in */
+#define CHECKED_HANDLER(name) op_ ## name: op ## name(*i); \
+  if (eventCheck) { executed += slice - remaining + 1; goto stopped; } \
+  DISPATCH();
+/* a fused pair counts as two instructions so it only runs whole when both fit the slice */
+#define FUSED_HANDLER(name, second) op_ ## name: op ## name(*i); \
+  if (i->fusion != Fusion::NONE && remaining > 1) { second(*i); --remaining; } \
+  DISPATCH();
+    
+    i = &decoded(regs.PC);
+    goto *labels[static_cast<size_t>(i->handler)];
+    
+    HANDLER(LD_RSH_LSH8)
+    HANDLER(LD_RSH_LSH16)
+    HANDLER(LD_NN)
+    HANDLER(LD_NNNN)
+    HANDLER(LD_PTR_NNNN)
+    HANDLER(LD_PTR_PP)
+    CHECKED_HANDLER(SD_PTR_NNNN)
+    CHECKED_HANDLER(SD_PTR_PP)
+    
+    HANDLER(ALU_REG8)
+    HANDLER(ALU_REG16)
+    HANDLER(ALU_NN)
+    FUSED_HANDLER(ALU_NNNN, jumpFused)
+    
+    FUSED_HANDLER(CMP_REG8, retFused)
+    FUSED_HANDLER(CMP_REG16, retFused)
+    FUSED_HANDLER(CMP_NN, jumpFused)
+    HANDLER(CMP_NNNN)
+    
+    HANDLER(MUL8)
+    HANDLER(MUL16)
+    HANDLER(DIV8)
+    
+    CHECKED_HANDLER(COPY)
+    CHECKED_HANDLER(FILL)
+    
+    HANDLER(JMP_NNNN)
+    HANDLER(JMP_PP)
+    HANDLER(CALL)
+    HANDLER(RET)
+    
+    HANDLER(PUSH)
+    HANDLER(PUSH16)
+    HANDLER(POP)
+    HANDLER(POP16)
+    
+    HANDLER(LF)
+    HANDLER(SF)
+    CHECKED_HANDLER(EI)
+    HANDLER(DI)
+    HANDLER(SEXT)
+    HANDLER(NOP)
+    
+  op_BREAK:
+    if (shouldBreak(*i))
+    {
+      executed += slice - remaining;
+      goto stopped;
+    }
+    opBREAK(*i);
+    if (eventCheck)
+    {
+      executed += slice - remaining + 1;
+      goto stopped;
+    }
+    DISPATCH();
+    
+    HANDLER(UNKNOWN)
+
+#undef FUSED_HANDLER
+#undef CHECKED_HANDLER
+#undef HANDLER
+#undef DISPATCH
+    
+  sliceDone:
+    executed += slice;
+  }
+  
+stopped:
+  stopRequested.store(false, std::memory_order_relaxed);
+  return executed;
+#else
+  return runSwitch(budget);
+#endif
+}
+
+/* translated blocks run until the budget can't fit the next one, the tail of the
+   budget and anything which can't be translated is run by the interpreter */
+u64 VM::runJit(u64 budget)
+{
+#if J80_JIT
+  if (!jit)
+    jit.reset(new vm::Jit(*this));
+  
+  if (jit->isValid())
+    return jit->run(budget);
+#endif
+  return runSwitch(budget);
+}
+
+Result VM::loadNative(const std::string& path)
+{
+  if (!aot)
+    aot.reset(new vm::Aot(*this));
+  
+  return aot->load(path);
+}
+
+void VM::unloadNative()
+{
+  if (aot)
+    aot->unload();
+}
+
+/* native blocks run while RAM still holds the code they were translated from, the
+   rest goes through the interpreter */
+u64 VM::runAot(u64 budget)
+{
+  if (aot && aot->isLoaded())
+    return aot->run(budget);
+  
+  return runSwitch(budget);
+}
+
+/* profiling, cycle accounting and watchpoints need to see every instruction so
+   they always go through the interpreter */
+u64 VM::dispatch(u64 budget)
+{
+  if (profiler || timing == Timing::CYCLE_ACCURATE || bus.hasWatches())
+    return interpret(budget);
+  
+  switch (engine)
+  {
+    case Engine::THREADED: return runThreaded(budget);
+    case Engine::JIT: return runJit(budget);
+    case Engine::AOT: return runAot(budget);
+    default: return runSwitch(budget);
+  }
+}
+
+/* longest fetch plus the slowest execution, a taken CALL or RET */
+static constexpr u64 MAX_INSTRUCTION_CYCLES = DecodeCache::MAX_INSTRUCTION_LENGTH + 5;
+
+/* engines never look at the event queue, each slice they get ends at the next
+   deadline (without events that's the whole budget) and they only leave early
+   when a store or EI asked for the queue to be looked at, with cycle accurate
+   timing slices shrink as the deadline gets closer so that it is never passed
+   by more than an instruction */
+u64 VM::run(u64 budget)
+{
+  u64 executed = 0;
+  
+  startRun();
+  
+  /* idle loops are looked for between slices, which are short enough for that */
+  bool probe = idleSkipping && !profiler && !bus.hasWatches();
+  
+  while (executed < budget)
+  {
+    if (eventCheck || clock() >= events.nextDeadline())
+      processEvents();
+    
+    u64 distance = events.nextDeadline() - clock();
+    
+    if (timing == Timing::CYCLE_ACCURATE)
+      distance = std::max<u64>(distance / MAX_INSTRUCTION_CYCLES, 1);
+    
+    u64 slice = std::min(budget - executed, probe ? std::min(distance, IDLE_CHECK_INTERVAL) : distance);
+    u64 done = dispatch(slice);
+    executed += done;
+    retiredCount += done;
+    
+    if (breakHit || haltHit || watchHit || (done < slice && !eventCheck))
+      break;
+    
+    if (probe && !eventCheck && executed < budget)
+    {
+      executed += probeIdle(budget - executed);
+      
+      if (idleHit || haltHit)
+        break;
+    }
+  }
+  
+  if (sout)
+    sout->flush();
+  
+  resumeAddress = NO_RESUME;
+  return executed;
+}
+
+VM::RunResult VM::run(const RunLimits& limits)
+{
+  auto start = std::chrono::steady_clock::now();
+  
+  RunResult result = { StopReason::STOP_REQUESTED, 0, 0, std::chrono::nanoseconds(0) };
+  
+  /* with throughput timing a cycle limit is just another instruction limit */
+  bool timed = timing == Timing::CYCLE_ACCURATE;
+  bool cycleLimit = timed && limits.cycles != std::numeric_limits<u64>::max();
+  u64 startCycles = cycleCount;
+  u64 budget = timed ? limits.instructions : std::min(limits.instructions, limits.cycles);
+  StopReason limitReason = timed || limits.instructions <= limits.cycles ? StopReason::INSTRUCTION_LIMIT : StopReason::CYCLE_LIMIT;
+  
+  /* breakpoints of the limits are set for the length of the run, engines trap them
+     like the others and a run starting on one executes it */
+  std::vector<u16> added;
+  
+  for (u16 address : limits.breakpoints)
+  {
+    if (!isBreakpoint(address))
+    {
+      setBreakpoint(address);
+      added.push_back(address);
+    }
+  }
+  
+  haltEnabled = limits.stopOnHalt;
+  
+  /* only a cycle limit needs a look at each instruction, anything else is trapped so
+     the selected engine runs at full speed */
+  if (!cycleLimit)
+  {
+    result.instructions = run(budget);
+    
+    if (breakHit)
+      result.reason = StopReason::BREAKPOINT;
+    else if (haltHit)
+      result.reason = StopReason::HALT;
+    else if (watchHit)
+      result.reason = StopReason::WATCHPOINT;
+    else if (idleHit)
+      result.reason = StopReason::IDLE;
+    else if (result.instructions == budget)
+      result.reason = limitReason;
+  }
+  else
+  {
+    bool stopped = false;
+    startRun();
+    
+    while (!stopped)
+    {
+      if (stopRequested.load(std::memory_order_relaxed))
+      {
+        result.reason = StopReason::STOP_REQUESTED;
+        break;
+      }
+      
+      u64 slice = std::min(budget - result.instructions, STOP_CHECK_INTERVAL);
+      
+      if (slice == 0)
+      {
+        result.reason = limitReason;
+        break;
+      }
+      
+      for (u64 n = 0; n < slice; ++n)
+      {
+        if (eventCheck || clock() >= events.nextDeadline())
+          processEvents();
+        
+        const DecodedInstruction& i = decoded(regs.PC);
+        u16 pc = regs.PC;
+        
+        /* the instruction which reaches the limit is completed */
+        if (cycleLimit && cycleCount - startCycles >= limits.cycles)
+        {
+          result.reason = StopReason::CYCLE_LIMIT;
+          stopped = true;
+          break;
+        }
+        
+        if (i.handler == Handler::BREAK && shouldBreak(i))
+        {
+          result.reason = haltHit ? StopReason::HALT : StopReason::BREAKPOINT;
+          stopped = true;
+          break;
+        }
+        
+        Handler handler = i.handler == Handler::BREAK ? i.trapped : i.handler;
+        
+        /* a jump to itself waiting for an interrupt, the slice is recomputed after a skip */
+        if (idleSkipping && !profiler && !bus.hasWatches() && handler == Handler::JMP_NNNN && i.short1 == regs.PC && isConditionTrue(i.cond))
+        {
+          u64 limit = budget - result.instructions;
+          
+          if (cycleLimit)
+            limit = std::min(limit, (limits.cycles - (cycleCount - startCycles)) / i.takenCycles);
+          
+          u64 skipped = skipIdle(1, i.takenCycles, limit);
+          result.instructions += skipped;
+          
+          if (idleHit)
+          {
+            result.reason = StopReason::IDLE;
+            stopped = true;
+            break;
+          }
+          else if (skipped)
+            break;
+        }
+        
+        if (profiler)
+          profiler->instruction(*this, i);
+        
+        (this->*handlers[static_cast<size_t>(i.handler)])(i);
+        ++result.instructions;
+        ++retiredCount;
+        
+        if (timed)
+          account(i, pc);
+        
+        if (profiler)
+          profiler->retired(*this);
+        
+        if (watchHit)
+        {
+          result.reason = StopReason::WATCHPOINT;
+          stopped = true;
+          break;
+        }
+      }
+    }
+    
+    stopRequested.store(false, std::memory_order_relaxed);
+    resumeAddress = NO_RESUME;
+    
+    if (sout)
+      sout->flush();
+  }
+  
+  haltEnabled = false;
+  
+  for (u16 address : added)
+    clearBreakpoint(address);
+  
+  result.cycles = timed ? cycleCount - startCycles : result.instructions;
+  result.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+  return result;
+}
+
+const char* VM::stopReasonName(StopReason reason)
+{
+  switch (reason)
+  {
+    case StopReason::INSTRUCTION_LIMIT: return "instruction limit";
+    case StopReason::CYCLE_LIMIT: return "cycle limit";
+    case StopReason::BREAKPOINT: return "breakpoint";
+    case StopReason::WATCHPOINT: return "watchpoint";
+    case StopReason::HALT: return "halt";
+    case StopReason::IDLE: return "idle";
+    case StopReason::STOP_REQUESTED: return "stop requested";
   }
   
-  regs.PC += length;
+  return "unknown";
 }
@@ -4,6 +4,40 @@
 #include "utils.h"
 
 #include "opcodes.h"
+#include "vm/bus.h"
+#include "vm/condition.h"
+#include "vm/events.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/* labels as values are needed by the threaded interpreter, other compilers
+   fall back to the switch based one */
+#if defined(__GNUC__) || defined(__clang__)
+  #define J80_THREADED_DISPATCH 1
+#else
+  #define J80_THREADED_DISPATCH 0
+#endif
+
+/* arithmetic flags are recorded by the ALU and computed only when something reads
+   them, define as 0 to compute them on every operation */
+#ifndef J80_LAZY_FLAGS
+  #define J80_LAZY_FLAGS 1
+#endif
+
+/* the block translator emits x86-64 code for the System V calling convention */
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(_WIN32)
+  #define J80_JIT 1
+#else
+  #define J80_JIT 0
+#endif
 
 enum Flag : u8
 {
@@ -13,105 +47,559 @@ enum Flag : u8
   FLAG_OVERFLOW = 0b1000,
 };
 
+/* the eight 16 bit registers are stored in encoding order so an encoded Reg indexes
+   them directly, 8 bit registers alias the halves of BA, CD, EF and XY, A D F Y
+   being the low bytes, the host is assumed to be little endian */
 struct Regs
 {
   union
   {
     struct
     {
-      u8 A;
-      u8 B;
+      union
+      {
+        struct
+        {
+          u8 A;
+          u8 B;
+        };
+        
+        u16 BA;
+      };
+      union
+      {
+        struct
+        {
+          u8 D;
+          u8 C;
+        };
+        
+        u16 CD;
+      };
+      union
+      {
+        struct
+        {
+          u8 F;
+          u8 E;
+        };
+        
+        u16 EF;
+      };
+      union
+      {
+        struct
+        {
+          u8 Y;
+          u8 X;
+        };
+        
+        u16 XY;
+      };
+      
+      u16 SP;
+      u16 FP;
+      u16 IX;
+      u16 IY;
     };
     
-    u16 BA;
+    u8 file8[16];
+    u16 file16[8];
   };
-  union
+  
+  u8 FLAGS;
+  
+  u16 PC;
+
+  /* byte offset into the register file of each 8 bit register */
+  static constexpr u8 REG8_OFFSETS[8] = { 0, 2, 4, 6, 1, 3, 5, 7 };
+
+  u8& reg8(Reg r) { return file8[REG8_OFFSETS[static_cast<u8>(r)]]; }
+  u16& reg16(Reg r) { return file16[static_cast<u8>(r)]; }
+  const u8& reg8(Reg r) const { return file8[REG8_OFFSETS[static_cast<u8>(r)]]; }
+  const u16& reg16(Reg r) const { return file16[static_cast<u8>(r)]; }
+
+  bool flag(Flag f) { return (FLAGS & f) == f; }
+};
+
+/* last arithmetic ALU operation whose flags haven't been written to FLAGS yet, carry,
+   zero, sign and overflow of ADD/ADC/SUB/SBC only depend on the unwrapped result
+   and on the sign of the first operand */
+struct LazyFlags
+{
+  u32 result;
+  u32 signMask;
+  bool negativeOperand;
+  
+  bool pending() const { return signMask != 0; }
+  void clear() { signMask = 0; }
+  
+  template <typename W> void record(bool negativeOperand, s32 result)
   {
-    struct
-    {
-      u8 D;
-      u8 C;
-    };
-    
-    u16 CD;
-  };
-  union
+    this->result = result;
+    this->signMask = 1 << (sizeof(W)*8 - 1);
+    this->negativeOperand = negativeOperand;
+  }
+  
+  /* a borrow leaves a negative result, which is above the mask once unsigned */
+  bool carry() const { return result > (signMask << 1) - 1; }
+  
+  u8 compute() const
   {
-    struct
-    {
-      u8 Y;
-      u8 X;
-    };
+    bool negative = (result & signMask) != 0;
     
-    u16 XY;
-  };
-  union
+    return (carry() ? FLAG_CARRY : 0)
+      | ((result & ((signMask << 1) - 1)) == 0 ? FLAG_ZERO : 0)
+      | (negative ? FLAG_SIGN : 0)
+      | (negative != negativeOperand ? FLAG_OVERFLOW : 0);
+  }
+};
+
+/* kind of handler bound to a decoded instruction, the extended bit of ALU
+   forms is solved at decode time so each handler works on a single width */
+enum class Handler : u8
+{
+  INVALID = 0,
+  
+  LD_RSH_LSH8,
+  LD_RSH_LSH16,
+  LD_NN,
+  LD_NNNN,
+  LD_PTR_NNNN,
+  LD_PTR_PP,
+  SD_PTR_NNNN,
+  SD_PTR_PP,
+  
+  ALU_REG8,
+  ALU_REG16,
+  ALU_NN,
+  ALU_NNNN,
+  
+  CMP_REG8,
+  CMP_REG16,
+  CMP_NN,
+  CMP_NNNN,
+  
+  MUL8,
+  MUL16,
+  DIV8,
+  
+  COPY,
+  FILL,
+  
+  JMP_NNNN,
+  JMP_PP,
+  CALL,
+  RET,
+  
+  PUSH,
+  PUSH16,
+  POP,
+  POP16,
+  
+  LF,
+  SF,
+  EI,
+  DI,
+  SEXT,
+  NOP,
+  
+  /* instruction at a breakpoint or a halt (see VM::haltsAt), the handler it replaces
+     is kept in trapped */
+  BREAK,
+  
+  UNKNOWN,
+  
+  COUNT
+};
+
+/* pairs of adjacent instructions executed together by the fast interpreters, the
+   fusion is owned by the first instruction so a jump straight to the second one
+   still runs it alone */
+enum class Fusion : u8
+{
+  NONE = 0,
+  
+  CMP_NN_JMP,
+  CMP_REG_RET,
+  ALU_NNNN_JMP,
+  
+  COUNT
+};
+
+struct DecodedInstruction
+{
+  Handler handler;
+  Opcode opcode;
+  Reg reg1;
+  Reg reg2;
+  Reg reg3;
+  Alu aluop;
+  JumpCondition cond;
+  u8 unsigned8;
+  u16 short1;
+  u16 short2;
+  u8 length;
+  /* clock cycles taken by the hardware when the instruction doesn't branch and when it does */
+  u8 cycles;
+  u8 takenCycles;
+  Handler trapped;
+  
+  /* the branch which follows the instruction when it is fused */
+  Fusion fusion;
+  JumpCondition cond2;
+  u8 length2;
+  u16 target2;
+  
+  s8 signed8() const { return static_cast<s8>(unsigned8); }
+};
+
+/* decoded instructions indexed by their address, pages are allocated the first
+   time an instruction inside them is decoded so writes to pages which never
+   contained code don't need to invalidate anything */
+class DecodeCache
+{
+public:
+  static constexpr u32 PAGE_SIZE = 256;
+  static constexpr u32 PAGE_COUNT = 0x10000 / PAGE_SIZE;
+  static constexpr u32 MAX_INSTRUCTION_LENGTH = 4;
+  /* a fused pair covers the bytes of both of its instructions */
+  static constexpr u32 MAX_SPAN = 2 * MAX_INSTRUCTION_LENGTH;
+  
+private:
+  std::array<std::unique_ptr<DecodedInstruction[]>, PAGE_COUNT> pages;
+  
+public:
+  DecodedInstruction* get(u16 address) const
   {
-    struct
+    const auto& page = pages[address / PAGE_SIZE];
+    
+    if (page)
     {
-      u8 F;
-      u8 E;
-    };
+      DecodedInstruction* entry = &page[address % PAGE_SIZE];
+      if (entry->handler != Handler::INVALID)
+        return entry;
+    }
     
-    u16 EF;
-  };
+    return nullptr;
+  }
   
-  u16 SP;
-  u16 FP;
-  u16 IX;
-  u16 IY;
+  DecodedInstruction& slot(u16 address)
+  {
+    auto& page = pages[address / PAGE_SIZE];
+    
+    if (!page)
+      page.reset(new DecodedInstruction[PAGE_SIZE]());
+    
+    return page[address % PAGE_SIZE];
+  }
   
-  u8 FLAGS;
+  /* an entry starting up to 7 bytes before address could contain it */
+  bool mayContain(u16 address) const
+  {
+    return pages[address / PAGE_SIZE] || pages[u16(address - (MAX_SPAN - 1)) / PAGE_SIZE];
+  }
   
-  u16 PC;
-
-  u8& reg8(Reg r)
+  void invalidate(u16 address)
   {
-    switch (r) {
-      case Reg::A: return A;
-      case Reg::B: return B;
-      case Reg::C: return C;
-      case Reg::D: return D;
-      case Reg::E: return E;
-      case Reg::F: return F;
-      case Reg::X: return X;
-      case Reg::Y: return Y;
+    for (u16 i = 0; i < MAX_SPAN; ++i)
+    {
+      u16 start = address - i;
+      const auto& page = pages[start / PAGE_SIZE];
+      
+      if (page)
+        page[start % PAGE_SIZE].handler = Handler::INVALID;
     }
   }
-
-  u16& reg16(Reg r)
+  
+  /* drops every instruction overlapping the page, allocated pages are kept */
+  void invalidatePage(u32 index)
   {
-    switch (r) {
-      case Reg::BA: return BA;
-      case Reg::CD: return CD;
-      case Reg::EF: return EF;
-      case Reg::XY: return XY;
-      case Reg::SP: return SP;
-      case Reg::FP: return FP;
-      case Reg::IX: return IX;
-      case Reg::IY: return IY;
+    if (pages[index])
+      std::fill_n(pages[index].get(), PAGE_SIZE, DecodedInstruction());
+    
+    const auto& previous = pages[(index - 1) % PAGE_COUNT];
+    
+    if (previous)
+    {
+      for (u32 i = PAGE_SIZE - (MAX_SPAN - 1); i < PAGE_SIZE; ++i)
+        previous[i].handler = Handler::INVALID;
     }
   }
+  
+  void clear()
+  {
+    for (auto& page : pages)
+      page.reset();
+  }
+};
 
-  bool flag(Flag f) { return (FLAGS & f) == f; }
+/* machine state saved by VM::snapshot, pages are immutable and shared between every
+   snapshot (and the VM) in which they didn't change so taking or restoring one only
+   copies the pages written in between, devices are not part of it */
+struct Snapshot
+{
+  static constexpr u32 PAGE_SIZE = 256;
+  static constexpr u32 PAGE_COUNT = 0x10000 / PAGE_SIZE;
+  
+  using Page = std::array<u8, PAGE_SIZE>;
+  
+  Regs regs;
+  LazyFlags lazyFlags;
+  bool interruptEnabled;
+  
+  std::array<std::shared_ptr<const Page>, PAGE_COUNT> pages;
 };
 
-class StdOut
+namespace vm
+{
+  class Aot;
+  class AotTranslator;
+  class FileMapping;
+  class Jit;
+  class Profiler;
+  class TraceRecorder;
+}
+
+/* console output, mapped as a write only device on its port */
+class StdOut : public vm::Device
 {
 public:
+  static constexpr u16 PORT = 0xFFFF;
+  
   virtual void out(u8 value) = 0;
+  void write(u16, u8 value) override { out(value); }
+  
+  /* called whenever a run returns, buffered implementations must emit their output */
+  virtual void flush() { }
 };
 
-class VM
+class VM : private vm::Watcher
 {
+  public:
+    enum class Engine
+    {
+      SWITCH,
+      THREADED,
+      JIT,
+      AOT
+    };
+  
+    /* how many instructions an engine runs before checking for a stop request */
+    static constexpr u64 STOP_CHECK_INTERVAL = 4096;
+  
+    static constexpr u32 MEMORY_SIZE = 0x10000;
+  
+    /* vectored interrupts jump to the slots laid out by J80Assembler for .interrupt */
+    static constexpr u16 INTERRUPT_VECTOR_BASE = 0x10;
+    static constexpr u16 INTERRUPT_VECTOR_SIZE = 4;
+    static constexpr u32 INTERRUPT_COUNT = 4;
+    /* taking an interrupt costs as much as a taken CALL */
+    static constexpr u8 INTERRUPT_CYCLES = 5;
+    /* block operations also spend a bus cycle for each byte they read or write, they
+       run to completion so events and interrupts wait for their end */
+    static constexpr u8 COPY_BYTE_CYCLES = 2;
+    static constexpr u8 FILL_BYTE_CYCLES = 1;
+  
+    /* with idle skipping, instructions run between two looks for an idle loop and
+       longest loop iteration a look can recognize */
+    static constexpr u64 IDLE_CHECK_INTERVAL = 1 << 12;
+    static constexpr u64 IDLE_PROBE_LENGTH = 64;
+  
+    /* cycle accurate timing accumulates the hardware cost of every instruction and
+       runs on the interpreter, throughput timing skips the accounting and lets every
+       engine run at full speed */
+    enum class Timing
+    {
+      THROUGHPUT,
+      CYCLE_ACCURATE
+    };
+  
+    /* cycles are only accounted with cycle accurate timing, otherwise every
+       instruction counts as one cycle */
+    struct RunLimits
+    {
+      u64 instructions = std::numeric_limits<u64>::max();
+      u64 cycles = std::numeric_limits<u64>::max();
+      std::vector<u16> breakpoints;
+      bool stopOnHalt = true;
+    };
+  
+    enum class StopReason
+    {
+      INSTRUCTION_LIMIT,
+      CYCLE_LIMIT,
+      BREAKPOINT,
+      WATCHPOINT,
+      HALT,
+      IDLE,
+      STOP_REQUESTED
+    };
+  
+    struct RunResult
+    {
+      StopReason reason;
+      u64 instructions;
+      u64 cycles;
+      std::chrono::nanoseconds elapsed;
+    };
+  
+    struct WatchHit
+    {
+      u16 pc;
+      u16 address;
+      u8 value;
+      bool write;
+    };
+  
   private:
     StdOut* sout;
     Regs regs;
     u8 *memory;
+    vm::MemoryBus bus;
     bool interruptEnabled;
 
     u32 dataSegmentStart;
   
+    LazyFlags lazyFlags;
+    DecodeCache decodeCache;
+    u32 fusions;
+  
+    /* a page with its dirty bit clear holds the same bytes as its entry in cleanPages */
+    std::array<u64, Snapshot::PAGE_COUNT / 64> dirtyPages;
+    std::array<std::shared_ptr<const Snapshot::Page>, Snapshot::PAGE_COUNT> cleanPages;
+  
+    bool isDirty(u32 page) const { return (dirtyPages[page / 64] >> (page % 64)) & 1; }
+    void markDirty(u16 address) { dirtyPages[address / Snapshot::PAGE_SIZE / 64] |= u64(1) << (address / Snapshot::PAGE_SIZE % 64); }
+    void markDirty(u32 start, size_t length);
+    void invalidateCode(u32 page);
+    void codeWritten(u16 address);
+    /* bytes stored straight to RAM by a block operation */
+    void blockWritten(u16 start, u32 length);
+    /* bytes changed behind the bus */
+    void ramReplaced(u32 start, size_t length);
+  
+    Engine engine;
+    std::atomic<bool> stopRequested;
+  
+    std::unique_ptr<vm::Jit> jit;
+    std::unique_ptr<vm::Aot> aot;
+    vm::Profiler* profiler;
+    vm::TraceRecorder* recorder;
+  
+    Timing timing;
+    u64 cycleCount;
+    u64 retiredCount;
+  
+    /* events scheduled relative to the clock are queued once the running instruction
+       has completed, since engines only update the clock between slices */
+    struct DeferredEvent
+    {
+      u64 delay;
+      vm::EventHandler* handler;
+    };
+  
+    vm::EventQueue events;
+    std::vector<DeferredEvent> deferredEvents;
+    u8 pendingInterrupts;
+    /* set when the queue or the pending interrupts must be looked at before the next
+       instruction, engines leave their slice when they find it set after a store or EI */
+    bool eventCheck;
+    void requestEventCheck();
+    void processEvents();
+    void deliverInterrupt();
+    /* a jump to itself can still be left through an interrupt */
+    bool mayBeInterrupted() const { return interruptEnabled && (pendingInterrupts || !events.empty() || !deferredEvents.empty()); }
+  
+    /* highest SP a push started from and lowest one a push left since reset */
+    u16 stackTop;
+    u16 stackBottom;
+    void pushed(u16 from, u16 to) { stackTop = std::max(stackTop, from); stackBottom = std::min(stackBottom, to); }
+  
+    /* a bit per address, instructions at set addresses are decoded as BREAK so
+       engines only look at breakpoints once they reach one */
+    std::array<u64, MEMORY_SIZE / 64> breakpoints;
+    std::unordered_map<u16, vm::Condition> breakConditions;
+    /* a run starting on a breakpoint executes it instead of stopping right away */
+    u32 resumeAddress;
+    bool breakHit;
+    /* halts are trapped like breakpoints, they only stop runs asking for it */
+    bool haltEnabled;
+    bool haltHit;
+    static bool haltsAt(const DecodedInstruction& i, u16 address) { return i.handler == Handler::UNKNOWN || (i.handler == Handler::JMP_NNNN && i.short1 == address); }
+  
+    bool watchHit;
+    WatchHit lastWatch;
+  
+    bool idleSkipping;
+    bool idleHit;
+    u64 probeIdle(u64 limit);
+    u64 skipIdle(u64 instructions, u64 cycles, u64 limit);
+    void watched(u16 address, u8 value, bool write) override;
+  
+    bool shouldBreak(const DecodedInstruction& i);
+    void invalidateBreakpoint(u16 address);
+    void startRun() { breakHit = false; haltHit = false; watchHit = false; idleHit = false; resumeAddress = isBreakpoint(regs.PC) ? regs.PC : NO_RESUME; }
+    static constexpr u32 NO_RESUME = 0x10000;
+  
+    using InstructionHandler = void (VM::*)(const DecodedInstruction&);
+    static const InstructionHandler handlers[];
+  
+    const DecodedInstruction& decode(u16 address);
+    const DecodedInstruction& decoded(u16 address)
+    {
+      const DecodedInstruction* i = decodeCache.get(address);
+      return i ? *i : decode(address);
+    }
+  
+    template <bool PROFILE, bool TIMED, bool WATCH> u64 interpret(u64 budget);
+    u64 interpret(u64 budget);
+    u64 dispatch(u64 budget);
+    void account(const DecodedInstruction& i, u16 pc) { cycleCount += regs.PC == u16(pc + i.length) ? i.cycles : i.takenCycles; }
+  
+    void opLD_RSH_LSH8(const DecodedInstruction& i);
+    void opLD_RSH_LSH16(const DecodedInstruction& i);
+    void opLD_NN(const DecodedInstruction& i);
+    void opLD_NNNN(const DecodedInstruction& i);
+    void opLD_PTR_NNNN(const DecodedInstruction& i);
+    void opLD_PTR_PP(const DecodedInstruction& i);
+    void opSD_PTR_NNNN(const DecodedInstruction& i);
+    void opSD_PTR_PP(const DecodedInstruction& i);
+    void opALU_REG8(const DecodedInstruction& i);
+    void opALU_REG16(const DecodedInstruction& i);
+    void opALU_NN(const DecodedInstruction& i);
+    void opALU_NNNN(const DecodedInstruction& i);
+    void opCMP_REG8(const DecodedInstruction& i);
+    void opCMP_REG16(const DecodedInstruction& i);
+    void opCMP_NN(const DecodedInstruction& i);
+    void opCMP_NNNN(const DecodedInstruction& i);
+    void opMUL8(const DecodedInstruction& i);
+    void opMUL16(const DecodedInstruction& i);
+    void opDIV8(const DecodedInstruction& i);
+    void opCOPY(const DecodedInstruction& i);
+    void opFILL(const DecodedInstruction& i);
+    void opJMP_NNNN(const DecodedInstruction& i);
+    void opJMP_PP(const DecodedInstruction& i);
+    void opCALL(const DecodedInstruction& i);
+    void opRET(const DecodedInstruction& i);
+    void opPUSH(const DecodedInstruction& i);
+    void opPUSH16(const DecodedInstruction& i);
+    void opPOP(const DecodedInstruction& i);
+    void opPOP16(const DecodedInstruction& i);
+    void opLF(const DecodedInstruction& i);
+    void opSF(const DecodedInstruction& i);
+    void opEI(const DecodedInstruction& i);
+    void opDI(const DecodedInstruction& i);
+    void opSEXT(const DecodedInstruction& i);
+    void opNOP(const DecodedInstruction& i);
+    void opBREAK(const DecodedInstruction& i);
+    void opUNKNOWN(const DecodedInstruction& i);
+  
+    /* second half of fused pairs, they run once the first instruction has advanced PC */
+    void fuse(DecodedInstruction& i, u16 address);
+    void jumpFused(const DecodedInstruction& i);
+    void retFused(const DecodedInstruction& i);
+  
     template <typename W> void add(const W& op1, const W& op2, W& dest, bool flags = true);
     template <typename W> void adc(const W& op1, const W& op2, W& dest, bool flags = true);
     template <typename W> void sub(const W& op1, const W& op2, W& dest, bool flags = true);
@@ -125,47 +613,195 @@ class VM
     inline void unsetFlag(Flag flag) { regs.FLAGS &= ~flag; }
     inline bool isFlagSet(Flag flag) { return (regs.FLAGS & flag) != 0; }
   
-  public:
-    VM()
+    void setMulDivFlags(u16 value, bool overflow);
+  
+    inline bool carry() const { return lazyFlags.pending() ? lazyFlags.carry() : (regs.FLAGS & FLAG_CARRY) != 0; }
+    template <typename W> inline void recordFlags(bool negativeOperand, s32 result)
     {
-      reset();
-      memory = new u8[0xFFFF]; 
-      dataSegmentStart = 0xFFFFFFFF;
+      lazyFlags.record<W>(negativeOperand, result);
+#if !J80_LAZY_FLAGS
+      materializeFlags();
+#endif
     }
+  
+    friend class vm::Aot;
+    friend class vm::AotTranslator;
+    friend class vm::Jit;
+  
+  public:
+    VM();
+    ~VM();
 
-    ~VM() { delete[] memory; }
-
-    void reset() { memset(&regs, 0, sizeof(Regs)); }
+    /* pending events are dropped since the clock restarts, devices keep their state */
+    void reset()
+    {
+      memset(&regs, 0, sizeof(Regs));
+      lazyFlags.clear();
+      interruptEnabled = false;
+      cycleCount = 0;
+      retiredCount = 0;
+      stackTop = 0;
+      stackBottom = 0xFFFF;
+      events.clear();
+      deferredEvents.clear();
+      pendingInterrupts = 0;
+      eventCheck = false;
+    }
+  
+    /* both clocks, the event queue and pending interrupts are left running by a
+       restore since they follow the devices, which snapshots don't cover */
+    Snapshot snapshot();
+    void restore(const Snapshot& snapshot);
     void executeInstruction();
   
-    void setStdOut(StdOut* out) { this->sout = out; }
+    void setStdOut(StdOut* out);
+  
+    /* devices stay owned by the caller and must outlive their mapping */
+    void mapDevice(vm::Device* device, u16 start, u32 length, vm::MemoryBus::Access access = vm::MemoryBus::READ_WRITE);
+    void unmapDevice(vm::Device* device);
+    void setReadInterceptor(vm::ReadInterceptor* interceptor) { bus.setReadInterceptor(interceptor); }
+    /* while a profiler is attached every engine runs through the profiled interpreter */
+    void setProfiler(vm::Profiler* profiler) { this->profiler = profiler; }
+    /* told about every interrupt taken so that a replay can deliver it again */
+    void setTraceRecorder(vm::TraceRecorder* recorder) { this->recorder = recorder; }
     void setDataSegmentStart(u32 dss) { this->dataSegmentStart = dss; }
 
     u32 getDataSegmentStart() { return dataSegmentStart; }
   
     bool isConditionTrue(JumpCondition condition) const;
   
-    void copyToRam(u8* data, size_t length, u16 offset = 0)
-    {
-      memcpy(&memory[offset], data, length);
-    }
+    void copyToRam(const u8* data, size_t length, u16 offset = 0);
+    /* places length bytes of a read only file from offset at address without copying
+       them when everything is page aligned, see vm::FileMapping::mapInto */
+    void mapRam(const vm::FileMapping& file, size_t offset, u16 address, u32 length);
+    void clearRam();
   
     void ramWrite(u16 address, u8 value);
-    u8 ramRead(u16 address) const { return memory[address]; }
+    u8 ramRead(u16 address) const { return bus.read(address); }
     const u8* ram() { return memory; }
 
-    auto& allRegs() { return regs; }
+    auto& allRegs() { materializeFlags(); return regs; }
+
+    /* writes pending arithmetic flags to FLAGS, must be called before inspecting
+       registers directly */
+    void materializeFlags()
+    {
+      if (lazyFlags.pending())
+      {
+        regs.FLAGS = (regs.FLAGS & ~0x0F) | lazyFlags.compute();
+        lazyFlags.clear();
+      }
+    }
 
     u16 pc() const { return regs.PC; }
-    u8 flags() const { return regs.FLAGS; }
+    u8 flags() const { return lazyFlags.pending() ? (regs.FLAGS & ~0x0F) | lazyFlags.compute() : regs.FLAGS; }
     u8& reg8(Reg r) { return regs.reg8(r); }
     u16& reg16(Reg r) { return regs.reg16(r); }
 
-    void run()
+    static bool isEngineAvailable(Engine engine)
     {
-      while (true)
-        executeInstruction();
+      switch (engine)
+      {
+        case Engine::SWITCH: return true;
+        case Engine::THREADED: return J80_THREADED_DISPATCH;
+        case Engine::JIT: return J80_JIT;
+        case Engine::AOT: return true;
+      }
+      
+      return false;
     }
+    bool setEngine(Engine engine)
+    {
+      if (!isEngineAvailable(engine))
+        return false;
+      
+      this->engine = engine;
+      return true;
+    }
+    Engine getEngine() const { return engine; }
+  
+    void setTiming(Timing timing) { this->timing = timing; }
+    Timing getTiming() const { return timing; }
+    /* cycles accumulated since the last reset, only advanced with cycle accurate timing */
+    u64 cycles() const { return cycleCount; }
+    u64 retiredInstructions() const { return retiredCount; }
+    /* time base of the event queue, cycles with cycle accurate timing and retired
+       instructions otherwise, both only advance while running */
+    u64 clock() const { return timing == Timing::CYCLE_ACCURATE ? cycleCount : retiredCount; }
+    /* bytes between the highest SP a push started from and the lowest SP reached */
+    u16 peakStackDepth() const { return stackTop > stackBottom ? stackTop - stackBottom : 0; }
+  
+    /* bit mask of the Fusion kinds the decoder may form, fused pairs are only run by
+       the switch and threaded engines while neither profiling nor timing is active */
+    static constexpr u32 fusionBit(Fusion fusion) { return 1 << static_cast<u32>(fusion); }
+    static constexpr u32 ALL_FUSIONS = ((1 << static_cast<u32>(Fusion::COUNT)) - 1) & ~1;
+    void setFusions(u32 fusions) { this->fusions = fusions; decodeCache.clear(); }
+    u32 getFusions() const { return fusions; }
+  
+    /* runs stop before the instruction at a breakpoint when its condition (see
+       vm::Condition) holds or is empty, a run starting on a breakpoint executes it,
+       stepping with executeInstruction always executes */
+    Result setBreakpoint(u16 address, const std::string& condition = std::string());
+    void clearBreakpoint(u16 address);
+    void clearBreakpoints();
+    bool isBreakpoint(u16 address) const { return (breakpoints[address / 64] >> (address % 64)) & 1; }
+  
+    /* runs stop after the instruction which accessed a watched byte through the bus,
+       while any watchpoint is set every engine runs through the interpreter */
+    void setWatchpoint(u16 start, u32 length, vm::MemoryBus::Access access = vm::MemoryBus::WRITE) { bus.watch(start, length, access); }
+    void clearWatchpoint(u16 start, u32 length) { bus.unwatch(start, length); }
+    void clearWatchpoints() { bus.clearWatches(); }
+    const WatchHit& lastWatchHit() const { return lastWatch; }
+  
+    /* handlers fire between instructions once clock() reaches their deadline, engines
+       are run in slices ending at the next deadline so nothing is checked per
+       instruction, handlers stay owned by the caller and must cancel their events
+       before going away */
+    void schedule(u64 deadline, vm::EventHandler* handler) { events.schedule(deadline, handler); requestEventCheck(); }
+    /* the delay starts after the running instruction, as needed by devices */
+    void scheduleIn(u64 delay, vm::EventHandler* handler) { deferredEvents.push_back({ delay, handler }); requestEventCheck(); }
+    void cancelEvents(vm::EventHandler* handler);
+    u64 nextEventDeadline() const { return events.nextDeadline(); }
+  
+    /* an interrupt stays pending until interrupts are enabled, then it is taken as a
+       CALL to its vector slot which disables interrupts, the handler enables them
+       again with EI before returning, the lowest index goes first */
+    void raiseInterrupt(u8 index);
+    bool interruptsEnabled() const { return interruptEnabled; }
+    /* whether the last run stopped because of a breakpoint, a watchpoint or an idle loop */
+    bool stoppedAtBreakpoint() const { return breakHit; }
+    bool stoppedAtWatchpoint() const { return watchHit; }
+    bool stoppedIdle() const { return idleHit; }
+  
+    /* a loop which neither stores, reads devices nor changes the interrupt state and
+       comes back to an address with the same registers repeats until an interrupt,
+       runs then skip its iterations up to the next event deadline and stop when no
+       interrupt can ever be taken, counters advance as if the loop had run, off by
+       default so that benchmarks really spin and ignored while profiling or watching,
+       run(const RunLimits&) with a cycle limit only skips jumps to themselves */
+    void setIdleSkipping(bool enabled) { idleSkipping = enabled; }
+    bool getIdleSkipping() const { return idleSkipping; }
+  
+    /* engines run until budget instructions have been executed or a stop has been
+       requested (from any thread), they return the amount of executed instructions */
+    u64 runSwitch(u64 budget);
+    u64 runThreaded(u64 budget);
+    u64 runJit(u64 budget);
+    u64 runAot(u64 budget);
+    u64 run(u64 budget);
+  
+    /* runs until one of the limits is hit, breakpoints stop before executing the
+       instruction at their address, halts are a taken jump to itself which no
+       interrupt can leave or an unknown opcode, neither of which can ever advance PC */
+    RunResult run(const RunLimits& limits);
+    static const char* stopReasonName(StopReason reason);
+  
+    void requestStop() { stopRequested.store(true, std::memory_order_relaxed); }
+  
+    /* the AOT engine runs the blocks of a module built from the C++ emitted by
+       vm::AotTranslator, without a module it is the plain interpreter */
+    Result loadNative(const std::string& path);
+    void unloadNative();
 };
 
 
@@ -0,0 +1,774 @@
+#include "aot.h"
+
+#include "../support/format/format.h"
+
+#include <algorithm>
+#include <cstddef>
+
+#if _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+using namespace vm;
+
+constexpr u32 AotTranslator::MAX_BLOCK_INSTRUCTIONS;
+constexpr u32 Aot::ABI_VERSION;
+
+static_assert(offsetof(Regs, FLAGS) == 16 && offsetof(Regs, PC) == 18 && sizeof(Regs) == 20, "translated code relies on the layout of Regs");
+static_assert(MemoryBus::PAGE_SIZE == 256, "translated code indexes bus pages by the high byte of addresses");
+
+/* what j80_aot_module() returns, mirrored by the prelude */
+struct AotModule
+{
+  u32 abi;
+  u32 origin;
+  u32 length;
+  const u8* code;
+  u32 blockCount;
+  const AotBlock* blocks;
+  u32 (*run)(AotContext* context);
+};
+
+/* the generated code only depends on the standard library, the ALU is the one of
+   VM::alu with saveFlags set, which is how every handler calls it, computing flags
+   right away: they are the same bits the lazy ones would give once materialized */
+static const char* const PRELUDE = R"(#include <cstdint>
+
+#if defined(_WIN32)
+  #define J80_AOT_EXPORT extern "C" __declspec(dllexport)
+#else
+  #define J80_AOT_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+namespace j80aot
+{
+  typedef uint8_t u8;
+  typedef uint16_t u16;
+  typedef uint32_t u32;
+  typedef int32_t s32;
+  typedef uint64_t u64;
+
+  struct Regs
+  {
+    union
+    {
+      u8 r8[16];
+      u16 r16[8];
+    };
+
+    u8 FLAGS;
+    u16 PC;
+  };
+
+  struct Context
+  {
+    Regs* regs;
+    u8* memory;
+    const bool* readMapped;
+    const u8* gates;
+    u16* stackTop;
+    u16* stackBottom;
+    void* vm;
+    u8 (*read)(void* vm, u16 address);
+    void (*write)(void* vm, u16 address, u8 value);
+    void (*execute)(void* vm);
+    u64 budget;
+    u8 exit;
+  };
+
+  struct Block
+  {
+    u16 start;
+    u16 length;
+    u32 count;
+  };
+
+  struct Module
+  {
+    u32 abi;
+    u32 origin;
+    u32 length;
+    const u8* code;
+    u32 blockCount;
+    const Block* blocks;
+    u32 (*run)(Context* context);
+  };
+
+  enum : u32
+  {
+    EXIT_BUDGET = 0,
+    EXIT_LOOKUP = 1,
+    EXIT_LEAVE = 2,
+
+    /* returned by blocks instead of the next address */
+    BLOCK_BUDGET = 0x10000,
+    BLOCK_LEAVE = 0x10001
+  };
+
+  enum : u8
+  {
+    FLAG_CARRY = 0x01,
+    FLAG_ZERO = 0x02,
+    FLAG_SIGN = 0x04,
+    FLAG_OVERFLOW = 0x08
+  };
+
+)";
+
+static const char* const PRELUDE_HELPERS = R"(
+  template <typename W> inline bool negative(u32 value) { return (value & (1 << (sizeof(W)*8 - 1))) != 0; }
+  inline void setFlag(Regs* r, u8 flag, bool value) { r->FLAGS = value ? r->FLAGS | flag : r->FLAGS & ~flag; }
+
+  template <u8 OP, typename W> inline void alu(Regs* r, const W& op1, const W& op2, W& dest, bool saveResult)
+  {
+    bool arithmetic = false;
+    s32 result = 0;
+
+    switch (OP)
+    {
+      case TRANSFER_A8: case TRANSFER_A16: case TRANSFER_B8: case TRANSFER_B16: dest = op2; return;
+      case ADD8: case ADD16: result = op1 + op2; arithmetic = true; break;
+      case ADC8: case ADC16: result = op1 + op2 + ((r->FLAGS & FLAG_CARRY) ? 1 : 0); dest = result; arithmetic = true; break;
+      case SUB8: case SUB16: result = op1 - op2; arithmetic = true; break;
+      case SBC8: case SBC16: result = op1 - op2 - ((r->FLAGS & FLAG_CARRY) ? 1 : 0); arithmetic = true; break;
+      case AND8: case AND16: dest = op1 & op2; break;
+      case OR8: case OR16: dest = op1 | op2; break;
+      case XOR8: case XOR16: dest = op1 ^ op2; break;
+      case NOT8: case NOT16: dest = ~op1; break;
+      case LSH8: case LSH16: setFlag(r, FLAG_CARRY, negative<W>(op1)); dest = op1 << 1; break;
+      case RSH8: case RSH16: setFlag(r, FLAG_CARRY, op1 & 0x01); dest = op1 >> 1; break;
+      default: break;
+    }
+
+    if (arithmetic)
+    {
+      u32 mask = 1 << (sizeof(W)*8 - 1), value = result;
+      bool sign = (value & mask) != 0;
+
+      r->FLAGS = (r->FLAGS & ~0x0F)
+        | (value > (mask << 1) - 1 ? FLAG_CARRY : 0)
+        | ((value & ((mask << 1) - 1)) == 0 ? FLAG_ZERO : 0)
+        | (sign ? FLAG_SIGN : 0)
+        | (sign != negative<W>(op1) ? FLAG_OVERFLOW : 0);
+    }
+
+    if (saveResult)
+      dest = result;
+
+    if (!arithmetic)
+      setFlag(r, FLAG_ZERO, (saveResult ? dest : W(result)) == 0);
+  }
+
+  inline void mulDivFlags(Regs* r, u16 value, bool overflow)
+  {
+    r->FLAGS = (r->FLAGS & ~0x0F)
+      | (overflow ? FLAG_CARRY | FLAG_OVERFLOW : 0)
+      | (value == 0 ? FLAG_ZERO : 0)
+      | (value & 0x8000 ? FLAG_SIGN : 0);
+  }
+
+  inline void mul8(Regs* r, u16& dest, u8 op1, u8 op2) { u16 product = op1 * op2; dest = product; mulDivFlags(r, product, product > 0xFF); }
+  inline void mul16(Regs* r, u16& dest, u16 op1, u16 op2) { u32 product = u32(op1) * op2; dest = product; mulDivFlags(r, product, product > 0xFFFF); }
+
+  inline void div8(Regs* r, u16& quotient, u16 dividend, u8& divisor)
+  {
+    if (divisor == 0)
+      r->FLAGS = (r->FLAGS & ~0x0F) | FLAG_OVERFLOW;
+    else
+    {
+      u8 d = divisor;
+      quotient = dividend / d;
+      divisor = dividend % d;
+      mulDivFlags(r, dividend / d, false);
+    }
+  }
+
+  inline u8 read(Context* c, u16 address) { return c->readMapped[address >> 8] ? c->read(c->vm, address) : c->memory[address]; }
+  inline void write(Context* c, u16 address, u8 value) { c->write(c->vm, address, value); }
+
+  inline void pushed(Context* c, u16 from, u16 to)
+  {
+    if (from > *c->stackTop) *c->stackTop = from;
+    if (to < *c->stackBottom) *c->stackBottom = to;
+  }
+
+  /* same order of accesses as the VM handlers, value can be SP itself */
+  inline void push8(Context* c, u8 value) { u16& sp = c->regs->r16[4]; pushed(c, sp, sp - 1); --sp; write(c, sp, value); }
+  inline void push16(Context* c, const u16& value) { u16& sp = c->regs->r16[4]; pushed(c, sp, sp - 2); --sp; write(c, sp, value & 0xFF); --sp; write(c, sp, (value >> 8) & 0xFF); }
+  inline void pop8(Context* c, u8& value) { u16& sp = c->regs->r16[4]; value = read(c, sp); ++sp; }
+  inline void pop16(Context* c, u16& value) { u16& sp = c->regs->r16[4]; u8 high = read(c, sp); ++sp; u8 low = read(c, sp); ++sp; value = (high << 8) | low; }
+  inline u16 ret(Context* c) { u16 value; pop16(c, value); return value; }
+}
+
+using namespace j80aot;
+)";
+
+/* names of the ALU operations as the prelude knows them, values come from Alu so that
+   operations the VM doesn't implement (or can't decode) behave the same */
+static const struct { Alu alu; const char* name; } ALU_NAMES[] = {
+  { Alu::ADD8, "ADD8" }, { Alu::ADD16, "ADD16" }, { Alu::ADC8, "ADC8" }, { Alu::ADC16, "ADC16" },
+  { Alu::SUB8, "SUB8" }, { Alu::SUB16, "SUB16" }, { Alu::SBC8, "SBC8" }, { Alu::SBC16, "SBC16" },
+  { Alu::AND8, "AND8" }, { Alu::AND16, "AND16" }, { Alu::OR8, "OR8" }, { Alu::OR16, "OR16" },
+  { Alu::XOR8, "XOR8" }, { Alu::XOR16, "XOR16" }, { Alu::NOT8, "NOT8" }, { Alu::NOT16, "NOT16" },
+  { Alu::TRANSFER_A8, "TRANSFER_A8" }, { Alu::TRANSFER_A16, "TRANSFER_A16" }, { Alu::TRANSFER_B8, "TRANSFER_B8" }, { Alu::TRANSFER_B16, "TRANSFER_B16" },
+  { Alu::LSH8, "LSH8" }, { Alu::LSH16, "LSH16" }, { Alu::RSH8, "RSH8" }, { Alu::RSH16, "RSH16" }
+};
+
+static std::string aluName(Alu alu)
+{
+  for (const auto& entry : ALU_NAMES)
+    if (entry.alu == alu)
+      return entry.name;
+
+  return fmt::format("{}", static_cast<u32>(alu));
+}
+
+AotTranslator::AotTranslator(const u8* code, u32 length, u16 origin) : origin(origin), end(std::min<u32>(origin + length, VM::MEMORY_SIZE))
+{
+  vm.setFusions(0);
+  vm.copyToRam(code, end - origin, origin);
+}
+
+/* every instruction reachable from an entry is visited once, blocks start at entries,
+   at branch targets and after conditional branches and calls */
+std::vector<bool> AotTranslator::findLeaders()
+{
+  std::vector<bool> leaders(VM::MEMORY_SIZE, false), visited(VM::MEMORY_SIZE, false);
+  std::vector<u32> pending;
+
+  auto lead = [&](u32 address) {
+    if (inside(address))
+    {
+      leaders[address] = true;
+      pending.push_back(address);
+    }
+  };
+
+  for (u16 entry : entries)
+    lead(entry);
+
+  while (!pending.empty())
+  {
+    u32 address = pending.back();
+    pending.pop_back();
+
+    while (inside(address) && !visited[address])
+    {
+      visited[address] = true;
+
+      const DecodedInstruction& i = vm.decoded(address);
+
+      if (i.handler == Handler::UNKNOWN || !inside(address, i.length))
+        break;
+
+      u32 next = address + i.length;
+
+      /* a jump to itself is trapped as a halt (see VM::haltsAt), it is left to the
+         interpreter so that runs can stop on it */
+      if (i.handler == Handler::BREAK)
+      {
+        if (!(i.cond & COND_UNCOND))
+          lead(next);
+
+        break;
+      }
+
+      if (isBranch(i.handler))
+      {
+        if (i.handler == Handler::JMP_NNNN || i.handler == Handler::CALL)
+          lead(i.short1);
+
+        if (!(i.cond & COND_UNCOND) || i.handler == Handler::CALL)
+          lead(next);
+
+        break;
+      }
+
+      address = next;
+    }
+  }
+
+  return leaders;
+}
+
+/* splitting a block which got too long adds a leader, blocks are built again until
+   there is none to add so that no block runs over the start of another */
+void AotTranslator::buildBlocks(std::vector<bool>& leaders)
+{
+  bool split = true;
+
+  while (split)
+  {
+    split = false;
+    blocks.clear();
+
+    for (u32 start = origin; start < end; ++start)
+    {
+      if (!leaders[start])
+        continue;
+
+      Block block;
+      block.start = start;
+
+      u32 address = start;
+      bool terminated = false;
+
+      while (!terminated && block.instructions.size() < MAX_BLOCK_INSTRUCTIONS && inside(address) && (address == start || !leaders[address]))
+      {
+        const DecodedInstruction& i = vm.decoded(address);
+
+        if (i.handler == Handler::UNKNOWN || i.handler == Handler::BREAK || !inside(address, i.length))
+          break;
+
+        block.instructions.push_back(address);
+        address += i.length;
+        terminated = isBranch(i.handler);
+      }
+
+      if (!terminated && block.instructions.size() == MAX_BLOCK_INSTRUCTIONS && inside(address) && !leaders[address])
+      {
+        leaders[address] = true;
+        split = true;
+      }
+
+      block.end = address;
+
+      if (!block.instructions.empty())
+        blocks.push_back(std::move(block));
+    }
+  }
+}
+
+std::string AotTranslator::reg8(Reg reg) const
+{
+  return fmt::format("r->r8[{}]", Regs::REG8_OFFSETS[static_cast<u8>(reg)]);
+}
+
+std::string AotTranslator::reg16(Reg reg) const
+{
+  return fmt::format("r->r16[{}]", static_cast<u8>(reg));
+}
+
+/* same as VM::isConditionTrue, anything with the unconditional bit is taken */
+std::string AotTranslator::condition(JumpCondition cond) const
+{
+  switch (cond)
+  {
+    case COND_CARRY: return "(r->FLAGS & FLAG_CARRY)";
+    case COND_NCARRY: return "!(r->FLAGS & FLAG_CARRY)";
+    case COND_ZERO: return "(r->FLAGS & FLAG_ZERO)";
+    case COND_NZERO: return "!(r->FLAGS & FLAG_ZERO)";
+    case COND_OVERFLOW: return "(r->FLAGS & FLAG_OVERFLOW)";
+    case COND_NOVERFLOW: return "!(r->FLAGS & FLAG_OVERFLOW)";
+    case COND_SIGN: return "(r->FLAGS & FLAG_SIGN)";
+    case COND_NSIGN: return "!(r->FLAGS & FLAG_SIGN)";
+    default: return "true";
+  }
+}
+
+/* C++ for a single instruction, branches return the address they continue from */
+std::string AotTranslator::statement(const DecodedInstruction& i, u16 address) const
+{
+  const u16 next = address + i.length;
+  const std::string alu = aluName(i.aluop);
+
+  switch (i.handler)
+  {
+    case Handler::LD_RSH_LSH8: return fmt::format("alu<{}, u8>(r, {}, {}, {}, true);", alu, reg8(i.reg1), reg8(i.reg2), reg8(i.reg1));
+    case Handler::LD_RSH_LSH16: return fmt::format("alu<{}, u16>(r, {}, {}, {}, true);", alu, reg16(i.reg1), reg16(i.reg2), reg16(i.reg1));
+    case Handler::LD_NN: return fmt::format("{} = 0x{:02X};", reg8(i.reg1), i.unsigned8);
+    case Handler::LD_NNNN: return fmt::format("{} = 0x{:04X};", reg16(i.reg1), i.short1);
+    case Handler::LD_PTR_NNNN: return fmt::format("{} = read(c, 0x{:04X});", reg8(i.reg1), i.short1);
+    case Handler::LD_PTR_PP: return fmt::format("{} = read(c, u16({} + ({})));", reg8(i.reg1), reg16(i.reg2), i.signed8());
+    case Handler::SD_PTR_NNNN: return fmt::format("write(c, 0x{:04X}, {});", i.short1, reg8(i.reg1));
+    case Handler::SD_PTR_PP: return fmt::format("write(c, u16({} + ({})), {});", reg16(i.reg2), i.signed8(), reg8(i.reg1));
+
+    case Handler::ALU_REG8: return fmt::format("alu<{}, u8>(r, {}, {}, {}, true);", alu, reg8(i.reg2), reg8(i.reg3), reg8(i.reg1));
+    case Handler::ALU_REG16: return fmt::format("alu<{}, u16>(r, {}, {}, {}, true);", alu, reg16(i.reg2), reg16(i.reg3), reg16(i.reg1));
+    case Handler::ALU_NN: return fmt::format("alu<{}, u8>(r, {}, u8(0x{:02X}), {}, true);", alu, reg8(i.reg2), i.unsigned8, reg8(i.reg1));
+    case Handler::ALU_NNNN: return fmt::format("alu<{}, u16>(r, {}, u16(0x{:04X}), {}, true);", alu, reg16(i.reg2), i.short2, reg16(i.reg1));
+
+    case Handler::CMP_REG8: return fmt::format("alu<{}, u8>(r, {}, {}, {}, false);", alu, reg8(i.reg1), reg8(i.reg2), reg8(i.reg1));
+    case Handler::CMP_REG16: return fmt::format("alu<{}, u16>(r, {}, {}, {}, false);", alu, reg16(i.reg1), reg16(i.reg2), reg16(i.reg1));
+    case Handler::CMP_NN: return fmt::format("alu<{}, u8>(r, {}, u8(0x{:02X}), {}, false);", alu, reg8(i.reg1), i.unsigned8, reg8(i.reg1));
+    case Handler::CMP_NNNN: return fmt::format("alu<{}, u16>(r, {}, u16(0x{:04X}), {}, false);", alu, reg16(i.reg1), i.short2, reg16(i.reg1));
+
+    case Handler::JMP_NNNN:
+      if (i.cond & COND_UNCOND)
+        return fmt::format("return 0x{:04X};", i.short1);
+      return fmt::format("return {} ? 0x{:04X} : 0x{:04X};", condition(i.cond), i.short1, next);
+
+    case Handler::JMP_PP:
+      if (i.cond & COND_UNCOND)
+        return fmt::format("return {};", reg16(i.reg2));
+      return fmt::format("return {} ? {} : 0x{:04X};", condition(i.cond), reg16(i.reg2), next);
+
+    case Handler::CALL:
+      if (i.cond & COND_UNCOND)
+        return fmt::format("push16(c, u16(0x{:04X}));\n  return 0x{:04X};", next, i.short1);
+      return fmt::format("if ({})\n  {{\n    push16(c, u16(0x{:04X}));\n    return 0x{:04X};\n  }}\n  return 0x{:04X};", condition(i.cond), next, i.short1, next);
+
+    case Handler::RET:
+      if (i.cond & COND_UNCOND)
+        return "return ret(c);";
+      return fmt::format("return {} ? ret(c) : 0x{:04X};", condition(i.cond), next);
+
+    case Handler::PUSH: return fmt::format("push8(c, {});", reg8(i.reg1));
+    case Handler::PUSH16: return fmt::format("push16(c, {});", reg16(i.reg1));
+    case Handler::POP: return fmt::format("pop8(c, {});", reg8(i.reg1));
+    case Handler::POP16: return fmt::format("pop16(c, {});", reg16(i.reg1));
+
+    case Handler::LF: return fmt::format("r->FLAGS = 0x0F & {};", reg8(i.reg1));
+    case Handler::SF: return fmt::format("{} = 0x0F & r->FLAGS;", reg8(i.reg1));
+    case Handler::MUL8: return fmt::format("mul8(r, {}, {}, {});", reg16(i.reg1), reg8(i.reg2), reg8(i.reg3));
+    case Handler::MUL16: return fmt::format("mul16(r, {}, {}, {});", reg16(i.reg1), reg16(i.reg2), reg16(i.reg3));
+    case Handler::DIV8: return fmt::format("div8(r, {}, {}, {});", reg16(i.reg1), reg16(i.reg2), reg8(i.reg3));
+
+    case Handler::SEXT: return fmt::format("{} = {} & 0x80 ? 0xFF : 0x00;", reg8(static_cast<Reg>(i.reg1 | 0b100)), reg8(i.reg1));
+    case Handler::NOP: return "";
+
+    /* the interrupt state belongs to the VM, block operations use its bulk path */
+    default: return fmt::format("r->PC = 0x{:04X};\n  c->execute(c->vm);", address);
+  }
+}
+
+std::string AotTranslator::emitBlock(const Block& block)
+{
+  const u32 count = static_cast<u32>(block.instructions.size());
+
+  std::string code = fmt::format("static u32 block_{0:04X}(Context* c)\n{{\n  Regs* r = c->regs;\n  (void)r;\n\n  if (c->budget < {1})\n    return BLOCK_BUDGET;\n  c->budget -= {1};\n", block.start, count);
+  bool terminated = false;
+
+  for (u32 k = 0; k < count; ++k)
+  {
+    const u16 address = block.instructions[k];
+    const DecodedInstruction& i = vm.decoded(address);
+
+    std::string bytes;
+    for (u32 b = 0; b < i.length; ++b)
+      bytes += fmt::format(" {:02X}", vm.memory[address + b]);
+
+    code += fmt::format("\n  // {:04X}:{}\n", address, bytes);
+
+    std::string line = statement(i, address);
+    if (!line.empty())
+      code += "  " + line + "\n";
+
+    /* a store or EI may have asked the VM to look at its events or hit translated code */
+    bool leave = i.handler == Handler::SD_PTR_NNNN || i.handler == Handler::SD_PTR_PP || i.handler == Handler::PUSH || i.handler == Handler::PUSH16 || i.handler == Handler::EI
+      || i.handler == Handler::COPY || i.handler == Handler::FILL;
+
+    if (leave && k + 1 < count)
+      code += fmt::format("  if (c->exit)\n  {{\n    c->budget += {};\n    r->PC = 0x{:04X};\n    return BLOCK_LEAVE;\n  }}\n", count - k - 1, address + i.length);
+
+    terminated = isBranch(i.handler);
+  }
+
+  if (!terminated)
+    code += fmt::format("\n  return 0x{:04X};\n", block.end);
+
+  return code + "}\n\n";
+}
+
+std::string AotTranslator::translate()
+{
+  std::vector<bool> leaders = findLeaders();
+  buildBlocks(leaders);
+
+  std::string code = fmt::format("// translated from {} bytes of J80 code at {:04X}h, {} blocks\n", end - origin, origin, blocks.size());
+  code += "// build with: c++ -O2 -shared -fPIC <this file> -o <module>\n\n";
+  code += PRELUDE;
+
+  code += "  enum : u8\n  {\n";
+  for (const auto& entry : ALU_NAMES)
+    code += fmt::format("    {} = {},\n", entry.name, static_cast<u32>(entry.alu));
+  code += "  };\n";
+
+  code += PRELUDE_HELPERS;
+  code += "\n";
+
+  for (const Block& block : blocks)
+    code += emitBlock(block);
+
+  /* the dispatcher follows blocks as long as their gate is open */
+  code += "static u32 run(Context* c)\n{\n  u32 pc = c->regs->PC;\n\n  while (c->gates[pc])\n  {\n    u32 next;\n\n    switch (pc)\n    {\n";
+  for (const Block& block : blocks)
+    code += fmt::format("      case 0x{0:04X}: next = block_{0:04X}(c); break;\n", block.start);
+  code += "      default: c->regs->PC = pc; return EXIT_LOOKUP;\n    }\n\n";
+  code += "    if (next == BLOCK_BUDGET)\n    {\n      c->regs->PC = pc;\n      return EXIT_BUDGET;\n    }\n    else if (next == BLOCK_LEAVE)\n      return EXIT_LEAVE;\n\n";
+  code += "    pc = next;\n\n    if (c->exit)\n    {\n      c->regs->PC = pc;\n      return EXIT_LEAVE;\n    }\n  }\n\n  c->regs->PC = pc;\n  return EXIT_LOOKUP;\n}\n\n";
+
+  code += "static const u8 code[] = {";
+  for (u32 address = origin; address < end; ++address)
+    code += fmt::format("{}0x{:02X},", (address - origin) % 16 ? " " : "\n  ", vm.memory[address]);
+  code += "\n  0x00\n};\n\n";
+
+  code += "static const Block blocks[] = {";
+  for (const Block& block : blocks)
+    code += fmt::format("\n  {{ 0x{:04X}, {}, {} }},", block.start, block.end - block.start, block.instructions.size());
+  code += "\n  { 0, 0, 0 }\n};\n\n";
+
+  code += fmt::format("static const Module module = {{ {}, 0x{:04X}, {}, code, {}, blocks, run }};\n\n", Aot::ABI_VERSION, origin, end - origin, blocks.size());
+  code += "J80_AOT_EXPORT const Module* j80_aot_module() { return &module; }\n";
+
+  return code;
+}
+
+Aot::Aot(VM& vm) : vm(vm), library(nullptr), enter(nullptr)
+{
+  context.regs = &vm.regs;
+  context.memory = vm.memory;
+  context.readMapped = vm.bus.readPages();
+  context.gates = nullptr;
+  context.stackTop = &vm.stackTop;
+  context.stackBottom = &vm.stackBottom;
+  context.vm = &vm;
+  context.read = &Aot::read;
+  context.write = &Aot::write;
+  context.execute = &Aot::execute;
+  context.budget = 0;
+  context.exit = 0;
+}
+
+Result Aot::load(const std::string& path)
+{
+  unload();
+
+#if _WIN32
+  HMODULE handle = LoadLibraryA(path.c_str());
+
+  if (!handle)
+    return Result(fmt::format("unable to load {}", path));
+
+  auto describe = reinterpret_cast<const AotModule* (*)()>(GetProcAddress(handle, "j80_aot_module"));
+  auto release = [handle] { FreeLibrary(handle); };
+#else
+  void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+
+  if (!handle)
+    return Result(dlerror());
+
+  auto describe = reinterpret_cast<const AotModule* (*)()>(dlsym(handle, "j80_aot_module"));
+  auto release = [handle] { dlclose(handle); };
+#endif
+
+  if (!describe)
+  {
+    release();
+    return Result(fmt::format("{} is not a translated J80 module", path));
+  }
+
+  const AotModule* module = describe();
+
+  if (module->abi != ABI_VERSION)
+  {
+    release();
+    return Result(fmt::format("{} was translated for version {} of the interface, expected {}", path, module->abi, ABI_VERSION));
+  }
+
+  for (u32 b = 0; b < module->blockCount; ++b)
+  {
+    const AotBlock& range = module->blocks[b];
+
+    if (range.length == 0 || range.start < module->origin || range.start + range.length > module->origin + module->length)
+    {
+      release();
+      return Result(fmt::format("{} has a block outside of its code", path));
+    }
+  }
+
+  library = reinterpret_cast<void*>(handle);
+  enter = module->run;
+
+  starts.reset(new u32[VM::MEMORY_SIZE]());
+  gates.reset(new u8[VM::MEMORY_SIZE]());
+  coverage.assign(VM::MEMORY_SIZE, false);
+  context.gates = gates.get();
+
+  /* blocks open once RAM has been checked against them */
+  for (u32 b = 0; b < module->blockCount; ++b)
+  {
+    const AotBlock& range = module->blocks[b];
+    blocks.push_back({ range, module->code + (range.start - module->origin), true });
+    starts[range.start] = b + 1;
+
+    std::fill(coverage.begin() + range.start, coverage.begin() + range.start + range.length, true);
+
+    for (u32 page = range.start / DecodeCache::PAGE_SIZE; page <= (range.start + range.length - 1u) / DecodeCache::PAGE_SIZE; ++page)
+      pageBlocks[page].push_back(b);
+  }
+
+  return Result();
+}
+
+void Aot::unload()
+{
+  if (!library)
+    return;
+
+#if _WIN32
+  FreeLibrary(reinterpret_cast<HMODULE>(library));
+#else
+  dlclose(library);
+#endif
+
+  library = nullptr;
+  enter = nullptr;
+  blocks.clear();
+  starts.reset();
+  gates.reset();
+  coverage.clear();
+  context.gates = nullptr;
+
+  for (auto& list : pageBlocks)
+    list.clear();
+}
+
+/* a stale block is compared with RAM, it stays closed while it differs or while a
+   breakpoint is inside it */
+void Aot::updateGate(Block& block)
+{
+  const u32 start = block.range.start, end = start + block.range.length;
+
+  if (block.stale)
+    block.stale = memcmp(vm.memory + start, block.code, block.range.length) != 0;
+
+  bool open = !block.stale;
+
+  for (u32 address = start; open && address < end; ++address)
+    open = !vm.isBreakpoint(address);
+
+  gates[start] = open;
+}
+
+void Aot::staleBlocks(u16 address)
+{
+  for (u32 b : pageBlocks[address / DecodeCache::PAGE_SIZE])
+  {
+    Block& block = blocks[b];
+
+    if (address >= block.range.start && address < block.range.start + block.range.length)
+    {
+      block.stale = true;
+      gates[block.range.start] = 0;
+    }
+  }
+}
+
+void Aot::invalidate(u16 address)
+{
+  staleBlocks(address);
+  context.exit = 1;
+}
+
+void Aot::invalidatePage(u32 page)
+{
+  for (u32 b : pageBlocks[page])
+  {
+    blocks[b].stale = true;
+    gates[blocks[b].range.start] = 0;
+  }
+
+  /* the page can be replaced by a device write from the running block */
+  if (!pageBlocks[page].empty())
+    context.exit = 1;
+}
+
+void Aot::invalidateAll()
+{
+  for (Block& block : blocks)
+  {
+    block.stale = true;
+    gates[block.range.start] = 0;
+  }
+}
+
+void Aot::breakpointChanged(u16 address)
+{
+  /* stale blocks are looked at once reached anyway */
+  for (u32 b : pageBlocks[address / DecodeCache::PAGE_SIZE])
+  {
+    Block& block = blocks[b];
+
+    if (!block.stale && address >= block.range.start && address < block.range.start + block.range.length)
+      updateGate(block);
+  }
+}
+
+void Aot::breakpointsCleared()
+{
+  for (Block& block : blocks)
+    if (!block.stale)
+      gates[block.range.start] = 1;
+}
+
+u8 Aot::read(VM* vm, u16 address)
+{
+  return vm->ramRead(address);
+}
+
+void Aot::write(VM* vm, u16 address, u8 value)
+{
+  vm->ramWrite(address, value);
+}
+
+void Aot::execute(VM* vm)
+{
+  vm->executeInstruction();
+}
+
+u64 Aot::run(u64 budget)
+{
+  u64 executed = 0;
+
+  while (executed < budget && !vm.stopRequested.load(std::memory_order_relaxed))
+  {
+    u64 slice = std::min(budget - executed, VM::STOP_CHECK_INTERVAL);
+    context.budget = slice;
+
+    while (context.budget > 0)
+    {
+      const u16 pc = vm.regs.PC;
+      Block* block = starts[pc] ? &blocks[starts[pc] - 1] : nullptr;
+
+      if (block && block->stale)
+        updateGate(*block);
+
+      /* blocks run entirely so the tail of the budget is left to the interpreter */
+      if (block && gates[pc] && block->range.count <= context.budget)
+      {
+        vm.materializeFlags();
+        context.exit = 0;
+        enter(&context);
+      }
+      else
+      {
+        const DecodedInstruction& i = vm.decoded(pc);
+
+        if (i.handler == Handler::BREAK && vm.shouldBreak(i))
+        {
+          vm.stopRequested.store(false, std::memory_order_relaxed);
+          return executed + slice - context.budget;
+        }
+
+        (vm.*VM::handlers[static_cast<size_t>(i.handler)])(i);
+        --context.budget;
+      }
+
+      /* the VM wants to look at its event queue */
+      if (vm.eventCheck)
+      {
+        vm.stopRequested.store(false, std::memory_order_relaxed);
+        return executed + slice - context.budget;
+      }
+    }
+
+    executed += slice;
+  }
+
+  vm.stopRequested.store(false, std::memory_order_relaxed);
+  return executed;
+}
@@ -0,0 +1,160 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include "../vm.h"
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace vm
+{
+  /* state shared between the VM and a translated module, the translator writes the
+     same layout in the generated prelude so both must change together along with
+     Aot::ABI_VERSION, registers are the VM ones with their flags always computed */
+  struct AotContext
+  {
+    Regs* regs;
+    u8* memory;
+    /* per bus page, reads of set pages go through read */
+    const bool* readMapped;
+    /* per address, blocks only run while their entry is set */
+    const u8* gates;
+    u16* stackTop;
+    u16* stackBottom;
+    VM* vm;
+    u8 (*read)(VM* vm, u16 address);
+    void (*write)(VM* vm, u16 address, u8 value);
+    /* runs the instruction at regs->PC through the interpreter */
+    void (*execute)(VM* vm);
+    u64 budget;
+    u8 exit;
+  };
+
+  /* guest code range of a translated block as exported by a module */
+  struct AotBlock
+  {
+    u16 start;
+    u16 length;
+    u32 count;
+  };
+
+  /* recovers the control flow graph of an assembled code segment from its entry points
+     (reset, interrupt vectors, labels) and emits a C++ translation unit with a host
+     function per guest basic block, build it as a shared object and hand it to
+     VM::loadNative, e.g. c++ -O2 -shared -fPIC program.cpp -o program.so
+
+     blocks end at branches, at the start of another block and after
+     MAX_BLOCK_INSTRUCTIONS, the generated dispatcher follows their successors until
+     a computed target (JMP PP, RET) isn't a block or the budget runs out */
+  class AotTranslator
+  {
+  public:
+    static constexpr u32 MAX_BLOCK_INSTRUCTIONS = 32;
+
+  private:
+    struct Block
+    {
+      u16 start;
+      u32 end;
+      std::vector<u16> instructions;
+    };
+
+    VM vm;
+    u32 origin;
+    u32 end;
+    std::vector<u16> entries;
+    std::vector<Block> blocks;
+
+    bool inside(u32 address, u32 length = 1) const { return address >= origin && address + length <= end; }
+    static bool isBranch(Handler handler) { return handler == Handler::JMP_NNNN || handler == Handler::JMP_PP || handler == Handler::CALL || handler == Handler::RET; }
+
+    std::vector<bool> findLeaders();
+    void buildBlocks(std::vector<bool>& leaders);
+
+    std::string reg8(Reg reg) const;
+    std::string reg16(Reg reg) const;
+    std::string condition(JumpCondition cond) const;
+    std::string statement(const DecodedInstruction& i, u16 address) const;
+    std::string emitBlock(const Block& block);
+
+  public:
+    AotTranslator(const u8* code, u32 length, u16 origin = 0);
+
+    /* addresses execution can start from, anything reachable from them is translated */
+    void addEntry(u16 address) { entries.push_back(address); }
+
+    std::string translate();
+    size_t blockCount() const { return blocks.size(); }
+  };
+
+  /* runs a module loaded from a shared object, a block only runs while RAM holds the
+     bytes it was translated from and no breakpoint is inside it, anything else goes
+     through the interpreter an instruction at a time, stores to translated code
+     leave the block and the modified blocks are checked again before running */
+  class Aot
+  {
+  public:
+    static constexpr u32 ABI_VERSION = 1;
+
+    enum Exit : u32
+    {
+      EXIT_BUDGET = 0,
+      EXIT_LOOKUP,
+      EXIT_LEAVE
+    };
+
+  private:
+    using run_t = u32 (*)(AotContext* context);
+
+    struct Block
+    {
+      AotBlock range;
+      const u8* code;
+      bool stale;
+    };
+
+    VM& vm;
+    AotContext context;
+
+    void* library;
+    run_t enter;
+
+    std::vector<Block> blocks;
+    /* index + 1 of the block starting at each address */
+    std::unique_ptr<u32[]> starts;
+    std::unique_ptr<u8[]> gates;
+    std::vector<bool> coverage;
+    std::array<std::vector<u32>, DecodeCache::PAGE_COUNT> pageBlocks;
+
+    void updateGate(Block& block);
+    void staleBlocks(u16 address);
+
+    static u8 read(VM* vm, u16 address);
+    static void write(VM* vm, u16 address, u8 value);
+    static void execute(VM* vm);
+
+  public:
+    Aot(VM& vm);
+    ~Aot() { unload(); }
+
+    Result load(const std::string& path);
+    void unload();
+    bool isLoaded() const { return library != nullptr; }
+
+    bool covers(u16 address) const { return !coverage.empty() && coverage[address]; }
+    void invalidate(u16 address);
+    void invalidatePage(u32 page);
+    void invalidateAll();
+    /* a breakpoint was set or cleared at address */
+    void breakpointChanged(u16 address);
+    void breakpointsCleared();
+    /* makes the running block leave after its next store or EI */
+    void requestExit() { context.exit = 1; }
+
+    u64 run(u64 budget);
+  };
+}
+
+#endif
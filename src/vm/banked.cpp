@@ -0,0 +1,85 @@
+#include "banked.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+using namespace vm;
+
+constexpr u16 BankedRam::WINDOW_BASE;
+constexpr u32 BankedRam::WINDOW_SIZE;
+constexpr u16 BankedRam::PORT;
+constexpr u32 BankedRam::MAX_BANKS;
+
+BankedRam::BankedRam(VM& vm, u32 banks) : vm(vm), banks(std::min(std::max(banks, 1u), MAX_BANKS)), current(0)
+{
+  anonymous = allocatePages(size_t(this->banks) * WINDOW_SIZE);
+
+  if (!anonymous)
+    throw std::bad_alloc();
+
+  storage = anonymous;
+}
+
+BankedRam::~BankedRam()
+{
+  if (file.isOpen())
+    sync();
+
+  file.close();
+  releasePages(anonymous, size_t(banks) * WINDOW_SIZE);
+}
+
+bool BankedRam::open(const std::string& path)
+{
+  if (!file.open(path, size_t(banks) * WINDOW_SIZE))
+    return false;
+
+  storage = file.bytes();
+  discardPages(anonymous, size_t(banks) * WINDOW_SIZE);
+  vm.copyToRam(bank(current), WINDOW_SIZE, WINDOW_BASE);
+  return true;
+}
+
+void BankedRam::select(u8 index)
+{
+  index %= banks;
+
+  if (index == current)
+    return;
+
+  sync();
+  current = index;
+  vm.copyToRam(bank(current), WINDOW_SIZE, WINDOW_BASE);
+}
+
+void BankedRam::load(u8 index, u16 offset, const u8* data, size_t length)
+{
+  index %= banks;
+
+  if (offset >= WINDOW_SIZE)
+    return;
+
+  length = std::min<size_t>(length, WINDOW_SIZE - offset);
+
+  if (index == current)
+    vm.copyToRam(data, length, WINDOW_BASE + offset);
+  else
+    memcpy(bank(index) + offset, data, length);
+}
+
+void BankedRam::clear()
+{
+  if (file.isOpen())
+    memset(storage, 0, size_t(banks) * WINDOW_SIZE);
+  else
+    discardPages(storage, size_t(banks) * WINDOW_SIZE);
+
+  current = 0;
+  vm.copyToRam(bank(current), WINDOW_SIZE, WINDOW_BASE);
+}
+
+void BankedRam::sync()
+{
+  memcpy(bank(current), vm.ram() + WINDOW_BASE, WINDOW_SIZE);
+}
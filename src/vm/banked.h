@@ -0,0 +1,60 @@
+#ifndef __BANKED_H__
+#define __BANKED_H__
+
+#include "../vm.h"
+#include "memory.h"
+
+#include <string>
+
+namespace vm
+{
+  /* extended RAM seen through a window of the address space, the window is plain RAM
+     holding the selected bank so every engine reads, writes and runs it at full speed,
+     selecting another bank stores the window back into its bank and copies the new
+     one in, banks live in anonymous pages until a file is opened for them, it must be
+     mapped on a single port
+
+       +0  selected bank, values past the last bank wrap around */
+  class BankedRam : public Device
+  {
+  public:
+    static constexpr u16 WINDOW_BASE = 0x8000;
+    static constexpr u32 WINDOW_SIZE = 0x4000;
+    static constexpr u16 PORT = 0xFFF4;
+    static constexpr u32 MAX_BANKS = 256;
+
+  private:
+    VM& vm;
+    FileMapping file;
+    u8* anonymous;
+    u8* storage;
+    u32 banks;
+    u8 current;
+
+    u8* bank(u8 index) const { return storage + size_t(index) * WINDOW_SIZE; }
+
+  public:
+    BankedRam(VM& vm, u32 banks = MAX_BANKS);
+    ~BankedRam();
+
+    /* moves the banks into the file, created or grown to hold all of them, whatever
+       the file already contains becomes the content of the banks */
+    bool open(const std::string& path);
+
+    u32 count() const { return banks; }
+    u8 selected() const { return current; }
+
+    void select(u8 index);
+    /* bytes past the end of the bank are dropped */
+    void load(u8 index, u16 offset, const u8* data, size_t length);
+    /* every bank back to zero and bank 0 selected */
+    void clear();
+    /* stores the window back into the selected bank */
+    void sync();
+
+    u8 read(u16) override { return current; }
+    void write(u16, u8 value) override { select(value); }
+  };
+}
+
+#endif
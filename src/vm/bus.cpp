@@ -0,0 +1,144 @@
+#include "bus.h"
+
+#include <algorithm>
+
+using namespace vm;
+
+constexpr u32 MemoryBus::PAGE_SIZE;
+constexpr u32 MemoryBus::PAGE_COUNT;
+
+void MemoryBus::map(Device* device, u16 start, u32 length, Access access)
+{
+  if (length == 0)
+    return;
+
+  u32 end = std::min<u32>(start + length, 0x10000);
+  mappings.push_back({ start, end, device, access });
+  rebuildPages();
+}
+
+void MemoryBus::unmap(Device* device)
+{
+  mappings.erase(std::remove_if(mappings.begin(), mappings.end(), [device] (const Mapping& mapping) { return mapping.device == device; }), mappings.end());
+  rebuildPages();
+}
+
+void MemoryBus::watch(u16 start, u32 length, Access access)
+{
+  if (length == 0)
+    return;
+
+  u32 end = std::min<u32>(start + length, 0x10000);
+  watches.push_back({ start, end, access });
+  rebuildPages();
+}
+
+void MemoryBus::unwatch(u16 start, u32 length)
+{
+  u32 end = std::min<u32>(start + length, 0x10000);
+  watches.erase(std::remove_if(watches.begin(), watches.end(), [start, end] (const Watch& watch) { return watch.start == start && watch.end == end; }), watches.end());
+  rebuildPages();
+}
+
+void MemoryBus::clearWatches()
+{
+  watches.clear();
+  rebuildPages();
+}
+
+/* watched pages take the same slow path as pages with devices */
+void MemoryBus::rebuildPages()
+{
+  readMapped.fill(false);
+  writeMapped.fill(false);
+
+  auto mark = [this] (u32 start, u32 end, Access access) {
+    for (u32 page = start / PAGE_SIZE; page <= (end - 1) / PAGE_SIZE; ++page)
+    {
+      if (access & READ)
+        readMapped[page] = true;
+      if (access & WRITE)
+        writeMapped[page] = true;
+    }
+  };
+
+  for (const Mapping& mapping : mappings)
+    mark(mapping.start, mapping.end, mapping.access);
+
+  for (const Watch& watch : watches)
+    mark(watch.start, watch.end, watch.access);
+}
+
+void MemoryBus::notify(u16 address, u8 value, Access access) const
+{
+  for (const Watch& watch : watches)
+  {
+    if ((watch.access & access) && address >= watch.start && address < watch.end)
+    {
+      if (watcher)
+        watcher->watched(address, value, access == WRITE);
+      return;
+    }
+  }
+}
+
+bool MemoryBus::hasReadMappings() const
+{
+  return std::find(readMapped.begin(), readMapped.end(), true) != readMapped.end();
+}
+
+bool MemoryBus::isRam(u16 start, u32 length, Access access) const
+{
+  if (length == 0)
+    return true;
+
+  if (start + length > 0x10000)
+    return false;
+
+  for (u32 page = start / PAGE_SIZE; page <= (start + length - 1) / PAGE_SIZE; ++page)
+  {
+    if (((access & READ) && readMapped[page]) || ((access & WRITE) && writeMapped[page]))
+      return false;
+  }
+
+  return true;
+}
+
+/* pages are shared between devices and RAM, addresses outside of every mapping fall
+   through to RAM, the most recently mapped device wins on overlaps */
+u8 MemoryBus::readDevice(u16 address) const
+{
+  u8 value = ram[address];
+
+  for (auto it = mappings.rbegin(); it != mappings.rend(); ++it)
+  {
+    if ((it->access & READ) && address >= it->start && address < it->end)
+    {
+      value = interceptor ? interceptor->read(it->device, address) : it->device->read(address);
+      break;
+    }
+  }
+
+  if (!watches.empty())
+    notify(address, value, READ);
+
+  return value;
+}
+
+bool MemoryBus::writeDevice(u16 address, u8 value)
+{
+  if (!watches.empty())
+    notify(address, value, WRITE);
+
+  for (auto it = mappings.rbegin(); it != mappings.rend(); ++it)
+  {
+    if ((it->access & WRITE) && address >= it->start && address < it->end)
+    {
+      it->device->write(address, value);
+      return false;
+    }
+  }
+
+  ram[address] = value;
+  return true;
+}
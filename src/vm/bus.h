@@ -0,0 +1,125 @@
+#ifndef __BUS_H__
+#define __BUS_H__
+
+#include "../utils.h"
+
+#include <array>
+#include <vector>
+
+namespace vm
+{
+  /* memory mapped device, it only sees accesses to the ranges it has been mapped to */
+  class Device
+  {
+  public:
+    virtual ~Device() { }
+
+    virtual u8 read(u16) { return 0xFF; }
+    virtual void write(u16, u8) { }
+  };
+
+  /* sits between the bus and devices for every device read, used to record the
+     values devices return and to feed them back when replaying */
+  class ReadInterceptor
+  {
+  public:
+    virtual ~ReadInterceptor() { }
+    virtual u8 read(Device* device, u16 address) = 0;
+  };
+
+  /* told about every access to a watched byte, reads once the value is known and
+     writes before they reach RAM or a device */
+  class Watcher
+  {
+  public:
+    virtual ~Watcher() { }
+    virtual void watched(u16 address, u8 value, bool write) = 0;
+  };
+
+  /* routes loads and stores either to RAM or to devices, a table with an entry per
+     256 bytes page tells whether any device or watchpoint is inside the page so plain
+     RAM accesses only pay for a single lookup */
+  class MemoryBus
+  {
+  public:
+    enum Access : u8
+    {
+      READ = 0x01,
+      WRITE = 0x02,
+      READ_WRITE = READ | WRITE
+    };
+
+    static constexpr u32 PAGE_SIZE = 256;
+    static constexpr u32 PAGE_COUNT = 0x10000 / PAGE_SIZE;
+
+  private:
+    struct Mapping
+    {
+      u32 start;
+      u32 end;
+      Device* device;
+      Access access;
+    };
+
+    struct Watch
+    {
+      u32 start;
+      u32 end;
+      Access access;
+    };
+
+    u8* ram;
+    std::vector<Mapping> mappings;
+    std::vector<Watch> watches;
+    Watcher* watcher;
+    std::array<bool, PAGE_COUNT> readMapped;
+    std::array<bool, PAGE_COUNT> writeMapped;
+    ReadInterceptor* interceptor;
+
+    void rebuildPages();
+    void notify(u16 address, u8 value, Access access) const;
+    u8 readDevice(u16 address) const;
+    bool writeDevice(u16 address, u8 value);
+
+  public:
+    MemoryBus() : ram(nullptr), watcher(nullptr), interceptor(nullptr) { readMapped.fill(false); writeMapped.fill(false); }
+
+    void setRam(u8* ram) { this->ram = ram; }
+    void setReadInterceptor(ReadInterceptor* interceptor) { this->interceptor = interceptor; }
+
+    void map(Device* device, u16 start, u32 length, Access access = READ_WRITE);
+    void unmap(Device* device);
+
+    void setWatcher(Watcher* watcher) { this->watcher = watcher; }
+    void watch(u16 start, u32 length, Access access);
+    void unwatch(u16 start, u32 length);
+    void clearWatches();
+    bool hasWatches() const { return !watches.empty(); }
+
+    bool isReadMapped(u16 address) const { return readMapped[address / PAGE_SIZE]; }
+    bool isWriteMapped(u16 address) const { return writeMapped[address / PAGE_SIZE]; }
+    bool hasReadMappings() const;
+    /* true when every byte of the range is plain RAM for the access, a range wrapping
+       around at 64K never is so that callers can handle it as a single span */
+    bool isRam(u16 start, u32 length, Access access) const;
+    /* an entry per page, read directly by translated code */
+    const bool* readPages() const { return readMapped.data(); }
+
+    u8 read(u16 address) const
+    {
+      return readMapped[address / PAGE_SIZE] ? readDevice(address) : ram[address];
+    }
+
+    /* returns true if the value reached RAM */
+    bool write(u16 address, u8 value)
+    {
+      if (writeMapped[address / PAGE_SIZE])
+        return writeDevice(address, value);
+
+      ram[address] = value;
+      return true;
+    }
+  };
+}
+
+#endif
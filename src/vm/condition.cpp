@@ -0,0 +1,292 @@
+#include "condition.h"
+
+#include "../vm.h"
+#include "../opcodes.h"
+#include "../support/format/format.h"
+
+#include <cctype>
+
+using namespace vm;
+
+constexpr u32 Condition::MAX_STACK;
+
+namespace vm
+{
+  /* recursive descent over the source emitting postfix steps, binary operators are
+     parsed by precedence climbing */
+  class ConditionParser
+  {
+  private:
+    struct Binary
+    {
+      const char* token;
+      Condition::Op op;
+      u32 precedence;
+    };
+
+    const std::string& source;
+    std::vector<Condition::Step>& code;
+    size_t position;
+    std::string error;
+
+    void skipSpaces()
+    {
+      while (position < source.size() && isspace(static_cast<unsigned char>(source[position])))
+        ++position;
+    }
+
+    bool accept(const char* token)
+    {
+      skipSpaces();
+      size_t length = strlen(token);
+
+      if (source.compare(position, length, token) != 0)
+        return false;
+
+      position += length;
+      return true;
+    }
+
+    void fail(const std::string& message)
+    {
+      if (error.empty())
+        error = fmt::format("{} at column {}", message, position + 1);
+    }
+
+    void emit(Condition::Op op, u8 reg = 0, u32 value = 0) { code.push_back({ op, reg, value }); }
+
+    const Binary* binary()
+    {
+      /* longer tokens first so that << isn't taken for < */
+      static const Binary binaries[] = {
+        { "||", Condition::Op::LOGICAL_OR, 1 },
+        { "&&", Condition::Op::LOGICAL_AND, 2 },
+        { "==", Condition::Op::EQ, 6 },
+        { "!=", Condition::Op::NE, 6 },
+        { "<=", Condition::Op::LE, 7 },
+        { ">=", Condition::Op::GE, 7 },
+        { "<<", Condition::Op::SHL, 8 },
+        { ">>", Condition::Op::SHR, 8 },
+        { "|", Condition::Op::OR, 3 },
+        { "^", Condition::Op::XOR, 4 },
+        { "&", Condition::Op::AND, 5 },
+        { "<", Condition::Op::LT, 7 },
+        { ">", Condition::Op::GT, 7 },
+        { "+", Condition::Op::ADD, 9 },
+        { "-", Condition::Op::SUB, 9 }
+      };
+
+      skipSpaces();
+
+      for (const Binary& candidate : binaries)
+        if (source.compare(position, strlen(candidate.token), candidate.token) == 0)
+          return &candidate;
+
+      return nullptr;
+    }
+
+    void expression(u32 minimum)
+    {
+      unary();
+
+      for (const Binary* op = binary(); op && op->precedence >= minimum && error.empty(); op = binary())
+      {
+        position += strlen(op->token);
+        expression(op->precedence + 1);
+        emit(op->op);
+      }
+    }
+
+    void unary()
+    {
+      if (accept("-"))
+      {
+        unary();
+        emit(Condition::Op::NEG);
+      }
+      else if (accept("!"))
+      {
+        unary();
+        emit(Condition::Op::NOT);
+      }
+      else if (accept("~"))
+      {
+        unary();
+        emit(Condition::Op::COMPLEMENT);
+      }
+      else
+        primary();
+    }
+
+    void primary()
+    {
+      skipSpaces();
+
+      if (accept("("))
+      {
+        expression(1);
+        if (!accept(")"))
+          fail("expected )");
+      }
+      else if (accept("["))
+      {
+        expression(1);
+        emit(Condition::Op::LOAD);
+        if (!accept("]"))
+          fail("expected ]");
+      }
+      else if (position < source.size() && isalnum(static_cast<unsigned char>(source[position])))
+      {
+        size_t start = position;
+        while (position < source.size() && isalnum(static_cast<unsigned char>(source[position])))
+          ++position;
+
+        operand(source.substr(start, position - start));
+      }
+      else
+        fail("expected an operand");
+    }
+
+    void operand(std::string word)
+    {
+      for (char& c : word)
+        c = toupper(static_cast<unsigned char>(c));
+
+      for (u8 r = 0; r < 8; ++r)
+      {
+        if (word == Opcodes::reg8(static_cast<Reg>(r)))
+          return emit(Condition::Op::REG8, r);
+        else if (word == Opcodes::reg16(static_cast<Reg>(r)))
+          return emit(Condition::Op::REG16, r);
+      }
+
+      if (word == "PC")
+        return emit(Condition::Op::PC);
+      else if (word == "FLAGS")
+        return emit(Condition::Op::FLAGS);
+
+      /* same number syntax as the assembler: decimal, 0x prefixed or h suffixed hex,
+         register names take precedence so 0Ah must be used instead of Ah */
+      int base = 10;
+      std::string digits = word;
+
+      if (digits.size() > 2 && digits[0] == '0' && digits[1] == 'X')
+      {
+        base = 16;
+        digits = digits.substr(2);
+      }
+      else if (digits.size() > 1 && digits.back() == 'H')
+      {
+        base = 16;
+        digits.pop_back();
+      }
+
+      char* end = nullptr;
+      unsigned long value = strtoul(digits.c_str(), &end, base);
+
+      if (digits.empty() || *end != '\0' || value > 0xFFFF)
+        fail(fmt::format("unknown operand '{}'", word));
+      else
+        emit(Condition::Op::CONST, 0, static_cast<u32>(value));
+    }
+
+  public:
+    ConditionParser(const std::string& source, std::vector<Condition::Step>& code) : source(source), code(code), position(0) { }
+
+    Result parse()
+    {
+      expression(1);
+      skipSpaces();
+
+      if (error.empty() && position < source.size())
+        fail("unexpected input");
+
+      /* each operand pushes a value, binary operators pop one */
+      u32 depth = 0;
+      for (const auto& step : code)
+      {
+        if (step.op <= Condition::Op::LOAD)
+          depth += step.op == Condition::Op::LOAD ? 0 : 1;
+        else if (step.op > Condition::Op::COMPLEMENT)
+          --depth;
+
+        if (depth > Condition::MAX_STACK)
+          fail("expression is too deep");
+      }
+
+      return error.empty() ? Result() : Result(error);
+    }
+  };
+}
+
+Result Condition::compile(const std::string& source)
+{
+  text = source;
+  code.clear();
+
+  size_t first = source.find_first_not_of(" \t");
+
+  if (first == std::string::npos)
+    return Result();
+
+  Result result = ConditionParser(source, code).parse();
+
+  if (!result)
+  {
+    text.clear();
+    code.clear();
+  }
+
+  return result;
+}
+
+bool Condition::evaluate(const Regs& regs, const u8* memory) const
+{
+  u32 stack[MAX_STACK];
+  u32 top = 0;
+
+  for (const Step& step : code)
+  {
+    switch (step.op)
+    {
+      case Op::CONST: stack[top++] = step.value; break;
+      case Op::REG8: stack[top++] = regs.reg8(static_cast<Reg>(step.reg)); break;
+      case Op::REG16: stack[top++] = regs.reg16(static_cast<Reg>(step.reg)); break;
+      case Op::PC: stack[top++] = regs.PC; break;
+      case Op::FLAGS: stack[top++] = regs.FLAGS; break;
+      case Op::LOAD: stack[top - 1] = memory[u16(stack[top - 1])]; break;
+
+      case Op::NEG: stack[top - 1] = -stack[top - 1]; break;
+      case Op::NOT: stack[top - 1] = !stack[top - 1]; break;
+      case Op::COMPLEMENT: stack[top - 1] = ~stack[top - 1]; break;
+
+      default:
+      {
+        u32 b = stack[--top];
+        u32& a = stack[top - 1];
+
+        switch (step.op)
+        {
+          case Op::ADD: a += b; break;
+          case Op::SUB: a -= b; break;
+          case Op::SHL: a = b < 32 ? a << b : 0; break;
+          case Op::SHR: a = b < 32 ? a >> b : 0; break;
+          case Op::LT: a = a < b; break;
+          case Op::LE: a = a <= b; break;
+          case Op::GT: a = a > b; break;
+          case Op::GE: a = a >= b; break;
+          case Op::EQ: a = a == b; break;
+          case Op::NE: a = a != b; break;
+          case Op::AND: a &= b; break;
+          case Op::XOR: a ^= b; break;
+          case Op::OR: a |= b; break;
+          case Op::LOGICAL_AND: a = a && b; break;
+          case Op::LOGICAL_OR: a = a || b; break;
+          default: break;
+        }
+      }
+    }
+  }
+
+  return code.empty() || stack[0] != 0;
+}
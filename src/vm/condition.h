@@ -0,0 +1,80 @@
+#ifndef __CONDITION_H__
+#define __CONDITION_H__
+
+#include "../utils.h"
+
+#include <string>
+#include <vector>
+
+struct Regs;
+
+namespace vm
+{
+  /* expression over registers and memory compiled once into postfix code for a small
+     stack machine, operators and precedence follow C, e.g.
+
+       A == 10 && [IX + 2] != 0FFh || (FLAGS & 2)
+
+     operands are numbers (decimal, 0x or h suffixed hex), register names, PC, FLAGS
+     and [address] which reads a byte of RAM directly so evaluating never reaches
+     devices or watchpoints, every value is computed on 32 bits */
+  class Condition
+  {
+  public:
+    static constexpr u32 MAX_STACK = 32;
+
+  private:
+    enum class Op : u8
+    {
+      CONST,
+      REG8,
+      REG16,
+      PC,
+      FLAGS,
+      LOAD,
+
+      NEG,
+      NOT,
+      COMPLEMENT,
+
+      ADD,
+      SUB,
+      SHL,
+      SHR,
+      LT,
+      LE,
+      GT,
+      GE,
+      EQ,
+      NE,
+      AND,
+      XOR,
+      OR,
+      LOGICAL_AND,
+      LOGICAL_OR
+    };
+
+    struct Step
+    {
+      Op op;
+      u8 reg;
+      u32 value;
+    };
+
+    std::string text;
+    std::vector<Step> code;
+
+    friend class ConditionParser;
+
+  public:
+    /* replaces the compiled code, an empty source compiles to an always true condition */
+    Result compile(const std::string& source);
+
+    bool isAlways() const { return code.empty(); }
+    const std::string& source() const { return text; }
+
+    bool evaluate(const Regs& regs, const u8* memory) const;
+  };
+}
+
+#endif
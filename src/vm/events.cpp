@@ -0,0 +1,36 @@
+#include "events.h"
+
+#include <algorithm>
+
+using namespace vm;
+
+constexpr u64 EventQueue::NEVER;
+
+void EventQueue::schedule(u64 deadline, EventHandler* handler)
+{
+  heap.push_back({ deadline, sequence++, handler });
+  std::push_heap(heap.begin(), heap.end());
+}
+
+void EventQueue::cancel(EventHandler* handler)
+{
+  auto end = std::remove_if(heap.begin(), heap.end(), [handler](const Event& event) { return event.handler == handler; });
+
+  if (end != heap.end())
+  {
+    heap.erase(end, heap.end());
+    std::make_heap(heap.begin(), heap.end());
+  }
+}
+
+void EventQueue::runDue(u64 now)
+{
+  while (!heap.empty() && heap.front().deadline <= now)
+  {
+    std::pop_heap(heap.begin(), heap.end());
+    Event event = heap.back();
+    heap.pop_back();
+
+    event.handler->fire(event.deadline);
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef __EVENTS_H__
+#define __EVENTS_H__
+
+#include "../utils.h"
+
+#include <limits>
+#include <vector>
+
+namespace vm
+{
+  /* something which asked to be called back once the VM clock reaches a deadline */
+  class EventHandler
+  {
+  public:
+    virtual ~EventHandler() { }
+
+    /* deadline is the one the event was scheduled for, the clock can be slightly past it */
+    virtual void fire(u64 deadline) = 0;
+  };
+
+  /* pending events as a binary min-heap on their deadline, events with the same
+     deadline fire in the order they were scheduled */
+  class EventQueue
+  {
+  public:
+    static constexpr u64 NEVER = std::numeric_limits<u64>::max();
+
+  private:
+    struct Event
+    {
+      u64 deadline;
+      u64 sequence;
+      EventHandler* handler;
+
+      /* inverted so that the std heap functions keep the earliest event on top */
+      bool operator<(const Event& other) const { return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence; }
+    };
+
+    std::vector<Event> heap;
+    u64 sequence;
+
+  public:
+    EventQueue() : sequence(0) { }
+
+    void schedule(u64 deadline, EventHandler* handler);
+    /* drops every pending event of the handler */
+    void cancel(EventHandler* handler);
+    void clear() { heap.clear(); }
+
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    u64 nextDeadline() const { return heap.empty() ? NEVER : heap.front().deadline; }
+
+    /* fires in order every event whose deadline is not after now, handlers may schedule
+       new events, which fire in the same call if they are due too */
+    void runDue(u64 now);
+  };
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include "farm.h"
+#include "banked.h"
+
+#include <algorithm>
+#include <thread>
+
+using namespace vm;
+
+/* output of the job currently running on a worker */
+class CollectStdOut : public StdOut
+{
+public:
+  std::vector<u8>* target = nullptr;
+
+  void out(u8 value) override { target->push_back(value); }
+};
+
+class VMFarm::Worker
+{
+public:
+  VM vm;
+  CollectStdOut sout;
+  BankedRam banked;
+
+  Worker(VM::Engine engine) : banked(vm)
+  {
+    vm.setEngine(engine);
+    vm.setStdOut(&sout);
+  }
+
+  void execute(const Job& job, JobResult& result)
+  {
+    vm.reset();
+    vm.clearRam();
+    vm.unmapDevice(&banked);
+
+    if (!job.banks.empty() || (job.image && job.image->hasBanks()))
+    {
+      banked.clear();
+      vm.mapDevice(&banked, BankedRam::PORT, 1);
+    }
+
+    if (job.image)
+      job.image->load(vm, &banked);
+
+    for (const Segment& segment : job.segments)
+      vm.copyToRam(segment.data.data(), std::min<size_t>(segment.data.size(), VM::MEMORY_SIZE - segment.offset), segment.offset);
+
+    for (const BankSegment& segment : job.banks)
+      banked.load(segment.bank, segment.offset, segment.data.data(), segment.data.size());
+
+    sout.target = &result.output;
+    VM::RunResult run = vm.run(job.limits);
+    sout.target = nullptr;
+
+    result.reason = run.reason;
+    result.instructions = run.instructions;
+    result.elapsed = run.elapsed;
+    result.regs = vm.allRegs();
+  }
+};
+
+bool VMFarm::WorkRange::popFront(u32& index)
+{
+  u64 current = bounds.load(std::memory_order_relaxed);
+
+  for (;;)
+  {
+    u32 begin = current & 0xFFFFFFFF, end = current >> 32;
+
+    if (begin >= end)
+      return false;
+
+    if (bounds.compare_exchange_weak(current, pack(begin + 1, end), std::memory_order_acquire, std::memory_order_relaxed))
+    {
+      index = begin;
+      return true;
+    }
+  }
+}
+
+bool VMFarm::WorkRange::popBack(u32& index)
+{
+  u64 current = bounds.load(std::memory_order_relaxed);
+
+  for (;;)
+  {
+    u32 begin = current & 0xFFFFFFFF, end = current >> 32;
+
+    if (begin >= end)
+      return false;
+
+    if (bounds.compare_exchange_weak(current, pack(begin, end - 1), std::memory_order_acquire, std::memory_order_relaxed))
+    {
+      index = end - 1;
+      return true;
+    }
+  }
+}
+
+VMFarm::VMFarm(size_t threads, VM::Engine engine) : engine(engine)
+{
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+
+  for (size_t i = 0; i < threads; ++i)
+    workers.emplace_back(new Worker(engine));
+
+  ranges = std::vector<WorkRange>(threads);
+}
+
+VMFarm::~VMFarm() { }
+
+void VMFarm::work(size_t id, const std::vector<Job>& jobs, std::vector<JobResult>& results)
+{
+  Worker& worker = *workers[id];
+  u32 index;
+
+  for (;;)
+  {
+    if (ranges[id].popFront(index))
+    {
+      worker.execute(jobs[index], results[index]);
+      continue;
+    }
+
+    /* own range is empty, look for work starting from the next worker */
+    bool stolen = false;
+
+    for (size_t i = 1; i < workers.size() && !stolen; ++i)
+    {
+      if (ranges[(id + i) % workers.size()].popBack(index))
+      {
+        worker.execute(jobs[index], results[index]);
+        stolen = true;
+      }
+    }
+
+    /* jobs never spawn other jobs so once every range is empty the batch is done */
+    if (!stolen)
+      return;
+  }
+}
+
+std::vector<JobResult> VMFarm::run(const std::vector<Job>& jobs)
+{
+  std::vector<JobResult> results(jobs.size());
+  const size_t count = workers.size();
+
+  for (size_t i = 0; i < count; ++i)
+    ranges[i].bounds.store(WorkRange::pack(u32(jobs.size() * i / count), u32(jobs.size() * (i + 1) / count)), std::memory_order_relaxed);
+
+  std::vector<std::thread> threads;
+
+  for (size_t i = 1; i < count; ++i)
+    threads.emplace_back(&VMFarm::work, this, i, std::cref(jobs), std::ref(results));
+
+  work(0, jobs, results);
+
+  for (auto& thread : threads)
+    thread.join();
+
+  return results;
+}
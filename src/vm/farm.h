@@ -0,0 +1,95 @@
+#ifndef __FARM_H__
+#define __FARM_H__
+
+#include "../vm.h"
+#include "../image.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace vm
+{
+  /* bytes copied into RAM before a job starts, used both for the program image and
+     for its input data */
+  struct Segment
+  {
+    u16 offset;
+    std::vector<u8> data;
+  };
+
+  /* bytes copied into a bank of extended RAM before a job starts, offset is inside
+     the bank, see vm::BankedRam */
+  struct BankSegment
+  {
+    u8 bank;
+    u16 offset;
+    std::vector<u8> data;
+  };
+
+  /* an image is loaded before the segments, jobs running the same image share its
+     mapping, jobs with banked data run with a vm::BankedRam mapped on its default port */
+  struct Job
+  {
+    std::string name;
+    std::shared_ptr<const image::Image> image;
+    std::vector<Segment> segments;
+    std::vector<BankSegment> banks;
+    VM::RunLimits limits;
+  };
+
+  struct JobResult
+  {
+    VM::StopReason reason;
+    u64 instructions;
+    Regs regs;
+    std::vector<u8> output;
+    std::chrono::nanoseconds elapsed;
+  };
+
+  /* runs batches of independent jobs on a fixed set of workers, each worker owns a
+     contiguous range of the batch and reuses the same VM for all of its jobs, idle
+     workers steal single jobs from the back of the other ranges */
+  class VMFarm
+  {
+  private:
+    /* both ends of a range packed in a single word so that the owner taking from the
+       front and thieves taking from the back agree through one compare-exchange, padded
+       to a cache line so that two bounds never share one whatever the allocation's
+       alignment (alignas isn't honoured by new before C++17) */
+    struct WorkRange
+    {
+      static constexpr size_t CACHE_LINE = 64;
+
+      std::atomic<u64> bounds;
+      char padding[CACHE_LINE - sizeof(std::atomic<u64>)];
+
+      static u64 pack(u32 begin, u32 end) { return (u64(end) << 32) | begin; }
+
+      bool popFront(u32& index);
+      bool popBack(u32& index);
+    };
+
+    class Worker;
+
+    VM::Engine engine;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<WorkRange> ranges;
+
+    void work(size_t id, const std::vector<Job>& jobs, std::vector<JobResult>& results);
+
+  public:
+    /* a thread count of 0 uses every hardware thread */
+    VMFarm(size_t threads = 0, VM::Engine engine = J80_THREADED_DISPATCH ? VM::Engine::THREADED : VM::Engine::SWITCH);
+    ~VMFarm();
+
+    size_t threadCount() const { return workers.size(); }
+
+    /* results are in the same order as jobs */
+    std::vector<JobResult> run(const std::vector<Job>& jobs);
+  };
+}
+
+#endif
@@ -0,0 +1,689 @@
+#include "jit.h"
+
+#if J80_JIT
+
+#include <algorithm>
+#include <cstddef>
+
+#include <sys/mman.h>
+
+using namespace vm;
+
+/* register assignment inside translated code:
+   rbx: Regs*, r12: guest memory, r13: JitContext*, r14: VM* */
+
+constexpr size_t Jit::CODE_BUFFER_SIZE;
+constexpr size_t Jit::MAX_BLOCK_BYTES;
+constexpr u32 Jit::MAX_BLOCK_INSTRUCTIONS;
+constexpr size_t Jit::CODE_PAGE_SIZE;
+constexpr u32 Jit::NO_TAIL;
+
+static constexpr u8 CONTEXT_BUDGET = offsetof(JitContext, budget);
+static constexpr u8 CONTEXT_TABLE = offsetof(JitContext, blockTable);
+static constexpr u8 CONTEXT_LINK_SITE = offsetof(JitContext, linkSite);
+static constexpr u8 CONTEXT_INVALIDATED = offsetof(JitContext, invalidated);
+
+Jit::Jit(VM& vm) : vm(vm), buffer(nullptr), codeStart(0), generation(0), dirty(false), tailEnd(NO_TAIL), enter(nullptr), dispatchDynamic(nullptr), leave(nullptr),
+  table(new const u8*[0x10000]()), untranslatable(0x10000, false)
+{
+  untranslatablePages.fill(false);
+
+  void* memory = mmap(nullptr, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (memory != MAP_FAILED)
+  {
+    buffer = static_cast<u8*>(memory);
+    emitter.init(buffer, CODE_BUFFER_SIZE);
+    emitTrampolines();
+    codeStart = emitter.offset();
+    mprotect(buffer, CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+  }
+
+  context.budget = 0;
+  context.blockTable = table.get();
+  context.linkSite = nullptr;
+  context.invalidated = 0;
+}
+
+Jit::~Jit()
+{
+  if (buffer)
+    munmap(buffer, CODE_BUFFER_SIZE);
+}
+
+s32 Jit::regOffset8(Reg reg) const
+{
+  return static_cast<s32>(reinterpret_cast<u8*>(&vm.regs.reg8(reg)) - reinterpret_cast<u8*>(&vm.regs));
+}
+
+s32 Jit::regOffset16(Reg reg) const
+{
+  return static_cast<s32>(reinterpret_cast<u8*>(&vm.regs.reg16(reg)) - reinterpret_cast<u8*>(&vm.regs));
+}
+
+s32 Jit::pcOffset() const { return offsetof(Regs, PC); }
+s32 Jit::flagsOffset() const { return offsetof(Regs, FLAGS); }
+
+/* relative to the VM, which is in r14 */
+s32 Jit::vmOffset(const void* field) const
+{
+  return static_cast<s32>(static_cast<const u8*>(field) - reinterpret_cast<const u8*>(&vm));
+}
+
+/* the buffer is never writable and executable at once, only the pages code is
+   emitted or patched in are made writable and they go back before entering it */
+void Jit::makeWritable(u8* start, size_t length)
+{
+  const uintptr_t mask = ~uintptr_t(CODE_PAGE_SIZE - 1);
+  u8* first = reinterpret_cast<u8*>(reinterpret_cast<uintptr_t>(start) & mask);
+  u8* last = reinterpret_cast<u8*>((reinterpret_cast<uintptr_t>(start + length) + CODE_PAGE_SIZE - 1) & mask);
+  last = std::min(last, buffer + CODE_BUFFER_SIZE);
+
+  for (const auto& range : writableRanges)
+  {
+    if (first >= range.first && last <= range.second)
+      return;
+  }
+
+  mprotect(first, last - first, PROT_READ | PROT_WRITE);
+  writableRanges.push_back(std::make_pair(first, last));
+}
+
+void Jit::makeExecutable()
+{
+  for (const auto& range : writableRanges)
+    mprotect(range.first, range.second - range.first, PROT_READ | PROT_EXEC);
+
+  writableRanges.clear();
+}
+
+void Jit::emitTrampolines()
+{
+  Emitter& e = emitter;
+
+  /* Exit enter(Regs*, u8* memory, JitContext*, VM*, const u8* code) */
+  enter = reinterpret_cast<enter_t>(e.current());
+  e.bytes({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 }); // push rbx, rbp, r12, r13, r14, r15
+  e.bytes({ 0x48, 0x83, 0xEC, 0x08 }); // sub rsp, 8 (keeps calls aligned)
+  e.bytes({ 0x48, 0x89, 0xFB }); // mov rbx, rdi
+  e.bytes({ 0x49, 0x89, 0xF4 }); // mov r12, rsi
+  e.bytes({ 0x49, 0x89, 0xD5 }); // mov r13, rdx
+  e.bytes({ 0x49, 0x89, 0xCE }); // mov r14, rcx
+  e.bytes({ 0x41, 0xFF, 0xE0 }); // jmp r8
+
+  /* continues at the block for the current PC if it's translated */
+  dispatchDynamic = e.current();
+  e.bytes({ 0x0F, 0xB7, 0x83 }); e.dword(pcOffset()); // movzx eax, word [rbx+PC]
+  e.bytes({ 0x49, 0x8B, 0x4D, CONTEXT_TABLE }); // mov rcx, [r13+table]
+  e.bytes({ 0x48, 0x8B, 0x0C, 0xC1 }); // mov rcx, [rcx+rax*8]
+  e.bytes({ 0x48, 0x85, 0xC9 }); // test rcx, rcx
+  e.bytes({ 0x74, 0x02 }); // jz miss
+  e.bytes({ 0xFF, 0xE1 }); // jmp rcx
+  e.byte(0xB8); e.dword(EXIT_LOOKUP); // miss: mov eax, EXIT_LOOKUP
+
+  leave = e.current();
+  e.bytes({ 0x48, 0x83, 0xC4, 0x08 }); // add rsp, 8
+  e.bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B }); // pop r15, r14, r13, r12, rbp, rbx
+  e.byte(0xC3); // ret
+}
+
+/* a static exit is a jmp which initially falls into its own stub, the stub asks the
+   dispatcher to link it and once the target is translated the jmp is patched to
+   reach it directly */
+void Jit::emitChainExit(u16 target)
+{
+  Emitter& e = emitter;
+
+  u8* site = e.current();
+  e.byte(0xE9); e.dword(0); // jmp stub
+
+  e.bytes({ 0x66, 0xC7, 0x83 }); e.dword(pcOffset()); e.word(target); // mov word [rbx+PC], target
+  e.bytes({ 0x48, 0x8D, 0x05 }); e.rel32(site); // lea rax, [rip+site]
+  e.bytes({ 0x49, 0x89, 0x45, CONTEXT_LINK_SITE }); // mov [r13+linkSite], rax
+  e.byte(0xB8); e.dword(EXIT_LINK); // mov eax, EXIT_LINK
+  e.byte(0xE9); e.rel32(leave); // jmp leave
+}
+
+void Jit::emitHelperCall(const DecodedInstruction& i, u16 address)
+{
+  Emitter& e = emitter;
+
+  arena.push_back(i);
+  const DecodedInstruction* copy = &arena.back();
+
+  e.bytes({ 0x66, 0xC7, 0x83 }); e.dword(pcOffset()); e.word(address); // mov word [rbx+PC], address
+  e.bytes({ 0x4C, 0x89, 0xF7 }); // mov rdi, r14
+  e.bytes({ 0x48, 0xBE }); e.qword(reinterpret_cast<u64>(copy)); // mov rsi, copy
+  e.bytes({ 0x48, 0xB8 }); e.qword(reinterpret_cast<u64>(&Jit::execute)); // mov rax, execute
+  e.bytes({ 0xFF, 0xD0 }); // call rax
+}
+
+/* conditional branches test FLAGS directly so pending ALU flags are computed first */
+void Jit::emitMaterializeFlags()
+{
+  Emitter& e = emitter;
+
+  e.bytes({ 0x41, 0x83, 0xBE }); e.dword(vmOffset(&vm.lazyFlags.signMask)); e.byte(0x00); // cmp dword [r14+signMask], 0
+  e.bytes({ 0x74, 0x0F }); // je skip
+  e.bytes({ 0x4C, 0x89, 0xF7 }); // mov rdi, r14
+  e.bytes({ 0x48, 0xB8 }); e.qword(reinterpret_cast<u64>(&Jit::materializeFlags)); // mov rax, materializeFlags
+  e.bytes({ 0xFF, 0xD0 }); // call rax
+}
+
+/* ALU and CMP forms write the lazy flags the same way VM::alu does, including ADC
+   storing its result before the sign of its first operand is taken, shifts are
+   left to the handler */
+bool Jit::emitAlu(const DecodedInstruction& i, bool wide, Reg dest, Reg op1, Reg op2, bool immediate, bool saveResult)
+{
+#if J80_LAZY_FLAGS
+  Emitter& e = emitter;
+  bool arithmetic = true, carry = false, subtract = false;
+  u8 logic = 0;
+
+  switch (i.aluop)
+  {
+    case Alu::ADD8: case Alu::ADD16: break;
+    case Alu::ADC8: case Alu::ADC16: carry = true; break;
+    case Alu::SUB8: case Alu::SUB16: subtract = true; break;
+    case Alu::SBC8: case Alu::SBC16: subtract = carry = true; break;
+    case Alu::AND8: case Alu::AND16: arithmetic = false; logic = 0x21; break;
+    case Alu::OR8: case Alu::OR16: arithmetic = false; logic = 0x09; break;
+    case Alu::XOR8: case Alu::XOR16: arithmetic = false; logic = 0x31; break;
+    case Alu::NOT8: case Alu::NOT16: arithmetic = false; break;
+    default: return false;
+  }
+
+  const bool storesFirst = carry && !subtract;
+  const u16 signBit = wide ? 0x8000 : 0x80;
+
+  auto storeDest = [&]() {
+    if (wide) { e.bytes({ 0x66, 0x89, 0x83 }); e.dword(regOffset16(dest)); } // mov [rbx+dest], ax
+    else { e.bytes({ 0x88, 0x83 }); e.dword(regOffset8(dest)); } // mov [rbx+dest], al
+  };
+
+  auto recordNegativeOperand = [&]() {
+    if (wide) { e.bytes({ 0x66, 0xF7, 0x83 }); e.dword(regOffset16(op1)); e.word(signBit); } // test word [rbx+op1], signBit
+    else { e.bytes({ 0xF6, 0x83 }); e.dword(regOffset8(op1)); e.byte(static_cast<u8>(signBit)); } // test byte [rbx+op1], signBit
+    e.bytes({ 0x41, 0x0F, 0x95, 0x86 }); e.dword(vmOffset(&vm.lazyFlags.negativeOperand)); // setnz [r14+negativeOperand]
+  };
+
+  /* the carry of ADC and SBC and the flags kept by logic operations must be in FLAGS */
+  if (carry || !arithmetic)
+    emitMaterializeFlags();
+
+  /* VM::alu stores the arithmetic result, which logic operations leave at zero,
+     over their own value so ALU forms clear their destination, both forms set
+     the zero flag */
+  if (!arithmetic && saveResult)
+  {
+    if (wide) { e.bytes({ 0x66, 0xC7, 0x83 }); e.dword(regOffset16(dest)); e.word(0); } // mov word [rbx+dest], 0
+    else { e.bytes({ 0xC6, 0x83 }); e.dword(regOffset8(dest)); e.byte(0); } // mov byte [rbx+dest], 0
+    e.bytes({ 0x80, 0x8B }); e.dword(flagsOffset()); e.byte(FLAG_ZERO); // or byte [rbx+FLAGS], FLAG_ZERO
+    return true;
+  }
+
+  e.bytes({ 0x0F, static_cast<u8>(wide ? 0xB7 : 0xB6), 0x83 }); e.dword(wide ? regOffset16(op1) : regOffset8(op1)); // movzx eax, [rbx+op1]
+
+  if (immediate)
+  {
+    e.byte(0xB9); e.dword(wide ? i.short2 : i.unsigned8); // mov ecx, imm
+  }
+  else
+  {
+    e.bytes({ 0x0F, static_cast<u8>(wide ? 0xB7 : 0xB6), 0x8B }); e.dword(wide ? regOffset16(op2) : regOffset8(op2)); // movzx ecx, [rbx+op2]
+  }
+
+  if (arithmetic)
+  {
+    e.bytes({ static_cast<u8>(subtract ? 0x29 : 0x01), 0xC8 }); // sub/add eax, ecx
+
+    if (carry)
+    {
+      e.bytes({ 0x0F, 0xB6, 0x93 }); e.dword(flagsOffset()); // movzx edx, byte [rbx+FLAGS]
+      e.bytes({ 0x83, 0xE2, FLAG_CARRY }); // and edx, FLAG_CARRY
+      e.bytes({ static_cast<u8>(subtract ? 0x29 : 0x01), 0xD0 }); // sub/add eax, edx
+    }
+
+    if (!storesFirst)
+      recordNegativeOperand();
+
+    if (saveResult || storesFirst)
+      storeDest();
+
+    if (storesFirst)
+      recordNegativeOperand();
+
+    e.bytes({ 0x41, 0x89, 0x86 }); e.dword(vmOffset(&vm.lazyFlags.result)); // mov [r14+result], eax
+    e.bytes({ 0x41, 0xC7, 0x86 }); e.dword(vmOffset(&vm.lazyFlags.signMask)); e.dword(signBit); // mov dword [r14+signMask], signBit
+  }
+  else
+  {
+    if (logic)
+      e.bytes({ logic, 0xC8 }); // and/or/xor eax, ecx
+    else
+      e.bytes({ 0xF7, 0xD0 }); // not eax
+
+    storeDest();
+    e.bytes({ 0x80, 0x8B }); e.dword(flagsOffset()); e.byte(FLAG_ZERO); // or byte [rbx+FLAGS], FLAG_ZERO
+  }
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+static bool isTransfer(Alu alu)
+{
+  return alu == Alu::TRANSFER_A8 || alu == Alu::TRANSFER_A16 || alu == Alu::TRANSFER_B8 || alu == Alu::TRANSFER_B16;
+}
+
+bool Jit::emitNative(const DecodedInstruction& i)
+{
+  Emitter& e = emitter;
+
+  switch (i.handler)
+  {
+    case Handler::NOP:
+      return true;
+
+    case Handler::LD_NN:
+      e.bytes({ 0xC6, 0x83 }); e.dword(regOffset8(i.reg1)); e.byte(i.unsigned8); // mov byte [rbx+r1], imm8
+      return true;
+
+    case Handler::LD_NNNN:
+      e.bytes({ 0x66, 0xC7, 0x83 }); e.dword(regOffset16(i.reg1)); e.word(i.short1); // mov word [rbx+r1], imm16
+      return true;
+
+    case Handler::LD_RSH_LSH8:
+      if (!isTransfer(i.aluop))
+        return false;
+      e.bytes({ 0x8A, 0x83 }); e.dword(regOffset8(i.reg2)); // mov al, [rbx+r2]
+      e.bytes({ 0x88, 0x83 }); e.dword(regOffset8(i.reg1)); // mov [rbx+r1], al
+      return true;
+
+    case Handler::LD_RSH_LSH16:
+      if (!isTransfer(i.aluop))
+        return false;
+      e.bytes({ 0x66, 0x8B, 0x83 }); e.dword(regOffset16(i.reg2)); // mov ax, [rbx+r2]
+      e.bytes({ 0x66, 0x89, 0x83 }); e.dword(regOffset16(i.reg1)); // mov [rbx+r1], ax
+      return true;
+
+    case Handler::LD_PTR_NNNN:
+      if (vm.bus.isReadMapped(i.short1))
+        return false;
+      e.bytes({ 0x41, 0x8A, 0x84, 0x24 }); e.dword(i.short1); // mov al, [r12+NNNN]
+      e.bytes({ 0x88, 0x83 }); e.dword(regOffset8(i.reg1)); // mov [rbx+r1], al
+      return true;
+
+    case Handler::LD_PTR_PP:
+      if (vm.bus.hasReadMappings())
+        return false;
+      e.bytes({ 0x0F, 0xB7, 0x83 }); e.dword(regOffset16(i.reg2)); // movzx eax, word [rbx+r2]
+      e.byte(0x05); e.dword(static_cast<u32>(static_cast<s32>(i.signed8()))); // add eax, SS
+      e.bytes({ 0x0F, 0xB7, 0xC0 }); // movzx eax, ax
+      e.bytes({ 0x41, 0x8A, 0x04, 0x04 }); // mov al, [r12+rax]
+      e.bytes({ 0x88, 0x83 }); e.dword(regOffset8(i.reg1)); // mov [rbx+r1], al
+      return true;
+
+    case Handler::ALU_REG8: return emitAlu(i, false, i.reg1, i.reg2, i.reg3, false, true);
+    case Handler::ALU_REG16: return emitAlu(i, true, i.reg1, i.reg2, i.reg3, false, true);
+    case Handler::ALU_NN: return emitAlu(i, false, i.reg1, i.reg2, i.reg2, true, true);
+    case Handler::ALU_NNNN: return emitAlu(i, true, i.reg1, i.reg2, i.reg2, true, true);
+
+    case Handler::CMP_REG8: return emitAlu(i, false, i.reg1, i.reg1, i.reg2, false, false);
+    case Handler::CMP_REG16: return emitAlu(i, true, i.reg1, i.reg1, i.reg2, false, false);
+    case Handler::CMP_NN: return emitAlu(i, false, i.reg1, i.reg1, i.reg1, true, false);
+    case Handler::CMP_NNNN: return emitAlu(i, true, i.reg1, i.reg1, i.reg1, true, false);
+
+    default:
+      return false;
+  }
+}
+
+static bool isBranch(Handler handler)
+{
+  return handler == Handler::JMP_NNNN || handler == Handler::JMP_PP || handler == Handler::CALL || handler == Handler::RET;
+}
+
+static bool mayWriteMemory(Handler handler)
+{
+  return handler == Handler::SD_PTR_NNNN || handler == Handler::SD_PTR_PP || handler == Handler::PUSH || handler == Handler::PUSH16
+    || handler == Handler::COPY || handler == Handler::FILL;
+}
+
+Jit::Block* Jit::translate(u16 start)
+{
+  if (!emitter.hasRoom(MAX_BLOCK_BYTES))
+    flush();
+
+  makeWritable(emitter.current(), MAX_BLOCK_BYTES);
+  dirty = true;
+
+  /* gather the instructions of the block, it ends at the first branch or before
+     the first instruction which must be left to the interpreter, breakpoints
+     included */
+  std::vector<std::pair<DecodedInstruction, u16>> instructions;
+  u32 address = start;
+  bool terminated = false;
+
+  while (instructions.size() < MAX_BLOCK_INSTRUCTIONS && !terminated)
+  {
+    DecodedInstruction i = vm.decoded(static_cast<u16>(address));
+
+    if (i.handler == Handler::UNKNOWN || i.handler == Handler::BREAK || address + i.length > 0x10000)
+      break;
+
+    bool branch = isBranch(i.handler);
+
+    instructions.push_back(std::make_pair(i, static_cast<u16>(address)));
+    address += i.length;
+    terminated = branch;
+  }
+
+  if (instructions.empty())
+  {
+    untranslatable[start] = true;
+    untranslatablePages[start / DecodeCache::PAGE_SIZE] = true;
+    return nullptr;
+  }
+
+  Emitter& e = emitter;
+  const u32 count = static_cast<u32>(instructions.size());
+
+  std::unique_ptr<Block> block(new Block());
+  block->start = start;
+  block->end = address;
+  block->count = count;
+  block->entry = e.current();
+
+  /* stubs are emitted after the body, remember where their jumps must be patched */
+  std::vector<std::pair<u8*, u32>> invalidationFixups;
+
+  e.bytes({ 0x49, 0x81, 0x7D, CONTEXT_BUDGET }); e.dword(count); // cmp qword [r13+budget], count
+  e.bytes({ 0x0F, 0x82 }); u8* budgetFixup = e.current(); e.dword(0); // jb budgetExit
+  e.bytes({ 0x49, 0x81, 0x6D, CONTEXT_BUDGET }); e.dword(count); // sub qword [r13+budget], count
+
+  for (u32 k = 0; k < count; ++k)
+  {
+    const DecodedInstruction& i = instructions[k].first;
+    const u16 at = instructions[k].second;
+    const u16 next = at + i.length;
+
+    if (i.handler == Handler::JMP_NNNN)
+    {
+      if (i.cond & COND_UNCOND)
+        emitChainExit(i.short1);
+      else
+      {
+        static const u8 masks[] = { FLAG_CARRY, FLAG_ZERO, FLAG_SIGN, FLAG_OVERFLOW };
+        const bool negated = (i.cond & 0b100) != 0;
+
+        emitMaterializeFlags();
+        e.bytes({ 0xF6, 0x83 }); e.dword(flagsOffset()); e.byte(masks[i.cond & 0b11]); // test byte [rbx+FLAGS], mask
+        e.bytes({ 0x0F, static_cast<u8>(negated ? 0x84 : 0x85) }); u8* taken = e.current(); e.dword(0); // jz/jnz taken
+        emitChainExit(next);
+        Emitter::patchRel32(taken, e.current());
+        emitChainExit(i.short1);
+      }
+    }
+    else if (!emitNative(i))
+    {
+      emitHelperCall(i, at);
+
+      /* a CALL pushes its return address, which may land on translated code, so
+         check before dispatching to a block which could be stale */
+      const bool dynamic = i.handler == Handler::JMP_PP || i.handler == Handler::CALL || i.handler == Handler::RET;
+
+      if (dynamic || mayWriteMemory(i.handler) || i.handler == Handler::EI)
+      {
+        e.bytes({ 0x41, 0x80, 0x7D, CONTEXT_INVALIDATED, 0x00 }); // cmp byte [r13+invalidated], 0
+        e.bytes({ 0x0F, 0x85 }); invalidationFixups.push_back(std::make_pair(e.current(), count - k - 1)); e.dword(0); // jne invalidatedExit
+      }
+
+      if (dynamic)
+      {
+        e.byte(0xE9); e.rel32(dispatchDynamic); // jmp dispatchDynamic
+      }
+    }
+  }
+
+  if (!terminated)
+    emitChainExit(static_cast<u16>(address));
+
+  Emitter::patchRel32(budgetFixup, e.current());
+  e.bytes({ 0x66, 0xC7, 0x83 }); e.dword(pcOffset()); e.word(start); // mov word [rbx+PC], start
+  e.byte(0xB8); e.dword(EXIT_BUDGET); // mov eax, EXIT_BUDGET
+  e.byte(0xE9); e.rel32(leave); // jmp leave
+
+  /* a store hit translated code: PC is already past the store, give back the
+     budget of the instructions which won't run and leave since this block
+     could be stale now */
+  for (const auto& fixup : invalidationFixups)
+  {
+    Emitter::patchRel32(fixup.first, e.current());
+    e.bytes({ 0x49, 0x81, 0x45, CONTEXT_BUDGET }); e.dword(fixup.second); // add qword [r13+budget], remaining
+    e.byte(0xB8); e.dword(EXIT_INVALIDATED); // mov eax, EXIT_INVALIDATED
+    e.byte(0xE9); e.rel32(leave); // jmp leave
+  }
+
+  Block* result = block.get();
+  blocks[start] = std::move(block);
+  table[start] = result->entry;
+
+  for (u32 page = start / DecodeCache::PAGE_SIZE; page <= (result->end - 1) / DecodeCache::PAGE_SIZE; ++page)
+    pageBlocks[page].push_back(result);
+
+  return result;
+}
+
+Jit::Block* Jit::blockAt(u16 address)
+{
+  auto it = blocks.find(address);
+
+  if (it != blocks.end())
+    return it->second.get();
+  else if (untranslatable[address])
+    return nullptr;
+  else
+    return translate(address);
+}
+
+const Jit::Block* Jit::existingBlock(u16 address) const
+{
+  auto it = blocks.find(address);
+  return it != blocks.end() ? it->second.get() : nullptr;
+}
+
+void Jit::link(u8* site, u16 address)
+{
+  unlinkDropped();
+
+  u32 before = generation;
+  Block* block = blockAt(address);
+
+  /* translating the target could have flushed the buffer containing the site */
+  if (block && generation == before)
+  {
+    makeWritable(site + 1, 4);
+    Emitter::patchRel32(site + 1, block->entry);
+    block->incoming.push_back(site);
+  }
+}
+
+/* a block can be dropped by a store of the running code, which can't be made writable
+   then, the jumps reaching it are sent back to their stub before code runs again and
+   the store leaves the block before any of them can be taken */
+void Jit::drop(Block* block)
+{
+  unlinked.insert(unlinked.end(), block->incoming.begin(), block->incoming.end());
+
+  table[block->start] = nullptr;
+
+  for (u32 page = block->start / DecodeCache::PAGE_SIZE; page <= (block->end - 1) / DecodeCache::PAGE_SIZE; ++page)
+  {
+    auto& list = pageBlocks[page];
+    list.erase(std::remove(list.begin(), list.end(), block), list.end());
+  }
+
+  blocks.erase(block->start);
+}
+
+void Jit::unlinkDropped()
+{
+  if (unlinked.empty())
+    return;
+
+  for (u8* site : unlinked)
+  {
+    makeWritable(site + 1, 4);
+    Emitter::patchRel32(site + 1, site + 5);
+  }
+
+  unlinked.clear();
+}
+
+/* starts which couldn't be translated are retried once the bytes they decode change */
+void Jit::clearUntranslatable(u32 start, u32 end)
+{
+  for (u32 address = start; address < end; ++address)
+    untranslatable[address & 0xFFFF] = false;
+}
+
+void Jit::invalidate(u16 address)
+{
+  if (untranslatablePages[address / DecodeCache::PAGE_SIZE] || untranslatablePages[u16(address - (DecodeCache::MAX_SPAN - 1)) / DecodeCache::PAGE_SIZE])
+    clearUntranslatable(0x10000 + address - (DecodeCache::MAX_SPAN - 1), 0x10000 + address + 1);
+
+  /* copy since dropping a block modifies the page list */
+  std::vector<Block*> candidates = pageBlocks[address / DecodeCache::PAGE_SIZE];
+
+  for (Block* block : candidates)
+  {
+    if (address >= block->start && address < block->end)
+    {
+      drop(block);
+      context.invalidated = 1;
+    }
+  }
+}
+
+void Jit::invalidatePage(u32 page)
+{
+  if (untranslatablePages[page])
+  {
+    clearUntranslatable(page * DecodeCache::PAGE_SIZE, (page + 1) * DecodeCache::PAGE_SIZE);
+    untranslatablePages[page] = false;
+  }
+
+  const u32 previous = (page - 1) % DecodeCache::PAGE_COUNT;
+
+  if (untranslatablePages[previous])
+    clearUntranslatable((previous + 1) * DecodeCache::PAGE_SIZE - (DecodeCache::MAX_SPAN - 1), (previous + 1) * DecodeCache::PAGE_SIZE);
+
+  std::vector<Block*> candidates = pageBlocks[page];
+
+  for (Block* block : candidates)
+    drop(block);
+
+  /* the page can be replaced by a device write from the running block */
+  if (!candidates.empty())
+    context.invalidated = 1;
+}
+
+void Jit::flush()
+{
+  if (!dirty)
+    return;
+
+  blocks.clear();
+
+  for (auto& list : pageBlocks)
+    list.clear();
+
+  std::fill(table.get(), table.get() + 0x10000, nullptr);
+  std::fill(untranslatable.begin(), untranslatable.end(), false);
+  untranslatablePages.fill(false);
+  unlinked.clear();
+  tailEnd = NO_TAIL;
+  arena.clear();
+
+  emitter.rewind(codeStart);
+  ++generation;
+  dirty = false;
+}
+
+void Jit::execute(VM* vm, const DecodedInstruction* i)
+{
+  (vm->*VM::handlers[static_cast<size_t>(i->handler)])(*i);
+}
+
+void Jit::materializeFlags(VM* vm)
+{
+  vm->materializeFlags();
+}
+
+u64 Jit::run(u64 budget)
+{
+  u64 executed = 0;
+
+  while (executed < budget && !vm.stopRequested.load(std::memory_order_relaxed))
+  {
+    u64 slice = std::min(budget - executed, VM::STOP_CHECK_INTERVAL);
+    context.budget = slice;
+
+    while (context.budget > 0)
+    {
+      /* blocks run entirely so the tail of the budget is left to the interpreter, which
+         goes on to the end of the block it cut, across slices too, instead of translating
+         a new block at each address it stops on */
+      const Block* block = tailEnd == NO_TAIL ? blockAt(vm.regs.PC) : existingBlock(vm.regs.PC);
+
+      if (!block || block->count > context.budget)
+      {
+        const DecodedInstruction& i = vm.decoded(vm.regs.PC);
+
+        if (i.handler == Handler::BREAK && vm.shouldBreak(i))
+        {
+          vm.stopRequested.store(false, std::memory_order_relaxed);
+          return executed + slice - context.budget;
+        }
+
+        if (block)
+          tailEnd = block->end % 0x10000;
+
+        execute(&vm, &i);
+        --context.budget;
+
+        if (vm.regs.PC == tailEnd || isBranch(i.handler))
+          tailEnd = NO_TAIL;
+      }
+      else
+      {
+        tailEnd = NO_TAIL;
+        unlinkDropped();
+        makeExecutable();
+
+        context.invalidated = 0;
+        Exit exit = enter(&vm.regs, vm.memory, &context, &vm, block->entry);
+
+        if (exit == EXIT_LINK)
+          link(context.linkSite, vm.regs.PC);
+      }
+
+      /* the VM wants to look at its event queue */
+      if (vm.eventCheck)
+      {
+        vm.stopRequested.store(false, std::memory_order_relaxed);
+        return executed + slice - context.budget;
+      }
+    }
+
+    executed += slice;
+  }
+
+  vm.stopRequested.store(false, std::memory_order_relaxed);
+  return executed;
+}
+
+#endif
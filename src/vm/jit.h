@@ -0,0 +1,164 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include "../vm.h"
+
+#include <array>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#if J80_JIT
+
+namespace vm
+{
+  /* state shared between the dispatcher and translated code, generated code
+     addresses it through r13 so layout must stay standard */
+  struct JitContext
+  {
+    u64 budget;
+    const u8* const* blockTable;
+    u8* linkSite;
+    u8 invalidated;
+  };
+
+  class Emitter
+  {
+  private:
+    u8* base;
+    size_t capacity;
+    size_t position;
+
+  public:
+    Emitter() : base(nullptr), capacity(0), position(0) { }
+
+    void init(u8* base, size_t capacity) { this->base = base; this->capacity = capacity; this->position = 0; }
+    void rewind(size_t position) { this->position = position; }
+
+    u8* current() const { return base + position; }
+    size_t offset() const { return position; }
+    bool hasRoom(size_t bytes) const { return position + bytes <= capacity; }
+
+    void byte(u8 v) { base[position++] = v; }
+    void bytes(std::initializer_list<u8> values) { for (u8 v : values) byte(v); }
+    void word(u16 v) { memcpy(current(), &v, sizeof(v)); position += sizeof(v); }
+    void dword(u32 v) { memcpy(current(), &v, sizeof(v)); position += sizeof(v); }
+    void qword(u64 v) { memcpy(current(), &v, sizeof(v)); position += sizeof(v); }
+
+    /* emits a rel32 displacement reaching target from the end of the field */
+    void rel32(const u8* target) { dword(static_cast<u32>(target - (current() + 4))); }
+
+    static void patchRel32(u8* field, const u8* target) { u32 rel = static_cast<u32>(target - (field + 4)); memcpy(field, &rel, sizeof(rel)); }
+  };
+
+  /* translates guest basic blocks to x86-64, instructions which move data and ALU
+     and CMP forms are emitted natively, the latter writing the lazy flags, while
+     shifts, the stack and memory stores call the interpreter handler for the
+     predecoded instruction so semantics (0xFFFF output port, code invalidation)
+     are exactly the same */
+  class Jit
+  {
+  public:
+    enum Exit : u32
+    {
+      EXIT_BUDGET = 0,
+      EXIT_LOOKUP,
+      EXIT_LINK,
+      EXIT_INVALIDATED
+    };
+
+    static constexpr size_t CODE_BUFFER_SIZE = 8 << 20;
+    static constexpr size_t MAX_BLOCK_BYTES = 4096;
+    static constexpr u32 MAX_BLOCK_INSTRUCTIONS = 32;
+    static constexpr size_t CODE_PAGE_SIZE = 4096;
+
+  private:
+    struct Block
+    {
+      u16 start;
+      u32 end;
+      u32 count;
+      const u8* entry;
+      std::vector<u8*> incoming;
+    };
+
+    using enter_t = Exit (*)(Regs* regs, u8* memory, JitContext* context, VM* vm, const u8* code);
+
+    VM& vm;
+    JitContext context;
+
+    u8* buffer;
+    Emitter emitter;
+    size_t codeStart;
+    u32 generation;
+    bool dirty;
+
+    /* end of the block the budget cut while the interpreter runs its tail */
+    static constexpr u32 NO_TAIL = 0x10000;
+    u32 tailEnd;
+
+    enter_t enter;
+    const u8* dispatchDynamic;
+    const u8* leave;
+
+    std::unique_ptr<const u8*[]> table;
+    std::unordered_map<u16, std::unique_ptr<Block>> blocks;
+    std::array<std::vector<Block*>, DecodeCache::PAGE_COUNT> pageBlocks;
+    std::vector<bool> untranslatable;
+    std::array<bool, DecodeCache::PAGE_COUNT> untranslatablePages;
+    std::vector<u8*> unlinked;
+    std::vector<std::pair<u8*, u8*>> writableRanges;
+    std::deque<DecodedInstruction> arena;
+
+    s32 regOffset8(Reg reg) const;
+    s32 regOffset16(Reg reg) const;
+    s32 pcOffset() const;
+    s32 flagsOffset() const;
+    s32 vmOffset(const void* field) const;
+
+    void makeWritable(u8* start, size_t length);
+    void makeExecutable();
+
+    void emitTrampolines();
+    void emitChainExit(u16 target);
+    void emitHelperCall(const DecodedInstruction& i, u16 address);
+    void emitMaterializeFlags();
+    bool emitAlu(const DecodedInstruction& i, bool wide, Reg dest, Reg op1, Reg op2, bool immediate, bool saveResult);
+    bool emitNative(const DecodedInstruction& i);
+
+    Block* translate(u16 address);
+    Block* blockAt(u16 address);
+    const Block* existingBlock(u16 address) const;
+    void link(u8* site, u16 address);
+    void drop(Block* block);
+    void unlinkDropped();
+    void clearUntranslatable(u32 start, u32 end);
+
+    static void execute(VM* vm, const DecodedInstruction* i);
+    static void materializeFlags(VM* vm);
+
+  public:
+    Jit(VM& vm);
+    ~Jit();
+
+    bool isValid() const { return buffer != nullptr; }
+
+    bool covers(u16 address) const
+    {
+      return !pageBlocks[address / DecodeCache::PAGE_SIZE].empty() || untranslatablePages[address / DecodeCache::PAGE_SIZE]
+        || untranslatablePages[u16(address - (DecodeCache::MAX_SPAN - 1)) / DecodeCache::PAGE_SIZE];
+    }
+    void invalidate(u16 address);
+    void invalidatePage(u32 page);
+    void flush();
+    /* makes the running block leave after its next store or EI */
+    void requestExit() { context.invalidated = 1; }
+
+    u64 run(u64 budget);
+  };
+}
+
+#endif
+
+#endif
@@ -0,0 +1,212 @@
+#include "memory.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace vm;
+
+#if _WIN32
+
+u8* vm::allocatePages(size_t size)
+{
+  return static_cast<u8*>(VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+}
+
+void vm::releasePages(u8* pages, size_t size)
+{
+  if (pages)
+    VirtualFree(pages, 0, MEM_RELEASE);
+}
+
+/* MEM_RESET leaves the content undefined so the pages are cleared by hand */
+void vm::discardPages(u8* pages, size_t size)
+{
+  memset(pages, 0, size);
+}
+
+FileMapping::FileMapping() : data(nullptr), size(0), writable(false), file(INVALID_HANDLE_VALUE), mapping(nullptr) { }
+
+bool FileMapping::open(const std::string& path, size_t size)
+{
+  close();
+
+  file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  /* a mapping larger than the file grows it, the new bytes are zero */
+  u64 length = size;
+  mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, DWORD(length >> 32), DWORD(length), nullptr);
+  data = mapping ? static_cast<u8*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size)) : nullptr;
+
+  if (!data)
+  {
+    close();
+    return false;
+  }
+
+  this->size = size;
+  writable = true;
+  return true;
+}
+
+bool FileMapping::openReadOnly(const std::string& path)
+{
+  close();
+
+  file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  LARGE_INTEGER length;
+
+  if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length) || length.QuadPart == 0)
+  {
+    close();
+    return false;
+  }
+
+  mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  data = mapping ? static_cast<u8*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+
+  if (!data)
+  {
+    close();
+    return false;
+  }
+
+  size = size_t(length.QuadPart);
+  return true;
+}
+
+/* views can't be placed over VirtualAlloc memory */
+void FileMapping::mapInto(u8* target, size_t offset, size_t length) const
+{
+  memcpy(target, data + offset, length);
+}
+
+void FileMapping::close()
+{
+  if (data)
+    UnmapViewOfFile(data);
+  if (mapping)
+    CloseHandle(mapping);
+  if (file != INVALID_HANDLE_VALUE)
+    CloseHandle(file);
+
+  data = nullptr;
+  mapping = nullptr;
+  file = INVALID_HANDLE_VALUE;
+  size = 0;
+  writable = false;
+}
+
+#else
+
+u8* vm::allocatePages(size_t size)
+{
+  void* pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return pages != MAP_FAILED ? static_cast<u8*>(pages) : nullptr;
+}
+
+void vm::releasePages(u8* pages, size_t size)
+{
+  if (pages)
+    munmap(pages, size);
+}
+
+/* private anonymous pages dropped with MADV_DONTNEED come back zero filled */
+void vm::discardPages(u8* pages, size_t size)
+{
+  if (madvise(pages, size, MADV_DONTNEED) != 0)
+    memset(pages, 0, size);
+}
+
+FileMapping::FileMapping() : data(nullptr), size(0), writable(false), file(-1) { }
+
+bool FileMapping::open(const std::string& path, size_t size)
+{
+  close();
+
+  file = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+  if (file < 0)
+    return false;
+
+  /* only grown, a larger file keeps its tail */
+  off_t current = lseek(file, 0, SEEK_END);
+
+  if (current < 0 || (size_t(current) < size && ftruncate(file, size) != 0))
+  {
+    close();
+    return false;
+  }
+
+  void* bytes = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+
+  if (bytes == MAP_FAILED)
+  {
+    close();
+    return false;
+  }
+
+  data = static_cast<u8*>(bytes);
+  this->size = size;
+  writable = true;
+  return true;
+}
+
+bool FileMapping::openReadOnly(const std::string& path)
+{
+  close();
+
+  file = ::open(path.c_str(), O_RDONLY);
+
+  if (file < 0)
+    return false;
+
+  off_t length = lseek(file, 0, SEEK_END);
+  void* bytes = length > 0 ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+
+  if (bytes == MAP_FAILED)
+  {
+    close();
+    return false;
+  }
+
+  data = static_cast<u8*>(bytes);
+  size = length;
+  return true;
+}
+
+void FileMapping::mapInto(u8* target, size_t offset, size_t length) const
+{
+  static const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  bool aligned = (reinterpret_cast<uintptr_t>(target) | offset | length) % pageSize == 0;
+
+  if (!aligned || writable || mmap(target, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file, offset) == MAP_FAILED)
+    memcpy(target, data + offset, length);
+}
+
+void FileMapping::close()
+{
+  if (data)
+    munmap(data, size);
+  if (file >= 0)
+    ::close(file);
+
+  data = nullptr;
+  file = -1;
+  size = 0;
+  writable = false;
+}
+
+#endif
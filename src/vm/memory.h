@@ -0,0 +1,56 @@
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+#include "../utils.h"
+
+#include <string>
+
+namespace vm
+{
+  /* zero filled pages taken straight from the OS, a page costs memory only once it
+     is touched, returns nullptr on failure */
+  u8* allocatePages(size_t size);
+  void releasePages(u8* pages, size_t size);
+  /* hands the pages back to the OS, they read as zero afterwards */
+  void discardPages(u8* pages, size_t size);
+
+  /* a file mapped in memory, either read/write with the file created or grown to the
+     mapped size and receiving every write by the time the mapping is closed, or read
+     only with its pages also available for mapInto() */
+  class FileMapping
+  {
+  private:
+    u8* data;
+    size_t size;
+    bool writable;
+
+#if _WIN32
+    void* file;
+    void* mapping;
+#else
+    int file;
+#endif
+
+  public:
+    FileMapping();
+    ~FileMapping() { close(); }
+
+    FileMapping(const FileMapping&) = delete;
+    FileMapping& operator=(const FileMapping&) = delete;
+
+    bool open(const std::string& path, size_t size);
+    bool openReadOnly(const std::string& path);
+    void close();
+
+    /* places a private copy on write view of length bytes of a read only file at
+       target, the pages are read as they are touched, falls back to copying when the
+       platform can't or when target, offset or length aren't page aligned */
+    void mapInto(u8* target, size_t offset, size_t length) const;
+
+    bool isOpen() const { return data != nullptr; }
+    u8* bytes() const { return data; }
+    size_t length() const { return size; }
+  };
+}
+
+#endif
@@ -0,0 +1,31 @@
+#include "output.h"
+
+#include <cerrno>
+
+using namespace vm;
+
+constexpr size_t BufferedStdOut::CAPACITY;
+
+void FileStdOut::flushed(const u8* data, size_t length)
+{
+#if !_WIN32
+  while (length > 0)
+  {
+    ssize_t written = ::write(fd, data, length);
+
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    data += written;
+    length -= written;
+  }
+#else
+  FILE* stream = fd == 2 ? stderr : stdout;
+  fwrite(data, 1, length, stream);
+  fflush(stream);
+#endif
+}
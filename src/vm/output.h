@@ -0,0 +1,67 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include "../vm.h"
+
+#include <array>
+
+namespace vm
+{
+  /* collects guest output and hands it out in batches to flushed(), a flush happens
+     on newlines (if enabled), when the buffer is full, when a VM run returns or
+     explicitly, every flush empties the buffer so it never needs to wrap */
+  class BufferedStdOut : public StdOut
+  {
+  public:
+    static constexpr size_t CAPACITY = 4096;
+
+  private:
+    std::array<u8, CAPACITY> buffer;
+    size_t length;
+    bool flushOnNewline;
+
+  protected:
+    virtual void flushed(const u8* data, size_t length) = 0;
+
+  public:
+    BufferedStdOut(bool flushOnNewline = true) : length(0), flushOnNewline(flushOnNewline) { }
+
+    void out(u8 value) override
+    {
+      buffer[length++] = value;
+
+      if (length == CAPACITY || (value == '\n' && flushOnNewline))
+        flush();
+    }
+
+    void write(u16, u8 value) override { out(value); }
+
+    void flush() override
+    {
+      if (length)
+      {
+        size_t pending = length;
+        length = 0;
+        flushed(buffer.data(), pending);
+      }
+    }
+
+    size_t buffered() const { return length; }
+  };
+
+  /* writes batches to a file descriptor with a single write each */
+  class FileStdOut : public BufferedStdOut
+  {
+  private:
+    int fd;
+
+  protected:
+    void flushed(const u8* data, size_t length) override;
+
+  public:
+    FileStdOut(int fd, bool flushOnNewline = true) : BufferedStdOut(flushOnNewline), fd(fd) { }
+    ~FileStdOut() { flush(); }
+  };
+}
+
+#endif
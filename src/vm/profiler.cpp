@@ -0,0 +1,392 @@
+#include "profiler.h"
+
+#include "../support/format/format.h"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace vm;
+
+constexpr u32 Profiler::OPCODE_COUNT;
+constexpr u32 Profiler::ALU_COUNT;
+constexpr u32 Profiler::HANDLER_COUNT;
+
+static const char* handlerLabel(Handler handler)
+{
+  switch (handler)
+  {
+    case Handler::LD_RSH_LSH8: return "LD_RSH_LSH8";
+    case Handler::LD_RSH_LSH16: return "LD_RSH_LSH16";
+    case Handler::LD_NN: return "LD_NN";
+    case Handler::LD_NNNN: return "LD_NNNN";
+    case Handler::LD_PTR_NNNN: return "LD_PTR_NNNN";
+    case Handler::LD_PTR_PP: return "LD_PTR_PP";
+    case Handler::SD_PTR_NNNN: return "SD_PTR_NNNN";
+    case Handler::SD_PTR_PP: return "SD_PTR_PP";
+    case Handler::ALU_REG8: return "ALU_REG8";
+    case Handler::ALU_REG16: return "ALU_REG16";
+    case Handler::ALU_NN: return "ALU_NN";
+    case Handler::ALU_NNNN: return "ALU_NNNN";
+    case Handler::CMP_REG8: return "CMP_REG8";
+    case Handler::CMP_REG16: return "CMP_REG16";
+    case Handler::CMP_NN: return "CMP_NN";
+    case Handler::CMP_NNNN: return "CMP_NNNN";
+    case Handler::MUL8: return "MUL8";
+    case Handler::MUL16: return "MUL16";
+    case Handler::DIV8: return "DIV8";
+    case Handler::COPY: return "COPY";
+    case Handler::FILL: return "FILL";
+    case Handler::JMP_NNNN: return "JMP_NNNN";
+    case Handler::JMP_PP: return "JMP_PP";
+    case Handler::CALL: return "CALL";
+    case Handler::RET: return "RET";
+    case Handler::PUSH: return "PUSH";
+    case Handler::PUSH16: return "PUSH16";
+    case Handler::POP: return "POP";
+    case Handler::POP16: return "POP16";
+    case Handler::LF: return "LF";
+    case Handler::SF: return "SF";
+    case Handler::EI: return "EI";
+    case Handler::DI: return "DI";
+    case Handler::SEXT: return "SEXT";
+    case Handler::NOP: return "NOP";
+    case Handler::BREAK: return "BREAK";
+    default: return "UNKNOWN";
+  }
+}
+
+static const char* opcodeLabel(u8 opcode)
+{
+  switch (opcode)
+  {
+    case OPCODE_LD_RSH_LSH: return "LD_RSH_LSH";
+    case OPCODE_LD_NN: return "LD_NN";
+    case OPCODE_LD_NNNN: return "LD_NNNN";
+    case OPCODE_LD_PTR_NNNN: return "LD_PTR_NNNN";
+    case OPCODE_LD_PTR_PP: return "LD_PTR_PP";
+    case OPCODE_SD_PTR_NNNN: return "SD_PTR_NNNN";
+    case OPCODE_SD_PTR_PP: return "SD_PTR_PP";
+    case OPCODE_ALU_REG: return "ALU_REG";
+    case OPCODE_ALU_NN: return "ALU_NN";
+    case OPCODE_ALU_NNNN: return "ALU_NNNN";
+    case OPCODE_JMP_NNNN: return "JMP_NNNN";
+    case OPCODE_JMPC_NNNN: return "JMPC_NNNN";
+    case OPCODE_NOP: return "NOP";
+    case OPCODE_JMP_PP: return "JMP_PP";
+    case OPCODE_JMPC_PP: return "JMPC_PP";
+    case OPCODE_PUSH: return "PUSH";
+    case OPCODE_POP: return "POP";
+    case OPCODE_PUSH16: return "PUSH16";
+    case OPCODE_POP16: return "POP16";
+    case OPCODE_RET: return "RET";
+    case OPCODE_RETC: return "RETC";
+    case OPCODE_CALL: return "CALL";
+    case OPCODE_CALLC: return "CALLC";
+    case OPCODE_LF: return "LF";
+    case OPCODE_SF: return "SF";
+    case OPCODE_CMP_REG: return "CMP_REG";
+    case OPCODE_CMP_NN: return "CMP_NN";
+    case OPCODE_CMP_NNNN: return "CMP_NNNN";
+    case OPCODE_EI: return "EI";
+    case OPCODE_DI: return "DI";
+    case OPCODE_SEXT: return "SEXT";
+    case OPCODE_EXT: return "EXT";
+    default: return nullptr;
+  }
+}
+
+static const char* aluLabel(u8 alu)
+{
+  switch (static_cast<Alu>(alu))
+  {
+    case Alu::ADD8: return "ADD8";
+    case Alu::ADD16: return "ADD16";
+    case Alu::ADC8: return "ADC8";
+    case Alu::ADC16: return "ADC16";
+    case Alu::SUB8: return "SUB8";
+    case Alu::SUB16: return "SUB16";
+    case Alu::SBC8: return "SBC8";
+    case Alu::AND8: return "AND8";
+    case Alu::AND16: return "AND16";
+    case Alu::OR8: return "OR8";
+    case Alu::OR16: return "OR16";
+    case Alu::XOR8: return "XOR8";
+    case Alu::XOR16: return "XOR16";
+    case Alu::NOT8: return "NOT8";
+    case Alu::NOT16: return "NOT16";
+    case Alu::TRANSFER_A8: return "TRANSFER_A8";
+    case Alu::TRANSFER_A16: return "TRANSFER_A16";
+    case Alu::TRANSFER_B8: return "TRANSFER_B8";
+    case Alu::TRANSFER_B16: return "TRANSFER_B16";
+    case Alu::ADD_NO_FLAGS: return "ADD_NO_FLAGS";
+    case Alu::LSH8: return "LSH8";
+    case Alu::LSH16: return "LSH16";
+    case Alu::RSH8: return "RSH8";
+    case Alu::RSH16: return "RSH16";
+    case Alu::SF: return "SF";
+    case Alu::LF: return "LF";
+    default: return nullptr;
+  }
+}
+
+void Profiler::reset()
+{
+  pcCounts.assign(0x10000, 0);
+  pcCycles.assign(0x10000, 0);
+  opcodeCounts.fill(0);
+  aluCounts.fill(0);
+  pairCounts.fill(0);
+  backEdges.clear();
+  total = 0;
+  totalCycles = 0;
+
+  frames.clear();
+  frames.push_back({ 0, 0, 0, 0, { } });
+  current = 0;
+
+  pending = Branch::NONE;
+  lastPC = 0;
+  lastCycles = 0;
+  lastHandler = Handler::INVALID;
+  fallthrough = 0;
+}
+
+void Profiler::instruction(const VM& vm, const DecodedInstruction& i)
+{
+  u16 pc = vm.pc();
+  /* breakpoints and halts are counted as the instruction they trap */
+  Handler handler = i.handler == Handler::BREAK ? i.trapped : i.handler;
+
+  /* the root frame is named after the address profiling started from */
+  if (total == 0)
+    frames[0].address = pc;
+
+  if (total && pc == fallthrough)
+    ++pairCounts[static_cast<u32>(lastHandler) * HANDLER_COUNT + static_cast<u32>(handler)];
+
+  lastPC = pc;
+  lastCycles = vm.cycles();
+  lastHandler = handler;
+  fallthrough = pc + i.length;
+
+  ++total;
+  ++pcCounts[pc];
+  ++opcodeCounts[i.opcode & (OPCODE_COUNT - 1)];
+  ++frames[current].instructions;
+
+  switch (handler)
+  {
+    case Handler::LD_RSH_LSH8:
+    case Handler::LD_RSH_LSH16:
+    case Handler::ALU_REG8:
+    case Handler::ALU_REG16:
+    case Handler::ALU_NN:
+    case Handler::ALU_NNNN:
+    case Handler::CMP_REG8:
+    case Handler::CMP_REG16:
+    case Handler::CMP_NN:
+    case Handler::CMP_NNNN:
+      ++aluCounts[static_cast<u8>(i.aluop) & (ALU_COUNT - 1)];
+      break;
+
+    /* conditions are evaluated before executing since flags can't change in between */
+    case Handler::JMP_NNNN:
+    case Handler::JMP_PP:
+      if (vm.isConditionTrue(i.cond))
+      {
+        pending = Branch::JUMP;
+        pendingPC = pc;
+      }
+      break;
+
+    case Handler::CALL:
+      if (vm.isConditionTrue(i.cond))
+      {
+        pending = Branch::CALL;
+        pendingTarget = i.short1;
+      }
+      break;
+
+    case Handler::RET:
+      if (vm.isConditionTrue(i.cond))
+        pending = Branch::RET;
+      break;
+
+    default:
+      break;
+  }
+}
+
+void Profiler::branch(u16 pc)
+{
+  switch (pending)
+  {
+    case Branch::JUMP:
+      if (pc <= pendingPC)
+        ++backEdges[(u32(pc) << 16) | pendingPC];
+      break;
+
+    case Branch::CALL:
+    {
+      auto it = frames[current].children.find(pendingTarget);
+
+      if (it != frames[current].children.end())
+        current = it->second;
+      else
+      {
+        u32 child = frames.size();
+        frames[current].children[pendingTarget] = child;
+        frames.push_back({ pendingTarget, current, 0, 0, { } });
+        current = child;
+      }
+
+      break;
+    }
+
+    /* returning from the root frame keeps counting into it */
+    case Branch::RET:
+      current = frames[current].parent;
+      break;
+
+    case Branch::NONE:
+      break;
+  }
+
+  pending = Branch::NONE;
+}
+
+std::vector<Profiler::Loop> Profiler::hotLoops() const
+{
+  std::vector<Loop> loops;
+
+  for (const auto& edge : backEdges)
+  {
+    u16 head = edge.first >> 16, tail = edge.first & 0xFFFF;
+    u64 instructions = std::accumulate(pcCounts.begin() + head, pcCounts.begin() + tail + 1, u64(0));
+    loops.push_back({ head, tail, edge.second, instructions });
+  }
+
+  std::sort(loops.begin(), loops.end(), [] (const Loop& a, const Loop& b) {
+    return a.instructions != b.instructions ? a.instructions > b.instructions : a.head < b.head;
+  });
+
+  return loops;
+}
+
+u32 Profiler::suggestedFusions(double share) const
+{
+  u64 counts[static_cast<u32>(Fusion::COUNT)] = { 0 };
+
+  counts[static_cast<u32>(Fusion::CMP_NN_JMP)] = pairCount(Handler::CMP_NN, Handler::JMP_NNNN);
+  counts[static_cast<u32>(Fusion::CMP_REG_RET)] = pairCount(Handler::CMP_REG8, Handler::RET) + pairCount(Handler::CMP_REG16, Handler::RET);
+  counts[static_cast<u32>(Fusion::ALU_NNNN_JMP)] = pairCount(Handler::ALU_NNNN, Handler::JMP_NNNN);
+
+  u32 mask = 0;
+
+  for (u32 fusion = 1; fusion < static_cast<u32>(Fusion::COUNT); ++fusion)
+    if (counts[fusion] && counts[fusion] * 2 >= share * total)
+      mask |= VM::fusionBit(static_cast<Fusion>(fusion));
+
+  return mask;
+}
+
+std::string Profiler::name(u16 address) const
+{
+  return symbolMap ? symbolMap->describe(address) : fmt::format("{:04X}h", address);
+}
+
+std::string Profiler::report(size_t rows) const
+{
+  auto percent = [this] (u64 count) { return total ? 100.0 * count / total : 0.0; };
+
+  std::string out = fmt::format("{} instructions, {} cycles\n", total, totalCycles);
+
+  std::vector<u32> pcs;
+  for (u32 pc = 0; pc < pcCounts.size(); ++pc)
+    if (pcCounts[pc])
+      pcs.push_back(pc);
+
+  std::stable_sort(pcs.begin(), pcs.end(), [this] (u32 a, u32 b) { return pcCounts[a] > pcCounts[b]; });
+  pcs.resize(std::min(pcs.size(), rows));
+
+  out += fmt::format("\n{:<24} {:>14} {:>8} {:>14}\n", "address", "count", "%", "cycles");
+  for (u32 pc : pcs)
+    out += fmt::format("{:<24} {:>14} {:>7.2f}% {:>14}\n", name(pc), pcCounts[pc], percent(pcCounts[pc]), pcCycles[pc]);
+
+  auto table = [&] (const char* title, const std::array<u64, 32>& counts, const char* (*label)(u8)) {
+    std::vector<u32> entries;
+    for (u32 k = 0; k < counts.size(); ++k)
+      if (counts[k])
+        entries.push_back(k);
+
+    std::stable_sort(entries.begin(), entries.end(), [&counts] (u32 a, u32 b) { return counts[a] > counts[b]; });
+
+    out += fmt::format("\n{:<24} {:>14} {:>8}\n", title, "count", "%");
+    for (u32 k : entries)
+    {
+      const char* name = label(k);
+      out += fmt::format("{:<24} {:>14} {:>7.2f}%\n", name ? name : fmt::format("{:05b}b", k), counts[k], percent(counts[k]));
+    }
+  };
+
+  table("opcode", opcodeCounts, opcodeLabel);
+  table("alu", aluCounts, aluLabel);
+
+  std::vector<u32> pairs;
+  for (u32 k = 0; k < pairCounts.size(); ++k)
+    if (pairCounts[k])
+      pairs.push_back(k);
+
+  std::stable_sort(pairs.begin(), pairs.end(), [this] (u32 a, u32 b) { return pairCounts[a] > pairCounts[b]; });
+  pairs.resize(std::min(pairs.size(), rows));
+
+  /* candidates for fusion, each pair counts as two instructions */
+  out += fmt::format("\n{:<24} {:>14} {:>8}\n", "pair", "count", "%");
+  for (u32 k : pairs)
+  {
+    std::string pair = std::string(handlerLabel(static_cast<Handler>(k / HANDLER_COUNT))) + "+" + handlerLabel(static_cast<Handler>(k % HANDLER_COUNT));
+    out += fmt::format("{:<24} {:>14} {:>7.2f}%\n", pair, pairCounts[k], percent(pairCounts[k] * 2));
+  }
+
+  std::vector<Loop> loops = hotLoops();
+  loops.resize(std::min(loops.size(), rows));
+
+  out += fmt::format("\n{:<24} {:>14} {:>14} {:>8}\n", "loop", "iterations", "instructions", "%");
+  for (const Loop& loop : loops)
+    out += fmt::format("{:<24} {:>14} {:>14} {:>7.2f}%\n", name(loop.head) + ".." + name(loop.tail), loop.iterations, loop.instructions, percent(loop.instructions));
+
+  return out;
+}
+
+std::string Profiler::foldedStacks(bool cycles) const
+{
+  std::string out;
+
+  for (const Frame& frame : frames)
+  {
+    u64 weight = cycles ? frame.cycles : frame.instructions;
+
+    if (!weight)
+      continue;
+
+    std::vector<const Frame*> stack;
+    for (const Frame* it = &frame; ; it = &frames[it->parent])
+    {
+      stack.push_back(it);
+      if (it == &frames[0])
+        break;
+    }
+
+    std::string line;
+    for (auto it = stack.rbegin(); it != stack.rend(); ++it)
+    {
+      if (!line.empty())
+        line += ';';
+      line += name((*it)->address);
+    }
+
+    out += fmt::format("{} {}\n", line, weight);
+  }
+
+  return out;
+}
@@ -0,0 +1,124 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include "../vm.h"
+#include "../symbols.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace vm
+{
+  /* counts what the interpreter executes, the VM calls it around every instruction
+     only while it is attached through VM::setProfiler, runs without a profiler use
+     an instantiation of the interpreter which has no hooks at all
+
+     calls are tracked as a tree of frames keyed by the CALL target so time can be
+     reported as folded stacks, a taken backward jump marks the target as a loop head */
+  class Profiler
+  {
+  public:
+    static constexpr u32 OPCODE_COUNT = 32;
+    static constexpr u32 ALU_COUNT = 32;
+    static constexpr u32 HANDLER_COUNT = static_cast<u32>(Handler::COUNT);
+
+    struct Loop
+    {
+      u16 head;
+      u16 tail;
+      u64 iterations;
+      u64 instructions;
+    };
+
+  private:
+    struct Frame
+    {
+      u16 address;
+      u32 parent;
+      u64 instructions;
+      u64 cycles;
+      std::unordered_map<u16, u32> children;
+    };
+
+    enum class Branch : u8
+    {
+      NONE,
+      JUMP,
+      CALL,
+      RET
+    };
+
+    std::vector<u64> pcCounts;
+    std::vector<u64> pcCycles;
+    std::array<u64, OPCODE_COUNT> opcodeCounts;
+    std::array<u64, ALU_COUNT> aluCounts;
+    std::array<u64, HANDLER_COUNT * HANDLER_COUNT> pairCounts;
+    std::unordered_map<u32, u64> backEdges;
+    u64 total;
+    u64 totalCycles;
+
+    std::vector<Frame> frames;
+    u32 current;
+
+    Branch pending;
+    u16 lastPC;
+    u64 lastCycles;
+    Handler lastHandler;
+    u16 fallthrough;
+    u16 pendingPC;
+    u16 pendingTarget;
+
+    const symbols::SymbolMap* symbolMap;
+
+    std::string name(u16 address) const;
+
+  public:
+    Profiler() : symbolMap(nullptr) { reset(); }
+
+    void reset();
+    /* addresses in reports are named after the closest preceding label */
+    void setSymbols(const symbols::SymbolMap* symbolMap) { this->symbolMap = symbolMap; }
+
+    /* called before executing the instruction at the current PC and after it, cycles
+       are attributed only when the VM runs with cycle accurate timing */
+    void instruction(const VM& vm, const DecodedInstruction& i);
+    void retired(const VM& vm)
+    {
+      u64 cycles = vm.cycles() - lastCycles;
+      pcCycles[lastPC] += cycles;
+      totalCycles += cycles;
+      frames[current].cycles += cycles;
+
+      if (pending != Branch::NONE)
+        branch(vm.pc());
+    }
+    void branch(u16 pc);
+    /* an interrupt is tracked as a call to its vector so its RET balances it */
+    void interrupted(u16 vector) { pending = Branch::CALL; pendingTarget = vector; branch(vector); }
+
+    u64 totalInstructions() const { return total; }
+    u64 totalCyclesSpent() const { return totalCycles; }
+    u64 countAt(u16 pc) const { return pcCounts[pc]; }
+    u64 cyclesAt(u16 pc) const { return pcCycles[pc]; }
+    u64 opcodeCount(Opcode opcode) const { return opcodeCounts[opcode & (OPCODE_COUNT - 1)]; }
+    u64 aluCount(Alu alu) const { return aluCounts[static_cast<u8>(alu) & (ALU_COUNT - 1)]; }
+    /* times second ran right after first without a branch in between */
+    u64 pairCount(Handler first, Handler second) const { return pairCounts[static_cast<u32>(first) * HANDLER_COUNT + static_cast<u32>(second)]; }
+
+    /* VM::setFusions mask enabling the fusions whose pairs made up at least share
+       of the executed instructions */
+    u32 suggestedFusions(double share = 0.01) const;
+
+    /* loops ordered by the instructions spent between their head and back edge */
+    std::vector<Loop> hotLoops() const;
+
+    /* sorted tables of the hottest addresses, opcodes, ALU operations and loops */
+    std::string report(size_t rows = 20) const;
+    /* one line per call stack with the instructions (or cycles) spent in its
+       innermost frame, as consumed by flamegraph.pl and similar tools */
+    std::string foldedStacks(bool cycles = false) const;
+  };
+}
+
+#endif
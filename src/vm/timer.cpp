@@ -0,0 +1,53 @@
+#include "timer.h"
+
+using namespace vm;
+
+constexpr u16 Timer::PORT;
+constexpr u32 Timer::PORT_COUNT;
+
+u8 Timer::read(u16 address)
+{
+  switch (address % PORT_COUNT)
+  {
+    case 0: return period & 0xFF;
+    case 1: return period >> 8;
+    case 2: return control;
+    default:
+    {
+      u8 value = expirations;
+      expirations = 0;
+      return value;
+    }
+  }
+}
+
+void Timer::write(u16 address, u8 value)
+{
+  switch (address % PORT_COUNT)
+  {
+    case 0: period = (period & 0xFF00) | value; break;
+    case 1: period = (period & 0x00FF) | (value << 8); break;
+    case 2:
+      control = value;
+      vm.cancelEvents(this);
+
+      if (control & ENABLE)
+        vm.scheduleIn(length(), this);
+      break;
+    default: break;
+  }
+}
+
+/* periodic deadlines follow each other exactly, however late the previous one fired */
+void Timer::fire(u64 deadline)
+{
+  if (expirations < 0xFF)
+    ++expirations;
+
+  vm.raiseInterrupt((control >> INTERRUPT_SHIFT) & 0b11);
+
+  if (control & PERIODIC)
+    vm.schedule(deadline + length(), this);
+  else
+    control &= ~ENABLE;
+}
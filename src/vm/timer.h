@@ -0,0 +1,49 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "../vm.h"
+
+namespace vm
+{
+  /* interval timer raising an interrupt each time its period elapses on VM::clock(),
+     every expiration is a single event on the VM queue so a stopped or waiting timer
+     costs nothing to the running engines, it must be mapped on PORT_COUNT ports
+     starting at a multiple of PORT_COUNT
+
+       +0  period low byte
+       +1  period high byte, a period of 0 lasts 65536
+       +2  control, see Control, writing it restarts the countdown from the period
+       +3  expirations since this port was last read, saturating at 255 */
+  class Timer : public Device, public EventHandler
+  {
+  public:
+    static constexpr u16 PORT = 0xFFF0;
+    static constexpr u32 PORT_COUNT = 4;
+
+    enum Control : u8
+    {
+      ENABLE = 0x01,
+      PERIODIC = 0x02,
+      /* bits 2-3 are the index of the raised interrupt */
+      INTERRUPT_SHIFT = 2
+    };
+
+  private:
+    VM& vm;
+    u16 period;
+    u8 control;
+    u8 expirations;
+
+    u64 length() const { return period ? period : 0x10000; }
+
+  public:
+    Timer(VM& vm) : vm(vm), period(0), control(0), expirations(0) { }
+    ~Timer() { vm.cancelEvents(this); }
+
+    u8 read(u16 address) override;
+    void write(u16 address, u8 value) override;
+    void fire(u64 deadline) override;
+  };
+}
+
+#endif
@@ -0,0 +1,505 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if !_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace vm;
+
+static const char TRACE_MAGIC[4] = { 'J', '8', '0', 'T' };
+static constexpr u16 TRACE_VERSION = 1;
+static constexpr size_t HEADER_SIZE = 16;
+static constexpr size_t FLUSH_THRESHOLD = 1 << 16;
+
+constexpr u64 TraceRecorder::DEFAULT_CHECKPOINT_INTERVAL;
+
+/* registers stored by checkpoints, in mask bit order */
+static u16& traceReg(Regs& regs, u32 index)
+{
+  u16* regs16[] = { &regs.BA, &regs.CD, &regs.EF, &regs.XY, &regs.SP, &regs.FP, &regs.IX, &regs.IY, &regs.PC };
+  return *regs16[index];
+}
+
+static constexpr u32 TRACE_REG16_COUNT = 9;
+static constexpr u32 TRACE_FLAGS_BIT = TRACE_REG16_COUNT;
+
+static u64 zigzag(s32 value) { return (u32(value) << 1) ^ u32(value >> 31); }
+static s32 unzigzag(u64 value) { return s32(value >> 1) ^ -s32(value & 1); }
+
+TraceRecorder::TraceRecorder(VM& vm, u64 checkpointInterval) : vm(vm), file(nullptr),
+  checkpointInterval(checkpointInterval ? checkpointInterval : DEFAULT_CHECKPOINT_INTERVAL), sinceCheckpoint(0), total(0), lastReadAddress(0), checkpointRetired(0)
+{
+  memset(&lastRegs, 0, sizeof(Regs));
+}
+
+TraceRecorder::~TraceRecorder()
+{
+  close();
+}
+
+void TraceRecorder::varint(u64 value)
+{
+  while (value >= 0x80)
+  {
+    buffer.push_back(u8(value) | 0x80);
+    value >>= 7;
+  }
+
+  buffer.push_back(u8(value));
+}
+
+void TraceRecorder::flush()
+{
+  if (file && !buffer.empty())
+    fwrite(buffer.data(), 1, buffer.size(), file);
+
+  buffer.clear();
+}
+
+bool TraceRecorder::open(const std::string& path)
+{
+  close();
+
+  file = fopen(path.c_str(), "wb");
+
+  if (!file)
+    return false;
+
+  buffer.insert(buffer.end(), TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC));
+  buffer.push_back(TRACE_VERSION & 0xFF);
+  buffer.push_back(TRACE_VERSION >> 8);
+  buffer.push_back(0);
+  buffer.push_back(0);
+  for (u32 i = 0; i < 8; ++i)
+    buffer.push_back(u8(checkpointInterval >> (i * 8)));
+
+  const u8* ram = vm.ram();
+  std::vector<u8> pages;
+
+  for (u32 page = 0; page < Snapshot::PAGE_COUNT; ++page)
+  {
+    const u8* begin = ram + page * Snapshot::PAGE_SIZE;
+
+    if (std::any_of(begin, begin + Snapshot::PAGE_SIZE, [] (u8 value) { return value != 0; }))
+      pages.push_back(page);
+  }
+
+  buffer.push_back(u8(TraceTag::IMAGE));
+  varint(pages.size());
+
+  for (u8 page : pages)
+  {
+    buffer.push_back(page);
+    buffer.insert(buffer.end(), ram + page * Snapshot::PAGE_SIZE, ram + (page + 1) * Snapshot::PAGE_SIZE);
+  }
+
+  sinceCheckpoint = 0;
+  total = 0;
+  lastReadAddress = 0;
+  memset(&lastRegs, 0, sizeof(Regs));
+
+  /* the first checkpoint holds the starting registers */
+  checkpoint();
+  flush();
+
+  vm.setReadInterceptor(this);
+  vm.setTraceRecorder(this);
+  return true;
+}
+
+void TraceRecorder::close()
+{
+  if (!file)
+    return;
+
+  vm.setReadInterceptor(nullptr);
+  vm.setTraceRecorder(nullptr);
+
+  if (sinceCheckpoint)
+    checkpoint();
+
+  buffer.push_back(u8(TraceTag::END));
+  varint(total);
+  flush();
+
+  fclose(file);
+  file = nullptr;
+}
+
+void TraceRecorder::checkpoint()
+{
+  vm.materializeFlags();
+  Regs regs = vm.allRegs();
+  u32 mask = 0;
+
+  for (u32 i = 0; i < TRACE_REG16_COUNT; ++i)
+    if (traceReg(regs, i) != traceReg(lastRegs, i))
+      mask |= 1 << i;
+
+  if (regs.FLAGS != lastRegs.FLAGS)
+    mask |= 1 << TRACE_FLAGS_BIT;
+
+  buffer.push_back(u8(TraceTag::CHECKPOINT));
+  varint(sinceCheckpoint);
+  varint(mask);
+
+  for (u32 i = 0; i < TRACE_REG16_COUNT; ++i)
+  {
+    if (mask & (1 << i))
+    {
+      u16 value = traceReg(regs, i);
+      buffer.push_back(value & 0xFF);
+      buffer.push_back(value >> 8);
+    }
+  }
+
+  if (mask & (1 << TRACE_FLAGS_BIT))
+    buffer.push_back(regs.FLAGS);
+
+  lastRegs = regs;
+  sinceCheckpoint = 0;
+  checkpointRetired = vm.retiredInstructions();
+}
+
+u64 TraceRecorder::run(u64 budget)
+{
+  u64 executed = 0;
+
+  while (executed < budget)
+  {
+    u64 slice = std::min(budget - executed, checkpointInterval - sinceCheckpoint);
+    u64 done = vm.run(slice);
+
+    executed += done;
+    sinceCheckpoint += done;
+    total += done;
+
+    if (sinceCheckpoint == checkpointInterval)
+      checkpoint();
+
+    if (buffer.size() >= FLUSH_THRESHOLD)
+      flush();
+
+    /* stop requested */
+    if (done < slice)
+      break;
+  }
+
+  return executed;
+}
+
+u8 TraceRecorder::read(Device* device, u16 address)
+{
+  u8 value = device->read(address);
+
+  buffer.push_back(u8(TraceTag::READ));
+  varint(zigzag(s32(address) - s32(lastReadAddress)));
+  buffer.push_back(value);
+  lastReadAddress = address;
+
+  return value;
+}
+
+/* interrupts are taken between slices so the instructions retired by the VM tell
+   where the running slice got to */
+void TraceRecorder::interrupted(u8 index)
+{
+  buffer.push_back(u8(TraceTag::INTERRUPT));
+  varint(vm.retiredInstructions() - checkpointRetired);
+  buffer.push_back(index);
+}
+
+TraceReader::TraceReader() : data(nullptr), size(0), position(0), mapping(nullptr), checkpointInterval(0), lastReadAddress(0)
+{
+  memset(&lastRegs, 0, sizeof(Regs));
+}
+
+TraceReader::~TraceReader()
+{
+  close();
+}
+
+bool TraceReader::open(const std::string& path)
+{
+  close();
+
+#if !_WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+
+  if (fstat(fd, &info) == 0 && info.st_size > 0)
+  {
+    void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (address != MAP_FAILED)
+    {
+      mapping = address;
+      data = static_cast<const u8*>(address);
+      size = info.st_size;
+    }
+  }
+
+  ::close(fd);
+#else
+  FILE* file = fopen(path.c_str(), "rb");
+
+  if (!file)
+    return false;
+
+  u8 chunk[4096];
+  for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0; )
+    contents.insert(contents.end(), chunk, chunk + read);
+
+  fclose(file);
+  data = contents.data();
+  size = contents.size();
+#endif
+
+  if (size < HEADER_SIZE || memcmp(data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || (data[4] | (data[5] << 8)) != TRACE_VERSION)
+  {
+    close();
+    return false;
+  }
+
+  checkpointInterval = 0;
+  for (u32 i = 0; i < 8; ++i)
+    checkpointInterval |= u64(data[8 + i]) << (i * 8);
+
+  position = HEADER_SIZE;
+  lastReadAddress = 0;
+  memset(&lastRegs, 0, sizeof(Regs));
+  return true;
+}
+
+void TraceReader::close()
+{
+#if !_WIN32
+  if (mapping)
+    munmap(mapping, size);
+#endif
+
+  mapping = nullptr;
+  contents.clear();
+  data = nullptr;
+  size = 0;
+  position = 0;
+}
+
+bool TraceReader::varint(u64& value)
+{
+  value = 0;
+
+  for (u32 shift = 0; shift < 64; shift += 7)
+  {
+    if (position >= size)
+      return false;
+
+    u8 byte = data[position++];
+    value |= u64(byte & 0x7F) << shift;
+
+    if (!(byte & 0x80))
+      return true;
+  }
+
+  return false;
+}
+
+bool TraceReader::next(TraceRecord& record)
+{
+  if (position >= size)
+    return false;
+
+  record.tag = static_cast<TraceTag>(data[position++]);
+  u64 value;
+
+  switch (record.tag)
+  {
+    case TraceTag::IMAGE:
+    {
+      if (!varint(value) || size - position < value * (Snapshot::PAGE_SIZE + 1))
+        return false;
+
+      record.pageCount = value;
+      record.pages = data + position;
+      position += value * (Snapshot::PAGE_SIZE + 1);
+      return true;
+    }
+
+    case TraceTag::READ:
+    {
+      if (!varint(value) || position >= size)
+        return false;
+
+      lastReadAddress = u16(lastReadAddress + unzigzag(value));
+      record.address = lastReadAddress;
+      record.value = data[position++];
+      return true;
+    }
+
+    case TraceTag::INTERRUPT:
+    {
+      if (!varint(record.instructions) || position >= size)
+        return false;
+
+      record.value = data[position++];
+      return true;
+    }
+
+    case TraceTag::CHECKPOINT:
+    {
+      u64 mask;
+
+      if (!varint(record.instructions) || !varint(mask))
+        return false;
+
+      for (u32 i = 0; i < TRACE_REG16_COUNT; ++i)
+      {
+        if (mask & (1 << i))
+        {
+          if (size - position < 2)
+            return false;
+
+          traceReg(lastRegs, i) = data[position] | (data[position + 1] << 8);
+          position += 2;
+        }
+      }
+
+      if (mask & (1 << TRACE_FLAGS_BIT))
+      {
+        if (position >= size)
+          return false;
+
+        lastRegs.FLAGS = data[position++];
+      }
+
+      record.regs = lastRegs;
+      return true;
+    }
+
+    case TraceTag::END:
+      return varint(record.instructions);
+
+    default:
+      return false;
+  }
+}
+
+TraceReplayer::Result TraceReplayer::replay(TraceReader& reader)
+{
+  Result result = { true, 0, "" };
+  TraceRecord record;
+  /* instructions run since the last checkpoint */
+  u64 ran = 0;
+
+  reads.clear();
+  diverged = false;
+  vm.setReadInterceptor(this);
+
+  while (result.success && reader.next(record))
+  {
+    switch (record.tag)
+    {
+      case TraceTag::IMAGE:
+      {
+        vm.clearRam();
+
+        for (size_t i = 0; i < record.pageCount; ++i)
+        {
+          const u8* page = record.pages + i * (Snapshot::PAGE_SIZE + 1);
+          vm.copyToRam(page + 1, Snapshot::PAGE_SIZE, page[0] * Snapshot::PAGE_SIZE);
+        }
+
+        break;
+      }
+
+      case TraceTag::READ:
+        reads.push_back(std::make_pair(record.address, record.value));
+        break;
+
+      case TraceTag::INTERRUPT:
+      {
+        if (record.instructions < ran)
+        {
+          result = { false, result.instructions, "trace is truncated or malformed" };
+          break;
+        }
+
+        result.instructions += vm.run(record.instructions - ran);
+        ran = record.instructions;
+
+        /* taken before the next instruction like it was while recording */
+        if (!vm.interruptsEnabled())
+          result = { false, result.instructions, "interrupt taken while interrupts are disabled at instruction " + std::to_string(result.instructions) };
+        else
+          vm.raiseInterrupt(record.value);
+
+        break;
+      }
+
+      case TraceTag::CHECKPOINT:
+      {
+        if (record.instructions < ran)
+        {
+          result = { false, result.instructions, "trace is truncated or malformed" };
+          break;
+        }
+
+        /* the first checkpoint only sets the starting registers */
+        if (record.instructions)
+          result.instructions += vm.run(record.instructions - ran);
+        else if (result.instructions == 0)
+        {
+          vm.materializeFlags();
+          vm.allRegs() = record.regs;
+        }
+
+        ran = 0;
+        vm.materializeFlags();
+        const Regs& regs = vm.allRegs();
+
+        if (diverged || !reads.empty())
+          result = { false, result.instructions, "device reads diverged before instruction " + std::to_string(result.instructions) };
+        else if (memcmp(regs.file16, record.regs.file16, sizeof(regs.file16)) != 0 || regs.FLAGS != record.regs.FLAGS || regs.PC != record.regs.PC)
+          result = { false, result.instructions, "registers diverged at instruction " + std::to_string(result.instructions) };
+
+        break;
+      }
+
+      case TraceTag::END:
+        vm.setReadInterceptor(nullptr);
+        return result;
+
+      default:
+        break;
+    }
+  }
+
+  vm.setReadInterceptor(nullptr);
+
+  if (result.success)
+    result = { false, result.instructions, "trace is truncated or malformed" };
+
+  return result;
+}
+
+u8 TraceReplayer::read(Device*, u16 address)
+{
+  if (reads.empty() || reads.front().first != address)
+  {
+    diverged = true;
+    return 0xFF;
+  }
+
+  u8 value = reads.front().second;
+  reads.pop_front();
+  return value;
+}
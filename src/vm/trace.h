@@ -0,0 +1,145 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "../vm.h"
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+/* execution traces only store what can't be derived by running the program again:
+   the starting image, values returned by device reads and, every checkpointInterval
+   instructions, the registers to verify the replay against.
+
+   header: "J80T", u16 version, u16 reserved, u64 checkpoint interval (little endian)
+   then a stream of records, each a tag byte followed by its payload:
+
+   IMAGE      varint count, count x (u8 page, 256 bytes), only non zero pages
+   READ       zigzag varint address delta from the previous read, u8 value
+   INTERRUPT  varint instructions since the previous checkpoint, u8 vector index
+   CHECKPOINT varint instructions since the previous checkpoint, varint mask of the
+              registers which changed, u16 for each changed register (u8 for FLAGS)
+   END        varint total instructions
+
+   records are written sequentially so the file can be consumed while it grows, a
+   reader only needs the bytes so it can work straight on a mapped file */
+
+namespace vm
+{
+  enum class TraceTag : u8
+  {
+    IMAGE = 1,
+    READ,
+    INTERRUPT,
+    CHECKPOINT,
+    END
+  };
+
+  struct TraceRecord
+  {
+    TraceTag tag;
+
+    u16 address;
+    u8 value;
+
+    const u8* pages;
+    size_t pageCount;
+
+    u64 instructions;
+    Regs regs;
+  };
+
+  class TraceRecorder : public ReadInterceptor
+  {
+  public:
+    static constexpr u64 DEFAULT_CHECKPOINT_INTERVAL = 1 << 20;
+
+  private:
+    VM& vm;
+    FILE* file;
+    std::vector<u8> buffer;
+
+    u64 checkpointInterval;
+    u64 sinceCheckpoint;
+    u64 total;
+    u16 lastReadAddress;
+    Regs lastRegs;
+    u64 checkpointRetired;
+
+    void varint(u64 value);
+    void checkpoint();
+    void flush();
+
+  public:
+    TraceRecorder(VM& vm, u64 checkpointInterval = DEFAULT_CHECKPOINT_INTERVAL);
+    ~TraceRecorder();
+
+    /* writes the header, the current RAM and registers and starts intercepting reads */
+    bool open(const std::string& path);
+    /* writes the last checkpoint and closes the file */
+    void close();
+
+    u64 run(u64 budget);
+
+    u8 read(Device* device, u16 address) override;
+    /* called by the VM when it takes an interrupt */
+    void interrupted(u8 index);
+  };
+
+  class TraceReader
+  {
+  private:
+    const u8* data;
+    size_t size;
+    size_t position;
+
+    void* mapping;
+    std::vector<u8> contents;
+
+    u64 checkpointInterval;
+    u16 lastReadAddress;
+    Regs lastRegs;
+
+    bool varint(u64& value);
+
+  public:
+    TraceReader();
+    ~TraceReader();
+
+    bool open(const std::string& path);
+    void close();
+
+    u64 getCheckpointInterval() const { return checkpointInterval; }
+
+    /* returns false at the end of data or on a malformed record */
+    bool next(TraceRecord& record);
+  };
+
+  class TraceReplayer : public ReadInterceptor
+  {
+  private:
+    VM& vm;
+    std::deque<std::pair<u16, u8>> reads;
+    bool diverged;
+
+  public:
+    struct Result
+    {
+      bool success;
+      u64 instructions;
+      std::string error;
+    };
+
+    TraceReplayer(VM& vm) : vm(vm), diverged(false) { }
+
+    /* loads the recorded image and runs it again with the selected engine, device
+       reads are answered from the trace, interrupts are raised again after the same
+       number of instructions and registers are compared at checkpoints */
+    Result replay(TraceReader& reader);
+
+    u8 read(Device* device, u16 address) override;
+  };
+}
+
+#endif
@@ -2,12 +2,15 @@
 
 #include "vm.h"
 #include "opcodes.h"
+#include "output.h"
 
 #include <ncurses.h>
 #include <panel.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 using namespace vm;
 
 static int width, height;
@@ -15,6 +18,7 @@ static int width, height;
 constexpr u32 WINDOW_REGS_HEIGHT = 8;
 constexpr u32 SIDE_PANEL_WIDTH = 33;
 constexpr u32 LOWER_PANEL_HEIGHT = 5;
+constexpr u32 CONTINUE_SLICE_STEPS = 1024;
 
 void UI::init()
 {
@@ -62,6 +66,8 @@ void UI::updateRegisters()
   box(wRegisters, 0, 0);
   mvwprintw(wRegisters, 0, 1, "[Registers]");
   
+  vm.materializeFlags();
+  
   mvwprintw(wRegisters, 1, 2, "BA: %04Xh", vm.reg16(Reg::BA));
   mvwprintw(wRegisters, 2, 2, "CD: %04Xh", vm.reg16(Reg::CD));
   mvwprintw(wRegisters, 3, 2, "EF: %04Xh", vm.reg16(Reg::EF));
@@ -148,6 +154,8 @@ void UI::updateCode()
       
       if (pc == vm.pc())
         mvwprintw(wCode, 1+row, 1, ">");
+      if (vm.isBreakpoint(pc))
+        mvwprintw(wCode, 1+row, 8, "*");
       
       pc += info.length;
     }
@@ -160,7 +168,7 @@ void UI::updateCode()
 }
 
 template<size_t HEIGHT>
-class MyStdOut : public StdOut
+class MyStdOut : public BufferedStdOut
 {
 public:
   std::string buffer[HEIGHT];
@@ -175,22 +183,33 @@ private:
     
     buffer[HEIGHT-1].clear();
   }
-public:
-  size_t index = 0;
-  void out(u8 value) override
+protected:
+  void flushed(const u8* data, size_t length) override
   {
-    if (value == '\n')
+    const u8* end = data + length;
+    
+    while (data < end)
     {
+      const u8* newline = std::find(data, end, '\n');
+      buffer[index].append(data, newline);
+      
+      if (newline == end)
+        break;
+      
       if (index < HEIGHT-1)
         ++index;
       else
         shiftUp();
       
-      return;
+      data = newline + 1;
     }
-    
-    buffer[index] += value;
   }
+  
+public:
+  size_t index = 0;
+  
+  /* the console is redrawn only after the VM stepped so lines are just gathered */
+  MyStdOut() : BufferedStdOut(false) { }
 };
 
 static MyStdOut<LOWER_PANEL_HEIGHT-2> sout;
@@ -201,12 +220,14 @@ void UI::updateConsole()
 {
   wclear(wConsole);
   box(wConsole, 0, 0);
+  
+  sout.flush();
   for (int i = 0; i < LOWER_PANEL_HEIGHT-2; ++i)
   {
     mvwprintw(wConsole, 1+i, 1, "%s", sout.buffer[i].c_str());
   }
   
-  mvwprintw(wConsole, LOWER_PANEL_HEIGHT-1, 3, "(S) Step (T) Step x%lu", stepSize);
+  mvwprintw(wConsole, LOWER_PANEL_HEIGHT-1, 3, "(S) Step (T) Step x%lu (B) Breakpoint (C) Continue", stepSize);
   mvwprintw(wConsole, LOWER_PANEL_HEIGHT-1, width - SIDE_PANEL_WIDTH - strlen("(Q) Quit") - 3, "(Q) Quit");
 }
 
@@ -238,6 +259,37 @@ void UI::handleEvents()
       draw();
       break;
     }
+    case 'b':
+    case 'B':
+    {
+      if (vm.isBreakpoint(vm.pc()))
+        vm.clearBreakpoint(vm.pc());
+      else
+        vm.setBreakpoint(vm.pc());
+      draw();
+      break;
+    }
+    case 'c':
+    case 'C':
+    {
+      /* run in slices so that a key press can interrupt a program that never
+         halts, a slice ending on a breakpoint stops there as the next slice
+         would resume past it */
+      VM::RunLimits limits;
+      limits.instructions = stepSize * CONTINUE_SLICE_STEPS;
+      
+      nodelay(stdscr, true);
+      VM::RunResult result;
+      do
+      {
+        result = vm.run(limits);
+        counter += result.instructions;
+      } while (result.reason == VM::StopReason::INSTRUCTION_LIMIT && !vm.isBreakpoint(vm.pc()) && getch() == ERR);
+      nodelay(stdscr, false);
+      
+      draw();
+      break;
+    }
     case '+':
     {
       stepSize <<= 1;